@@ -3,6 +3,7 @@
 #include "src/ConfigFile.h"
 #include "src/FlasherTask.h"
 #include "src/SDStorage.h"
+#include "src/FileIndex.h"
 
 #ifdef ENABLE_WEB_PORTAL
   #include <WiFi.h>
@@ -42,6 +43,7 @@ void setup() {
         Serial.println("Warning: SD Init Failed! Web features requiring SD will not work.");
         // We continue anyway so WiFi/WebPortal can utilize what they can (or allow upload?)
     }
+    Files.begin();
     
     // Initialize Flasher Task
     Flasher.begin();
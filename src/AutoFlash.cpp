@@ -0,0 +1,275 @@
+#include "AutoFlash.h"
+#include "SDStorage.h"
+#include "ConfigFile.h"
+#include "FlashPlan.h"
+#include "esp-loader/esp_loader.h"
+#include "esp-loader/serial_io.h"
+#include <ArduinoJson.h>
+#include <Preferences.h>
+#include "driver/gpio.h"
+
+AutoFlash Auto;
+
+// Indexed by target_chip_t, as the web UI names them
+static const char *CHIP_NAMES[ESP_MAX_CHIP] = {"esp8266", "esp32", "esp32s2", "esp32c3", "esp32s3"};
+
+static const char *STATE_NAMES[] = {"waiting", "flashing", "remove board"};
+
+static void setPin(int pin, bool on) {
+    if (pin >= 0) digitalWrite(pin, on ? HIGH : LOW);
+}
+
+// Whether the flashed board is still in the fixture. Its reset and boot pins
+// are left alone, so it runs the new firmware meanwhile. Without a presence
+// switch the target's TX line tells: a board keeps it high when idle, with
+// the board gone the pull-down set here takes it low.
+static bool boardPresent() {
+    if (FLASHER_AUTO_PRESENCE_PIN >= 0) return digitalRead(FLASHER_AUTO_PRESENCE_PIN) == LOW;
+
+    gpio_num_t rx = (gpio_num_t)TARGET_RX_PIN;
+    gpio_set_pull_mode(rx, GPIO_PULLDOWN_ONLY);
+    delayMicroseconds(50);
+    // The firmware may be sending, a single high sample will do
+    bool high = false;
+    for (int i = 0; i < 8 && !high; i++) {
+        high = gpio_get_level(rx);
+        delayMicroseconds(100);
+    }
+    // As the UART driver set it up
+    gpio_set_pull_mode(rx, GPIO_PULLUP_ONLY);
+    return high;
+}
+
+void AutoFlash::begin() {
+    _lock = xSemaphoreCreateMutex();
+    for (int pin : {FLASHER_AUTO_PASS_PIN, FLASHER_AUTO_FAIL_PIN, FLASHER_AUTO_BUSY_PIN}) {
+        if (pin >= 0) pinMode(pin, OUTPUT);
+    }
+    if (FLASHER_AUTO_PRESENCE_PIN >= 0) pinMode(FLASHER_AUTO_PRESENCE_PIN, INPUT_PULLUP);
+    setPins(false, false, false);
+
+    Preferences prefs;
+    prefs.begin("flasher", true);
+    bool enabled = prefs.getBool("auto", FLASHER_AUTO_FLASH);
+    prefs.end();
+
+    if (enabled) {
+        String error;
+        if (!setEnabled(true, error)) Serial.println("[Auto] Not armed: " + error);
+    }
+}
+
+bool AutoFlash::setEnabled(bool enabled, String &error) {
+    FlashJob recipe;
+    if (enabled && !loadRecipe(recipe, error)) return false;
+
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    if (enabled) _recipe = recipe;
+    _enabled = enabled;
+    // A job already queued still runs and is counted
+    if (_state != BUSY) _state = WAITING;
+    xSemaphoreGive(_lock);
+
+    Preferences prefs;
+    prefs.begin("flasher", false);
+    prefs.putBool("auto", enabled);
+    prefs.end();
+
+    setPins(false, false, false);
+    if (enabled) {
+        Serial.println("[Auto] Armed: " + recipe.summary);
+        Flasher.setStatus("Auto: waiting for board");
+    } else {
+        Serial.println("[Auto] Off");
+        Flasher.setStatus("Ready");
+    }
+    return true;
+}
+
+bool AutoFlash::loadRecipe(FlashJob &recipe, String &error) {
+    File file = SDStorage.openFile(FLASHER_AUTO_MANIFEST);
+    if (!file) {
+        error = "No " FLASHER_AUTO_MANIFEST;
+        return false;
+    }
+    DynamicJsonDocument doc(file.size() + 1024);
+    DeserializationError jsonError = deserializeJson(doc, file);
+    file.close();
+    if (jsonError) {
+        error = String("Manifest: ") + jsonError.c_str();
+        return false;
+    }
+
+    recipe.type = JOB_WRITE;
+    recipe.target = doc["target"].as<String>();
+    for (int chip = 0; chip < ESP_MAX_CHIP; chip++) {
+        if (recipe.target == CHIP_NAMES[chip]) recipe.chip = (target_chip_t)chip;
+    }
+    if (recipe.chip == ESP_UNKNOWN_CHIP) {
+        error = "Manifest: unknown target '" + recipe.target + "'";
+        return false;
+    }
+
+    for (JsonObject f : doc["files"].as<JsonArray>()) {
+        FlashFile ff;
+        ff.name = f["name"].as<String>();
+        ff.address = (uint32_t) strtol(f["address"].as<String>().c_str(), NULL, 0);
+        recipe.files.push_back(ff);
+    }
+    if (recipe.files.empty()) {
+        error = "Manifest: no files";
+        return false;
+    }
+
+    if (doc.containsKey("compress")) recipe.options.compress = doc["compress"].as<bool>();
+    if (doc.containsKey("verify")) recipe.options.verify = doc["verify"].as<bool>();
+    if (doc.containsKey("delta")) recipe.options.delta = doc["delta"].as<bool>();
+    if (doc.containsKey("sparse")) recipe.options.sparse = doc["sparse"].as<bool>();
+    if (doc["gang"].as<bool>()) {
+        error = "Manifest: gang jobs are not supported, only the first port is probed";
+        return false;
+    }
+
+    // Same checks the job runs, so a bad manifest fails now rather than per board
+    FlashPlan plan;
+    String planError;
+    if (!plan.build(recipe.files, planError)) {
+        error = "Manifest: " + planError;
+        return false;
+    }
+
+    recipe.summary = "Auto " + recipe.target + ":";
+    for (const auto &f : recipe.files) {
+        recipe.summary += " " + f.name + "@0x" + String(f.address, HEX);
+    }
+    return true;
+}
+
+void AutoFlash::poll() {
+    if (!_enabled) return;
+
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    State state = _state;
+    xSemaphoreGive(_lock);
+    if (state == BUSY) return; // Queued behind other jobs
+
+    if (state == REMOVE) {
+        // No probe, a sync would reset the flashed board into the bootloader
+        _misses = boardPresent() ? 0 : _misses + 1;
+        if (_misses >= FLASHER_AUTO_GONE_PROBES) {
+            setState(WAITING);
+            setPins(false, false, false);
+            Flasher.setStatus("Auto: waiting for board");
+        }
+        return;
+    }
+
+    // A failed job may have left the port at a higher rate
+    loader_port_change_baudrate(FLASHER_BAUD_RATE);
+    if (esp_loader_probe(FLASHER_AUTO_SYNC_TIMEOUT) != ESP_LOADER_SUCCESS) return;
+
+    uint32_t now = millis();
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    FlashJob *job = new FlashJob(_recipe);
+    if (_lastDetected) {
+        _totalPitchMs += now - _lastDetected;
+        _pitches++;
+    }
+    _lastDetected = now;
+    _detected = now;
+    xSemaphoreGive(_lock);
+
+    Serial.println("[Auto] Board detected");
+    setPins(true, false, false);
+    uint32_t id = Jobs.submit(job);
+
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    _jobId = id;
+    _state = id ? BUSY : REMOVE;
+    _misses = 0;
+    xSemaphoreGive(_lock);
+
+    if (!id) {
+        setPins(false, false, true);
+        Flasher.setStatus("Auto: job queue full, remove board");
+    }
+}
+
+void AutoFlash::finished(const FlashJob *job, bool success, const String &result, const uint8_t mac[6]) {
+    if (!job) return;
+
+    uint32_t now = millis();
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    if (_jobId == 0 || job->id != _jobId) {
+        xSemaphoreGive(_lock);
+        return;
+    }
+
+    Board board;
+    board.success = success;
+    board.result = result;
+    board.cycleMs = now - _detected;
+    if (mac[0] | mac[1] | mac[2] | mac[3] | mac[4] | mac[5]) {
+        char text[18];
+        snprintf(text, sizeof(text), "%02x:%02x:%02x:%02x:%02x:%02x",
+                 mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+        board.mac = text;
+    }
+
+    _boards++;
+    if (success) _passed++;
+    _lastMs = board.cycleMs;
+    _minMs = _boards == 1 ? board.cycleMs : min(_minMs, board.cycleMs);
+    _maxMs = max(_maxMs, board.cycleMs);
+    _totalMs += board.cycleMs;
+    _recent.push_back(board);
+    if (_recent.size() > FLASHER_AUTO_RECENT) _recent.erase(_recent.begin());
+
+    _jobId = 0;
+    _misses = 0;
+    _state = REMOVE;
+    xSemaphoreGive(_lock);
+
+    setPins(false, success, !success);
+    Serial.printf("[Auto] Board %s %s in %u ms (%u/%u passed)\n",
+                  board.mac.length() ? board.mac.c_str() : "?", success ? "PASS" : "FAIL",
+                  board.cycleMs, _passed, _boards);
+    Flasher.setStatus(String("Auto: ") + (success ? "PASS" : "FAIL: " + result) + ", remove board");
+}
+
+AutoFlash::Stats AutoFlash::stats() {
+    Stats s = {};
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    s.enabled = _enabled;
+    s.state = _enabled || _state == BUSY ? STATE_NAMES[_state] : "off";
+    s.recipe = _recipe.summary;
+    s.boards = _boards;
+    s.passed = _passed;
+    s.failed = _boards - _passed;
+    s.lastMs = _lastMs;
+    s.minMs = _minMs;
+    s.maxMs = _maxMs;
+    s.avgMs = _boards ? _totalMs / _boards : 0;
+    s.pitchMs = _pitches ? _totalPitchMs / _pitches : 0;
+    xSemaphoreGive(_lock);
+    return s;
+}
+
+std::vector<AutoFlash::Board> AutoFlash::recent() {
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    std::vector<Board> copy = _recent;
+    xSemaphoreGive(_lock);
+    return copy;
+}
+
+void AutoFlash::setPins(bool busy, bool pass, bool fail) {
+    setPin(FLASHER_AUTO_BUSY_PIN, busy);
+    setPin(FLASHER_AUTO_PASS_PIN, pass);
+    setPin(FLASHER_AUTO_FAIL_PIN, fail);
+}
+
+void AutoFlash::setState(State state) {
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    _state = state;
+    xSemaphoreGive(_lock);
+}
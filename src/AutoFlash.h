@@ -0,0 +1,81 @@
+#ifndef AUTO_FLASH_H
+#define AUTO_FLASH_H
+
+#include <Arduino.h>
+#include <vector>
+#include "JobQueue.h"
+
+// Production line mode. While the job queue is idle the flasher task probes
+// the target port with a single sync command; a board that answers gets the
+// recipe from FLASHER_AUTO_MANIFEST queued as a normal job. The result is
+// shown on the pass/fail pins, and the next board is only picked up after
+// this one stopped answering (was removed).
+class AutoFlash {
+public:
+    struct Board {
+        String mac;       // Empty if the board never connected
+        bool success;
+        String result;
+        uint32_t cycleMs; // Detection to result
+    };
+
+    struct Stats {
+        bool enabled;
+        String state;
+        String recipe;
+        uint32_t boards;
+        uint32_t passed;
+        uint32_t failed;
+        uint32_t lastMs;  // Cycle times, detection to result
+        uint32_t minMs;
+        uint32_t maxMs;
+        uint32_t avgMs;
+        uint32_t pitchMs; // Average time from one detection to the next
+    };
+
+    // Sets up the pins and restores the mode from NVS
+    void begin();
+
+    // Arming loads and checks the manifest, error says why it was refused.
+    // The manifest is read once here, rearm after changing it.
+    bool setEnabled(bool enabled, String &error);
+    bool enabled() const { return _enabled; }
+
+    // Flasher task side. poll() runs one probe whenever no job was due,
+    // finished() gets every job that ends.
+    void poll();
+    void finished(const FlashJob *job, bool success, const String &result, const uint8_t mac[6]);
+
+    Stats stats();
+    std::vector<Board> recent();
+
+private:
+    enum State { WAITING, BUSY, REMOVE };
+
+    bool loadRecipe(FlashJob &recipe, String &error);
+    void setPins(bool busy, bool pass, bool fail);
+    void setState(State state);
+
+    SemaphoreHandle_t _lock = NULL;
+    volatile bool _enabled = false;
+    State _state = WAITING;
+    FlashJob _recipe;
+    uint32_t _jobId = 0;
+    uint32_t _misses = 0;
+    uint32_t _detected = 0;    // millis() of the current board
+    uint32_t _lastDetected = 0;
+
+    uint32_t _boards = 0;
+    uint32_t _passed = 0;
+    uint32_t _minMs = 0;
+    uint32_t _maxMs = 0;
+    uint32_t _lastMs = 0;
+    uint64_t _totalMs = 0;
+    uint64_t _totalPitchMs = 0;
+    uint32_t _pitches = 0;
+    std::vector<Board> _recent; // Oldest first
+};
+
+extern AutoFlash Auto;
+
+#endif
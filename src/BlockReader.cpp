@@ -0,0 +1,117 @@
+#include "BlockReader.h"
+
+bool BlockReader::begin(uint32_t blockSize, size_t depth) {
+    if (_task) return true;
+
+    if (!_pool.begin(depth, blockSize)) return false;
+    if (!_idle) _idle = xSemaphoreCreateBinary();
+    if (!_idle) return false;
+
+    // Storage reads and hashing, neither cares which core it runs on
+    return xTaskCreatePinnedToCore(readerTask, "BlockReader", 4096, this, 1, &_task, tskNO_AFFINITY) == pdPASS;
+}
+
+void BlockReader::start(ImageFile &file, uint32_t offset, uint32_t size, uint32_t blockSize, MD5Context *md5) {
+    _file = &file;
+    _offset = offset;
+    _size = size;
+    _blockSize = blockSize;
+    _md5 = md5;
+    _abort = false;
+
+    _mapped = file.data();
+    if (_mapped) {
+        _done = 0;
+        _tail = nullptr;
+        return;
+    }
+    xTaskNotifyGive(_task);
+}
+
+uint8_t *BlockReader::nextMapped(size_t *len) {
+    *len = min(_blockSize, _size - _done);
+    const uint8_t *data = _mapped + _offset + _done;
+    _done += *len;
+    if (_md5) MD5Update(_md5, data, *len);
+
+    if (*len == _blockSize) return (uint8_t *)data;
+
+    // Padded by the loader, which must not write to the image
+    _pool.take(&_tail, portMAX_DELAY);
+    memcpy(_tail, data, *len);
+    return _tail;
+}
+
+void BlockReader::readerTask(void *pvParameters) {
+    BlockReader *reader = (BlockReader *)pvParameters;
+
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        reader->readSegment();
+        xSemaphoreGive(reader->_idle);
+    }
+}
+
+// An image cache miss copies each block into PSRAM as it is read here, see
+// ImageFile::fillCache()
+void BlockReader::readSegment() {
+    _file->seek(_offset);
+
+    uint32_t done = 0;
+    while (done < _size && !_abort) {
+        BufferPool::Block block;
+        if (!_pool.take(&block.data, 0)) {
+            _readerStalls++;
+            _pool.take(&block.data, portMAX_DELAY);
+        }
+        if (_abort) {
+            _pool.give(block.data);
+            break;
+        }
+
+        block.len = _file->read(block.data, min(_blockSize, _size - done));
+        if (block.len == 0) {
+            // Flasher sees the failed read and stops taking blocks
+            _pool.give(block.data);
+            block.data = nullptr;
+            _pool.push(block);
+            break;
+        }
+        if (_md5) MD5Update(_md5, block.data, block.len);
+
+        _pool.push(block);
+        done += block.len;
+    }
+}
+
+uint8_t *BlockReader::next(size_t *len) {
+    if (_mapped) return nextMapped(len);
+
+    BufferPool::Block block;
+    if (!_pool.pop(&block, 0)) {
+        _senderStalls++;
+        _pool.pop(&block, portMAX_DELAY);
+    }
+    *len = block.data ? block.len : 0;
+    return block.data;
+}
+
+void BlockReader::release(uint8_t *block) {
+    if (_mapped && block != _tail) return;
+    _pool.give(block);
+    _tail = nullptr;
+}
+
+void BlockReader::stop() {
+    if (_mapped) {
+        release(_tail);
+        _mapped = nullptr;
+        return;
+    }
+    _abort = true;
+
+    // Blocks still queued go back to the pool, which also wakes a reader
+    // waiting for a free buffer so it can see the abort
+    while (xSemaphoreTake(_idle, pdMS_TO_TICKS(1)) != pdTRUE) _pool.reclaim();
+    _pool.reclaim();
+}
@@ -0,0 +1,65 @@
+#ifndef BLOCK_READER_H
+#define BLOCK_READER_H
+
+#include <Arduino.h>
+#include "ImageCache.h"
+#include "BufferPool.h"
+#include "esp-loader/md5_hash.h"
+
+// Reads image data ahead of the flasher on a task of its own, so storage
+// reads and MD5 hashing overlap with the UART transfer. Blocks circulate
+// through a small pool: the reader fills free buffers and queues them in
+// file order, the flasher takes them and hands them back once sent.
+// Images already in memory skip the task and the copy, blocks then point
+// straight into the image.
+class BlockReader {
+public:
+    // Allocates depth buffers of blockSize bytes and starts the reader task.
+    // Returns false if out of memory.
+    bool begin(uint32_t blockSize, size_t depth);
+
+    // Starts reading size bytes from offset of file in blocks of blockSize
+    // (at most the size given to begin()). md5, if set, is updated with all
+    // data read. file and md5 must not be used until stop().
+    void start(ImageFile &file, uint32_t offset, uint32_t size, uint32_t blockSize, MD5Context *md5);
+
+    // Next block in file order, waits for the reader if none is ready.
+    // Returns nullptr with len 0 on a read error. Blocks shorter than
+    // blockSize are always pool buffers, so the loader can pad them in place.
+    uint8_t *next(size_t *len);
+    void release(uint8_t *block);
+
+    // Waits for the reader to finish or abandon the segment and takes back
+    // all buffers. To be called after every start(), also on errors.
+    void stop();
+
+    // Times the reader found no free buffer (flasher is the bottleneck) and
+    // the flasher found no block ready (storage is the bottleneck)
+    uint32_t readerStalls() { return _readerStalls; }
+    uint32_t senderStalls() { return _senderStalls; }
+    void resetStalls() { _readerStalls = 0; _senderStalls = 0; }
+
+private:
+    static void readerTask(void *pvParameters);
+    void readSegment();
+    uint8_t *nextMapped(size_t *len);
+
+    TaskHandle_t _task = NULL;
+    BufferPool _pool;
+    SemaphoreHandle_t _idle = NULL;
+
+    ImageFile *_file = nullptr;
+    uint32_t _offset = 0;
+    uint32_t _size = 0;
+    uint32_t _blockSize = 0;
+    MD5Context *_md5 = nullptr;
+    const uint8_t *_mapped = nullptr; // Image in memory, read without the task
+    uint32_t _done = 0;
+    uint8_t *_tail = nullptr;         // Pool buffer holding a short last block
+    volatile bool _abort = false;
+
+    volatile uint32_t _readerStalls = 0;
+    volatile uint32_t _senderStalls = 0;
+};
+
+#endif
@@ -0,0 +1,56 @@
+#include "BufferPool.h"
+
+bool BufferPool::begin(size_t count, size_t size, size_t extra) {
+    if (_free) return true;
+
+    _free = xQueueCreate(count, sizeof(uint8_t *));
+    _full = xQueueCreate(count + extra, sizeof(Block));
+    if (!_free || !_full) {
+        release();
+        return false;
+    }
+    for (size_t i = 0; i < count; i++) {
+        uint8_t *buffer = (uint8_t *)malloc(size);
+        if (!buffer) {
+            release();
+            return false;
+        }
+        xQueueSend(_free, &buffer, 0);
+    }
+    return true;
+}
+
+// Frees a partial allocation, all buffers are still in _free then
+void BufferPool::release() {
+    if (_free) {
+        uint8_t *buffer;
+        while (xQueueReceive(_free, &buffer, 0) == pdTRUE) free(buffer);
+        vQueueDelete(_free);
+        _free = NULL;
+    }
+    if (_full) {
+        vQueueDelete(_full);
+        _full = NULL;
+    }
+}
+
+bool BufferPool::take(uint8_t **buffer, TickType_t wait) {
+    return xQueueReceive(_free, buffer, wait) == pdTRUE;
+}
+
+void BufferPool::give(uint8_t *buffer) {
+    if (buffer) xQueueSend(_free, &buffer, 0);
+}
+
+void BufferPool::push(const Block &block) {
+    xQueueSend(_full, &block, 0);
+}
+
+bool BufferPool::pop(Block *block, TickType_t wait) {
+    return xQueueReceive(_full, block, wait) == pdTRUE;
+}
+
+void BufferPool::reclaim() {
+    Block block;
+    while (xQueueReceive(_full, &block, 0) == pdTRUE) give(block.data);
+}
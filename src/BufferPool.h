@@ -0,0 +1,41 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <Arduino.h>
+
+// Fixed set of equal buffers passed between a producer and a consumer. The
+// producer takes free buffers, fills them and pushes them in order, the
+// consumer pops them and gives them back. Allocated once and kept; a pool
+// that could not be allocated in full holds nothing.
+class BufferPool {
+public:
+    struct Block {
+        uint8_t *data;  // nullptr for markers the users agree on
+        size_t len;
+    };
+
+    // count buffers of size bytes. The queue of filled blocks has room for
+    // extra markers besides them. True right away if allocated already.
+    bool begin(size_t count, size_t size, size_t extra = 0);
+    bool ready() const { return _free != NULL; }
+
+    // Free buffer, false if none came within wait
+    bool take(uint8_t **buffer, TickType_t wait);
+    void give(uint8_t *buffer);
+    size_t available() const { return uxQueueMessagesWaiting(_free); }
+
+    // Never waits for room, the queue holds every buffer and the markers
+    void push(const Block &block);
+    // Next filled block in order, false if none came within wait
+    bool pop(Block *block, TickType_t wait);
+    // Filled blocks not popped yet go back to the free buffers
+    void reclaim();
+
+private:
+    void release();
+
+    QueueHandle_t _free = NULL;
+    QueueHandle_t _full = NULL;
+};
+
+#endif
@@ -9,10 +9,17 @@
 // --- Storage Configuration ---
 // Comment out the line below to use SPIFFS (Internal Flash) instead of SD Card
 // #define USE_SD_CARD 
+#define FLASHER_FILE_INDEX "/files.idx" // Metadata of the .bin files, see FileIndex
+#define FLASHER_INDEX_JOURNAL 256 // Changes appended to the index before it is written anew
+#define FLASHER_UPLOAD_BUFFER 16384 // Uploads are written in pieces of this size (a multiple of 4KB sectors), see UploadWriter
+#define FLASHER_UPLOAD_BUFFERS 3    // Pieces an upload can be ahead of storage
+#define FLASHER_SCAN_DEPTH 4  // Folder levels below the root searched for .bin files
+#define FLASHER_SCAN_MAX 4096 // Files a rescan looks at before it gives up
 
 // --- Web Portal Configuration ---
 // Comment out the line below to DISABLE the Web Portal and WiFi
 #define ENABLE_WEB_PORTAL 
+#define WEB_PUSH_INTERVAL_MS 250 // Status, progress and log changes are pushed to /events at most this often
 
 // --- OTA Configuration ---
 #if __has_include("Version.h")
@@ -49,9 +56,66 @@
 #define TARGET_RX_PIN  17  // Connect to Target TX
 #define TARGET_RST_PIN 1   // Connect to Target RST
 #define TARGET_BOOT_PIN 2  // Connect to Target GPIO0
+#define TARGET_UART_PORT 2         // UART driven by the ESP-IDF driver (not used as Serial2 then)
+#define TARGET_UART_RX_BUFFER 4096  // Driver ring buffers, bytes
+#define TARGET_UART_TX_BUFFER 4096
+#define TARGET_UART_RX_TIMEOUT 2    // Idle symbols before received bytes are reported
+
+// --- Gang Programming ---
+// Further target ports, flashed together with the one above by jobs started in
+// gang mode: {uart, tx, rx, rst, boot} each. ESP32-S3 has UART0-2, UART0 is the console.
+// None by default, every port listed takes its UART and pins at boot, e.g.
+// #define FLASHER_GANG_PORTS { {1, 15, 16, 8, 9} }
+#define FLASHER_GANG_PORTS {}
+
+// --- Pinned Images ---
+// Data partition of the host's flash that images can be copied to, see README
+#define FLASHER_PIN_PARTITION "images"
+#define FLASHER_PIN_MAX 32 // Images the partition index holds
+
+// --- Production Line (Auto-Flash) ---
+// Headless mode: every board attached to the target port gets the recipe in
+// FLASHER_AUTO_MANIFEST (same JSON as a /flash request), see README
+#define FLASHER_AUTO_FLASH false     // Armed at boot, until changed through /auto (kept in NVS)
+#define FLASHER_AUTO_MANIFEST "/autoflash.json"
+#define FLASHER_AUTO_PROBE_MS 250    // Pause between probes while the queue is idle
+#define FLASHER_AUTO_SYNC_TIMEOUT 50 // Wait for the sync response of a probe (ms)
+#define FLASHER_AUTO_GONE_PROBES 3   // Checks in a row without a board before it counts as removed
+#define FLASHER_AUTO_PRESENCE_PIN -1 // Fixture switch, LOW while a board sits in it; -1 senses the target's TX line
+#define FLASHER_AUTO_PASS_PIN -1     // Result outputs, active high, -1 for none
+#define FLASHER_AUTO_FAIL_PIN -1
+#define FLASHER_AUTO_BUSY_PIN -1
+#define FLASHER_AUTO_RECENT 20       // Boards kept for /auto
+
+// --- Activity Log ---
+#define FLASHER_LOG_LINES 256 // Lines kept for /logs, older ones are overwritten
+#define FLASHER_LOG_LINE 120  // Longer lines are cut
+
+// --- Job Queue ---
+#define FLASHER_JOB_QUEUE 8         // Jobs waiting behind the running one
+#define FLASHER_JOB_HISTORY 50      // Finished jobs kept in FLASHER_JOB_FILE
+#define FLASHER_JOB_FILE "/jobs.log"
 
 // --- Flasher Settings ---
 #define FLASHER_BAUD_RATE 115200
-#define FLASHER_HIGHER_BAUD 230400 // or 460800, 921600
+// Rates tried after connecting, highest first. The best rate each fixture reaches
+// is kept in NVS and later jobs start from it, for FLASHER_BAUD_RETRY jobs when it
+// is below the top; then the whole ladder is tried again.
+#define FLASHER_BAUD_LADDER {2000000, 921600, 460800, 230400}
+#define FLASHER_BAUD_RETRY 20
+#define FLASHER_BLOCK_SIZE 4096
+#define FLASHER_USE_STUB true // Run esptool's flasher stub (stub_flasher_*.json on storage) instead of the ROM loader
+#define FLASHER_STUB_BLOCK_SIZE 16384
+#define FLASHER_READ_AHEAD 3   // Blocks read from storage ahead of the UART, each takes FLASHER_STUB_BLOCK_SIZE of RAM
+#define FLASHER_STREAM_DEPTH 6 // Blocks of a /flash_stream upload buffered ahead of the UART, FLASHER_STUB_BLOCK_SIZE each
+#define FLASHER_STREAM_WAIT_MS 4000 // Longest the flasher waits for /flash_stream data before failing the job
+#define FLASHER_IMAGE_CACHE_SIZE (4 * 1024 * 1024) // PSRAM keeping recent images, capped at half the PSRAM
+#define FLASHER_COMPRESS true // Deflate images on the host, cuts UART traffic (falls back to raw on ESP8266)
+#define FLASHER_VERIFY true   // Check every written image against the target's flash MD5
+#define FLASHER_DELTA true    // Only rewrite regions whose flash MD5 differs from the image
+#define FLASHER_DELTA_REGION_SIZE 0x10000 // Compare granularity, multiple of the 4KB sector
+#define FLASHER_SPARSE true   // Only erase runs of 0xFF in images instead of sending them
+#define FLASHER_SPARSE_MIN_GAP 0x4000 // Shorter 0xFF runs are sent with the surrounding data
+#define FLASHER_MERGE_GAP 0      // Files this close (past the sector one ends in) share an erase session, the gap is erased
 
 #endif
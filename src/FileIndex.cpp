@@ -0,0 +1,420 @@
+#include "FileIndex.h"
+#include "SDStorage.h"
+#include "ConfigFile.h"
+#include <ArduinoJson.h>
+#include <algorithm>
+
+FileIndex Files;
+
+// New index while it is written, renamed to FLASHER_FILE_INDEX when complete
+static const char *INDEX_TEMP = FLASHER_FILE_INDEX ".new";
+
+static const uint8_t IMAGE_MAGIC = 0xE9;        // esptool image, ESP8266 and ESP32 family
+static const uint8_t IMAGE_MAGIC_V2 = 0xEA;     // ESP8266 OTA image
+static const uint16_t PARTITION_MAGIC = 0x50AA; // First entry of a partition table
+
+// Chip IDs of the extended image header (esptool's IMAGE_CHIP_ID)
+static const struct {
+    uint16_t id;
+    const char *name;
+} IMAGE_CHIPS[] = {
+    {0, "esp32"}, {2, "esp32s2"}, {5, "esp32c3"}, {9, "esp32s3"},
+    {12, "esp32c2"}, {13, "esp32c6"}, {16, "esp32h2"},
+};
+
+static void toHex(const uint8_t *data, size_t len, char *out) {
+    for (size_t i = 0; i < len; i++) sprintf(out + 2 * i, "%02x", data[i]);
+}
+
+static bool fromHex(const char *text, uint8_t *data, size_t len) {
+    if (!text || strlen(text) != 2 * len) return false;
+    for (size_t i = 0; i < len; i++) {
+        char byte[3] = {text[2 * i], text[2 * i + 1], 0};
+        data[i] = strtoul(byte, NULL, 16);
+    }
+    return true;
+}
+
+String FileIndex::relative(const String &path) {
+    return path.startsWith("/") ? path.substring(1) : path;
+}
+
+void FileIndex::detect(FileInfo &info, const uint8_t *header, size_t len) {
+    info.type = "data";
+    info.chip = "";
+    info.segments = 0;
+    if (len >= 2 && (header[0] | header[1] << 8) == PARTITION_MAGIC) {
+        info.type = "partitions";
+        return;
+    }
+    if (len < HEADER_SIZE || (header[0] != IMAGE_MAGIC && header[0] != IMAGE_MAGIC_V2)) return;
+
+    info.type = "image";
+    info.segments = header[1];
+    if (header[0] == IMAGE_MAGIC_V2) {
+        info.chip = "esp8266";
+        return;
+    }
+    // The ESP32 family adds an extended header with the chip ID and reserved
+    // zero bytes, on ESP8266 the first segment starts there
+    uint16_t chipId = header[12] | header[13] << 8;
+    bool reserved = !header[19] && !header[20] && !header[21] && !header[22];
+    for (const auto &chip : IMAGE_CHIPS) {
+        if (reserved && chip.id == chipId) {
+            info.chip = chip.name;
+            return;
+        }
+    }
+    if (!reserved) info.chip = "esp8266";
+}
+
+// Fills size, mtime and the header fields from the file on storage
+bool FileIndex::stat(FileInfo &info, const uint8_t *header, size_t headerLen) {
+    File file = SDStorage.openFile(("/" + info.name).c_str());
+    if (!file || file.isDirectory()) return false;
+    info.size = file.size();
+    info.mtime = file.getLastWrite();
+
+    uint8_t buffer[HEADER_SIZE];
+    if (!header) {
+        headerLen = file.read(buffer, sizeof(buffer));
+        header = buffer;
+    }
+    file.close();
+    detect(info, header, headerLen);
+    return true;
+}
+
+void FileIndex::toJson(const FileInfo &info, JsonDocument &doc) {
+    doc["name"] = info.name;
+    doc["size"] = info.size;
+    doc["mtime"] = info.mtime;
+    if (info.hasDigest) {
+        char md5[33];
+        toHex(info.md5, sizeof(info.md5), md5);
+        doc["md5"] = md5;
+    }
+    doc["type"] = info.type;
+    if (info.chip.length()) doc["chip"] = info.chip;
+    if (info.segments) doc["segments"] = info.segments;
+}
+
+bool FileIndex::fromJson(const JsonDocument &doc, FileInfo &info) {
+    info.name = doc["name"].as<String>();
+    if (!info.name.length()) return false;
+    info.size = doc["size"] | 0;
+    info.mtime = doc["mtime"] | 0;
+    info.hasDigest = fromHex(doc["md5"], info.md5, sizeof(info.md5));
+    info.chip = doc["chip"] | "";
+    info.segments = doc["segments"] | 0;
+    info.type = "data";
+    for (const char *type : {"image", "partitions"}) {
+        if (strcmp(doc["type"] | "", type) == 0) info.type = type;
+    }
+    return true;
+}
+
+void FileIndex::begin() {
+    _lock = xSemaphoreCreateMutex();
+    _writeLock = xSemaphoreCreateMutex();
+
+    if (load(FLASHER_FILE_INDEX)) {
+        // Left over by a save cut short
+        SDStorage.remove(INDEX_TEMP);
+    } else if (load(INDEX_TEMP)) {
+        // Reset between removing the old index and renaming the new one
+        SDStorage.remove(FLASHER_FILE_INDEX);
+        _saved = SDStorage.rename(INDEX_TEMP, FLASHER_FILE_INDEX);
+    } else {
+        rescan();
+        return;
+    }
+    Serial.printf("[Files] %u files in index, %u changes journaled\n", _files.size(), _journal);
+    if (!_saved || _journal >= FLASHER_INDEX_JOURNAL) save();
+}
+
+// Takes the index at path if it is complete, i.e. has the end line, then
+// replays the journal after it. A journal line cut short does not parse and
+// is dropped with the change it held.
+bool FileIndex::load(const char *path) {
+    File file = SDStorage.openFile(path);
+    if (!file) return false;
+
+    std::vector<FileInfo> files;
+    bool complete = false;
+    while (file.available()) {
+        String line = file.readStringUntil('\n');
+        StaticJsonDocument<384> doc;
+        if (deserializeJson(doc, line)) continue;
+        if (doc.containsKey("end")) {
+            complete = doc["end"] == files.size();
+            break;
+        }
+        FileInfo info;
+        if (fromJson(doc, info)) files.push_back(info);
+    }
+    if (!complete) {
+        file.close();
+        Serial.printf("[Files] %s is incomplete, not used\n", path);
+        return false;
+    }
+
+    // Written sorted, but a hand-edited index should not break lookups
+    std::sort(files.begin(), files.end(), [](const FileInfo &a, const FileInfo &b) {
+        return a.name < b.name;
+    });
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    _files.swap(files);
+    xSemaphoreGive(_lock);
+
+    _journal = 0;
+    while (file.available()) {
+        String line = file.readStringUntil('\n');
+        StaticJsonDocument<384> doc;
+        if (deserializeJson(doc, line)) continue;
+        FileInfo info;
+        if (doc.containsKey("del")) erase(doc["del"].as<String>());
+        else if (fromJson(doc, info)) put(info);
+        _journal++;
+    }
+    file.close();
+    _saved = true;
+    return true;
+}
+
+void FileIndex::rescan() {
+    std::vector<FileInfo> files;
+    bool complete = SDStorage.walk("/", FLASHER_SCAN_DEPTH, FLASHER_SCAN_MAX, [&](File &file, const String &path) {
+        if (!path.endsWith(".bin")) return;
+        FileInfo info;
+        info.name = path;
+        info.size = file.size();
+        info.mtime = file.getLastWrite();
+        info.hasDigest = false;
+        uint8_t header[HEADER_SIZE];
+        detect(info, header, file.read(header, sizeof(header)));
+        files.push_back(info);
+    });
+    if (!complete) Serial.printf("[Files] Scan stopped after %u files, see FLASHER_SCAN_MAX\n", FLASHER_SCAN_MAX);
+    std::sort(files.begin(), files.end(), [](const FileInfo &a, const FileInfo &b) {
+        return a.name < b.name;
+    });
+
+    xSemaphoreTake(_writeLock, portMAX_DELAY);
+    // Digests cannot be recomputed cheaply, keep those of unchanged files
+    for (auto &info : files) {
+        bool found;
+        int i = locate(info.name, &found);
+        if (found && _files[i].hasDigest && _files[i].size == info.size && _files[i].mtime == info.mtime) {
+            info.hasDigest = true;
+            memcpy(info.md5, _files[i].md5, sizeof(info.md5));
+        }
+    }
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    _files.swap(files);
+    xSemaphoreGive(_lock);
+    save();
+    Serial.printf("[Files] Rescanned, %u files\n", _files.size());
+    xSemaphoreGive(_writeLock);
+}
+
+// Only called from the web server, so the flag needs no lock
+bool FileIndex::startRescan() {
+    if (_scanning) return false;
+    _scanning = true;
+    if (xTaskCreatePinnedToCore(scanTask, "FileScan", 6144, this, 1, NULL, tskNO_AFFINITY) != pdPASS) {
+        _scanning = false;
+        return false;
+    }
+    return true;
+}
+
+void FileIndex::scanTask(void *pvParameters) {
+    FileIndex *index = (FileIndex *)pvParameters;
+    index->rescan();
+    index->_scanning = false;
+    vTaskDelete(NULL);
+}
+
+void FileIndex::update(const String &name, const uint8_t *header, size_t headerLen, const uint8_t *md5) {
+    FileInfo info;
+    info.name = relative(name);
+    if (!info.name.endsWith(".bin")) return;
+    if (!stat(info, header, headerLen)) {
+        remove(info.name);
+        return;
+    }
+    info.hasDigest = md5 != nullptr;
+    if (md5) memcpy(info.md5, md5, sizeof(info.md5));
+
+    StaticJsonDocument<384> doc;
+    toJson(info, doc);
+    xSemaphoreTake(_writeLock, portMAX_DELAY);
+    put(info);
+    journal(doc);
+    xSemaphoreGive(_writeLock);
+}
+
+void FileIndex::remove(const String &name) {
+    StaticJsonDocument<256> doc;
+    doc["del"] = relative(name);
+    xSemaphoreTake(_writeLock, portMAX_DELAY);
+    if (erase(relative(name))) journal(doc);
+    xSemaphoreGive(_writeLock);
+}
+
+void FileIndex::rename(const String &from, const String &to) {
+    xSemaphoreTake(_writeLock, portMAX_DELAY);
+    bool found;
+    int i = locate(relative(from), &found);
+    if (!found) {
+        xSemaphoreGive(_writeLock);
+        // Not indexed yet, e.g. copied onto the card by hand
+        update(to);
+        return;
+    }
+    FileInfo info = _files[i];
+    erase(info.name);
+    StaticJsonDocument<256> gone;
+    gone["del"] = info.name;
+    journal(gone);
+
+    info.name = relative(to);
+    if (info.name.endsWith(".bin")) {
+        StaticJsonDocument<384> doc;
+        toJson(info, doc);
+        put(info);
+        journal(doc);
+    }
+    xSemaphoreGive(_writeLock);
+}
+
+size_t FileIndex::page(const String &prefix, size_t offset, size_t limit, std::vector<FileInfo> &out,
+                       bool direct) {
+    // Files of a subfolder sort in between, skip them
+    size_t dirLen = prefix.lastIndexOf('/') + 1;
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    bool found;
+    size_t i = locate(prefix, &found);
+    size_t matches = 0;
+    for (; i < _files.size() && _files[i].name.startsWith(prefix); i++) {
+        if (direct && _files[i].name.indexOf('/', dirLen) >= 0) continue;
+        if (matches >= offset && out.size() < limit) out.push_back(_files[i]);
+        matches++;
+    }
+    xSemaphoreGive(_lock);
+    return matches;
+}
+
+std::vector<String> FileIndex::folders(const String &dir) {
+    String prefix = dir.length() ? dir + "/" : "";
+    std::vector<String> names;
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    bool found;
+    size_t i = locate(prefix, &found);
+    for (; i < _files.size() && _files[i].name.startsWith(prefix); i++) {
+        int slash = _files[i].name.indexOf('/', prefix.length());
+        if (slash < 0) continue;
+        // Sorted, so a folder's files follow each other
+        String name = _files[i].name.substring(prefix.length(), slash);
+        if (names.empty() || names.back() != name) names.push_back(name);
+    }
+    xSemaphoreGive(_lock);
+    return names;
+}
+
+bool FileIndex::find(const String &path, FileInfo &info) {
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    bool found;
+    int i = locate(relative(path), &found);
+    if (found) info = _files[i];
+    xSemaphoreGive(_lock);
+    return found;
+}
+
+// First entry not less than name. _lock or _writeLock held.
+int FileIndex::locate(const String &name, bool *found) {
+    auto it = std::lower_bound(_files.begin(), _files.end(), name, [](const FileInfo &info, const String &name) {
+        return info.name < name;
+    });
+    *found = it != _files.end() && it->name == name;
+    return it - _files.begin();
+}
+
+// Adds or replaces the entry of info.name. _writeLock held.
+void FileIndex::put(const FileInfo &info) {
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    bool found;
+    int i = locate(info.name, &found);
+    if (found) _files[i] = info;
+    else _files.insert(_files.begin() + i, info);
+    xSemaphoreGive(_lock);
+}
+
+// False if name is not indexed. _writeLock held.
+bool FileIndex::erase(const String &name) {
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    bool found;
+    int i = locate(name, &found);
+    if (found) _files.erase(_files.begin() + i);
+    xSemaphoreGive(_lock);
+    return found;
+}
+
+// Appends one change to the index, or writes it anew once the journal is
+// long or the file is not there to append to. _writeLock held.
+void FileIndex::journal(const JsonDocument &doc) {
+    if (!_saved || _journal >= FLASHER_INDEX_JOURNAL) {
+        save();
+        return;
+    }
+    File file = SDStorage.appendFile(FLASHER_FILE_INDEX);
+    bool written = file;
+    if (file) {
+        serializeJson(doc, file);
+        file.print('\n');
+        written = file.getWriteError() == 0;
+        file.close();
+    }
+    if (!written) {
+        Serial.println("[Files] Failed to append to " FLASHER_FILE_INDEX);
+        save();
+        return;
+    }
+    _journal++;
+}
+
+// Writes the index to a new file and swaps it in. Only changes take
+// _writeLock, so _files holds still without _lock and lookups go on.
+// _writeLock held.
+void FileIndex::save() {
+    _saved = false;
+    File file = SDStorage.createFile(INDEX_TEMP);
+    if (!file) {
+        Serial.println("[Files] Failed to write " FLASHER_FILE_INDEX);
+        return;
+    }
+    for (const auto &info : _files) {
+        StaticJsonDocument<384> doc;
+        toJson(info, doc);
+        serializeJson(doc, file);
+        file.print('\n');
+    }
+    file.printf("{\"end\":%u}\n", (unsigned)_files.size());
+    bool written = file.getWriteError() == 0;
+    file.close();
+    if (!written) {
+        Serial.println("[Files] Failed to write " FLASHER_FILE_INDEX);
+        SDStorage.remove(INDEX_TEMP);
+        return;
+    }
+
+    // Neither SD nor SPIFFS rename over an existing file
+    SDStorage.remove(FLASHER_FILE_INDEX);
+    if (!SDStorage.rename(INDEX_TEMP, FLASHER_FILE_INDEX)) {
+        Serial.println("[Files] Failed to replace " FLASHER_FILE_INDEX);
+        return;
+    }
+    _saved = true;
+    _journal = 0;
+}
@@ -0,0 +1,87 @@
+#ifndef FILE_INDEX_H
+#define FILE_INDEX_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <vector>
+
+struct FileInfo {
+    String name;        // Path without the leading '/', e.g. "product/v1.2/app.bin"
+    uint32_t size;
+    uint32_t mtime;     // getLastWrite(), 0 if the file system has none
+    bool hasDigest;     // md5 known, from the upload or flash read that wrote the file
+    uint8_t md5[16];
+    String chip;        // From the image header, empty if not an app/bootloader image or unknown
+    uint8_t segments;   // Segments of an app/bootloader image
+    const char *type;   // "image", "partitions" or "data"
+};
+
+// Metadata of the .bin files on storage, kept sorted by path in RAM and in
+// FLASHER_FILE_INDEX (one JSON object per line, then an end line with the
+// count). Uploads, deletes, renames and flash reads update it as they
+// happen, so listing and lookups never have to open files or walk folders.
+// Each change appends one journal line after the end line, replayed on
+// load; a rescan, or FLASHER_INDEX_JOURNAL changes, write a new file and
+// rename it over the old one, so a file cut short is never loaded. Changes
+// made to the card elsewhere need a rescan().
+class FileIndex {
+public:
+    // Loads the index, scans storage if there is none
+    void begin();
+    // Rebuilds the index from storage, opens every file. Descends at most
+    // FLASHER_SCAN_DEPTH folders and indexes at most FLASHER_SCAN_MAX files.
+    void rescan();
+    // Runs rescan() on a task of its own, false if one is running already
+    bool startRescan();
+    bool scanning() const { return _scanning; }
+
+    // Records a .bin file that was just written. header holds its first
+    // headerLen bytes (read from the file when null), md5 is null if unknown.
+    void update(const String &name, const uint8_t *header = nullptr, size_t headerLen = 0,
+                const uint8_t *md5 = nullptr);
+    void remove(const String &name);
+    void rename(const String &from, const String &to);
+
+    // Up to limit files whose path starts with prefix, after skipping offset
+    // of them. Returns how many match in total. With direct, only files
+    // right in the folder prefix ends in match, none of its subfolders.
+    size_t page(const String &prefix, size_t offset, size_t limit, std::vector<FileInfo> &out,
+                bool direct = false);
+    // Names of the folders right in dir ("" for the root) that hold files
+    std::vector<String> folders(const String &dir);
+    // Metadata of the file at path, binary search of the index
+    bool find(const String &path, FileInfo &info);
+
+    // Bytes of an image header needed to detect its chip and segments
+    static const size_t HEADER_SIZE = 24;
+
+private:
+    static String relative(const String &path);
+    static void detect(FileInfo &info, const uint8_t *header, size_t len);
+    static bool stat(FileInfo &info, const uint8_t *header, size_t headerLen);
+
+    static void scanTask(void *pvParameters);
+
+    static void toJson(const FileInfo &info, JsonDocument &doc);
+    static bool fromJson(const JsonDocument &doc, FileInfo &info);
+
+    bool load(const char *path);
+    int locate(const String &name, bool *found);
+    void put(const FileInfo &info);
+    bool erase(const String &name);
+    void journal(const JsonDocument &doc);
+    void save();
+
+    // _lock guards _files against readers while it changes. Changes, and
+    // the file, take _writeLock, so readers never wait on storage.
+    SemaphoreHandle_t _lock = NULL;
+    SemaphoreHandle_t _writeLock = NULL;
+    volatile bool _scanning = false;
+    std::vector<FileInfo> _files;
+    uint32_t _journal = 0;  // Lines appended since the last save
+    bool _saved = false;    // FLASHER_FILE_INDEX is complete, so appending is safe
+};
+
+extern FileIndex Files;
+
+#endif
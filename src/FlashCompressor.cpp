@@ -0,0 +1,121 @@
+#include "FlashCompressor.h"
+#include <esp_heap_caps.h>
+
+// The deflater lives in the chip ROM, the header moved between IDF versions.
+#if __has_include("miniz.h")
+  #include "miniz.h"
+  #define FLASH_COMPRESSOR_AVAILABLE 1
+#elif __has_include("rom/miniz.h")
+  #include "rom/miniz.h"
+  #define FLASH_COMPRESSOR_AVAILABLE 1
+#else
+  #define FLASH_COMPRESSOR_AVAILABLE 0
+#endif
+
+#if FLASH_COMPRESSOR_AVAILABLE
+
+// Greedy parsing with few probes: the UART is the bottleneck, so a cheap
+// compression level already gets most of the gain on firmware images.
+static const int DEFLATE_FLAGS = TDEFL_WRITE_ZLIB_HEADER | TDEFL_GREEDY_PARSING_FLAG | 16;
+
+bool FlashCompressor::begin(uint32_t blockSize) {
+    // Buffers are kept between images of a job, only the stream is restarted
+    if (!_state) {
+        _state = heap_caps_malloc(sizeof(tdefl_compressor), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    }
+    if (!_state) {
+        _state = malloc(sizeof(tdefl_compressor));
+    }
+    if (_block && blockSize != _blockSize) {
+        free(_block);
+        _block = nullptr;
+    }
+    if (!_block) {
+        _block = (uint8_t *)malloc(blockSize);
+    }
+    if (!_state || !_block) {
+        Serial.println("FlashCompressor: Out of memory");
+        end();
+        return false;
+    }
+
+    if (tdefl_init((tdefl_compressor *)_state, NULL, NULL, DEFLATE_FLAGS) != TDEFL_STATUS_OKAY) {
+        end();
+        return false;
+    }
+
+    _blockSize = blockSize;
+    _blockFill = 0;
+    _compressedSize = 0;
+    return true;
+}
+
+esp_loader_error_t FlashCompressor::compress(const uint8_t *data, size_t len, bool finish) {
+    tdefl_compressor *comp = (tdefl_compressor *)_state;
+    if (!comp) return ESP_LOADER_ERROR_FAIL;
+
+    while (true) {
+        size_t inSize = len;
+        size_t space = _blockSize - _blockFill;
+        size_t outSize = space;
+
+        tdefl_status status = tdefl_compress(comp, data, &inSize, _block + _blockFill, &outSize,
+                                             finish ? TDEFL_FINISH : TDEFL_NO_FLUSH);
+        if (status < TDEFL_STATUS_OKAY) {
+            return ESP_LOADER_ERROR_FAIL;
+        }
+
+        data += inSize;
+        len -= inSize;
+        _blockFill += outSize;
+
+        if (_blockFill == _blockSize || (status == TDEFL_STATUS_DONE && _blockFill > 0)) {
+            RETURN_ON_ERROR( _sink ? _sink(_block, _blockFill) : esp_loader_flash_deflate_write(_block, _blockFill) );
+            _compressedSize += _blockFill;
+            _blockFill = 0;
+        }
+
+        if (status == TDEFL_STATUS_DONE) {
+            return ESP_LOADER_SUCCESS;
+        }
+        // Input consumed and the compressor had nothing more to hand out
+        if (!finish && len == 0 && outSize < space) {
+            return ESP_LOADER_SUCCESS;
+        }
+    }
+}
+
+#else
+
+bool FlashCompressor::begin(uint32_t blockSize) {
+    Serial.println("FlashCompressor: No deflater in this build");
+    return false;
+}
+
+esp_loader_error_t FlashCompressor::compress(const uint8_t *data, size_t len, bool finish) {
+    return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+}
+
+#endif
+
+void FlashCompressor::end() {
+    if (_state) heap_caps_free(_state);
+    if (_block) free(_block);
+    _state = nullptr;
+    _block = nullptr;
+}
+
+esp_loader_error_t FlashCompressor::write(const uint8_t *data, size_t len) {
+    return compress(data, len, false);
+}
+
+esp_loader_error_t FlashCompressor::finish() {
+    return compress(NULL, 0, true);
+}
+
+uint32_t FlashCompressor::compressBound(uint32_t size) {
+    // Same bound as mz_compressBound: stored blocks plus zlib framing
+    uint32_t stored = 128 + size + ((size / (31 * 1024)) + 1) * 5;
+    uint32_t worst = 128 + (uint32_t)(((uint64_t)size * 110) / 100);
+    return max(stored, worst);
+}
@@ -0,0 +1,45 @@
+#ifndef FLASH_COMPRESSOR_H
+#define FLASH_COMPRESSOR_H
+
+#include <Arduino.h>
+#include "esp-loader/esp_loader.h"
+
+// Streams an image to the target as a zlib stream (FLASH_DEFL_*).
+// Data is compressed as it is written and every full block of compressed
+// output is sent straight away, so the image never has to fit in RAM.
+class FlashCompressor {
+public:
+    // Starts a new zlib stream. The compressor state (~300KB, taken from PSRAM
+    // when present) is allocated on first use and kept until end().
+    // Returns false if compression is not available on this build or out of memory.
+    bool begin(uint32_t blockSize);
+    void end();
+
+    // Compresses data and sends every completed block to the target.
+    esp_loader_error_t write(const uint8_t *data, size_t len);
+    // Flushes the end of the zlib stream, including the last short block.
+    esp_loader_error_t finish();
+
+    uint32_t compressedSize() { return _compressedSize; }
+
+    // Completed blocks go to sink instead of esp_loader_flash_deflate_write,
+    // e.g. to hand one stream to several targets. nullptr restores the default.
+    typedef esp_loader_error_t (*BlockSink)(const uint8_t *block, uint32_t len);
+    void setSink(BlockSink sink) { _sink = sink; }
+
+    // Worst case size of the zlib stream of an image, used to announce the
+    // block count before the real compressed size is known.
+    static uint32_t compressBound(uint32_t size);
+
+private:
+    esp_loader_error_t compress(const uint8_t *data, size_t len, bool finish);
+
+    void *_state = nullptr;
+    uint8_t *_block = nullptr;
+    uint32_t _blockSize = 0;
+    uint32_t _blockFill = 0;
+    uint32_t _compressedSize = 0;
+    BlockSink _sink = nullptr;
+};
+
+#endif
@@ -0,0 +1,98 @@
+#include "FlashPlan.h"
+#include "SDStorage.h"
+#include "FileIndex.h"
+#include "ConfigFile.h"
+#include <algorithm>
+
+static const uint32_t SECTOR_SIZE = 0x1000;
+
+static uint32_t alignSector(uint32_t size) {
+    return (size + SECTOR_SIZE - 1) & ~(SECTOR_SIZE - 1);
+}
+
+static uint32_t blocks(uint32_t size, uint32_t blockSize) {
+    return (size + blockSize - 1) / blockSize;
+}
+
+String FlashSession::name() const {
+    String joined;
+    for (const auto &part : parts) {
+        if (joined.length()) joined += " + ";
+        joined += part.name;
+    }
+    return joined;
+}
+
+bool FlashPlan::build(const std::vector<FlashFile> &files, String &error) {
+    _sessions.clear();
+    _files = files.size();
+
+    std::vector<FlashFile> sorted = files;
+    std::stable_sort(sorted.begin(), sorted.end(), [](const FlashFile &a, const FlashFile &b) {
+        return a.address < b.address;
+    });
+
+    for (const auto &f : sorted) {
+        // The index knows the size of every .bin, only others are opened
+        FileInfo info;
+        uint32_t size;
+        if (Files.find(f.name, info)) {
+            size = info.size;
+        } else {
+            File file = SDStorage.openFile(("/" + f.name).c_str());
+            if (!file) {
+                error = f.name + " missing";
+                return false;
+            }
+            size = file.size();
+            file.close();
+        }
+
+        if (f.address % SECTOR_SIZE) {
+            error = f.name + " not at a 4KB boundary";
+            return false;
+        }
+        if (size == 0) {
+            error = f.name + " is empty";
+            return false;
+        }
+
+        if (!_sessions.empty()) {
+            FlashSession &last = _sessions.back();
+            uint32_t end = last.address + last.size;
+            if (f.address < end) {
+                error = f.name + " overlaps " + last.parts.back().name;
+                return false;
+            }
+            // The rest of the last sector is erased anyway
+            if (f.address <= last.address + alignSector(last.size) + FLASHER_MERGE_GAP) {
+                last.parts.push_back({f.name, f.address - last.address, size});
+                last.size = f.address - last.address + size;
+                continue;
+            }
+        }
+
+        FlashSession session;
+        session.address = f.address;
+        session.size = size;
+        session.parts.push_back({f.name, 0, size});
+        _sessions.push_back(session);
+    }
+    return true;
+}
+
+void FlashPlan::log(uint32_t blockSize, bool delta, bool verify) const {
+    uint32_t bytes = 0;
+    uint32_t roundTrips = 0;
+    for (const auto &session : _sessions) {
+        Serial.printf("[Plan] 0x%06x-0x%06x: %s\n", session.address,
+                      session.address + session.size, session.name().c_str());
+
+        bytes += session.size;
+        roundTrips += 1 + blocks(session.size, blockSize);
+        if (delta) roundTrips += blocks(session.size, FLASHER_DELTA_REGION_SIZE);
+        if (verify) roundTrips++;
+    }
+    Serial.printf("[Plan] %u files in %u erase sessions, %u bytes, ~%u round trips\n",
+                  _files, _sessions.size(), bytes, roundTrips);
+}
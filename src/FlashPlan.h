@@ -0,0 +1,42 @@
+#ifndef FLASH_PLAN_H
+#define FLASH_PLAN_H
+
+#include <Arduino.h>
+#include <vector>
+#include "FlasherTask.h"
+
+// Files of a job written in one erase/write session, as one image with the
+// space between them padded with 0xFF
+struct FlashSession {
+    struct Part {
+        String name;
+        uint32_t offset; // In the session
+        uint32_t size;
+    };
+
+    uint32_t address;
+    uint32_t size;
+    std::vector<Part> parts;
+
+    String name() const; // File names joined with " + "
+};
+
+// Turns the file list of a job into sessions. Files are ordered by address,
+// must be sector aligned and must not overlap. A file starting at most
+// FLASHER_MERGE_GAP past the last sector of the one before is merged with
+// it, which saves a begin command, an erase wait and a verify per file.
+class FlashPlan {
+public:
+    bool build(const std::vector<FlashFile> &files, String &error);
+    const std::vector<FlashSession> &sessions() const { return _sessions; }
+
+    // Prints the sessions and the estimated cost of the job: bytes sent,
+    // erase sessions and round trips (before compression, which only saves)
+    void log(uint32_t blockSize, bool delta, bool verify) const;
+
+private:
+    std::vector<FlashSession> _sessions;
+    size_t _files = 0;
+};
+
+#endif
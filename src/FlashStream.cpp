@@ -0,0 +1,191 @@
+#include "FlashStream.h"
+#include "ImageCache.h"
+#include "PinnedImages.h"
+
+FlashStream Feed;
+
+// The flasher writes a block in pieces of its own block size and the loader
+// pads the last piece in place, so pieces must never straddle a block
+static_assert(FlashStream::BLOCK_SIZE % FLASHER_BLOCK_SIZE == 0, "Stream blocks must hold whole flash blocks");
+// Whatever the peer still sends after the web server held back must fit
+static_assert(FlashStream::WINDOW <= FLASHER_STREAM_DEPTH * FlashStream::BLOCK_SIZE, "Stream pool smaller than the TCP window");
+
+bool FlashStream::open(uint32_t size, const String &teeName, String &error) {
+    if (_active) {
+        error = "Another stream is running";
+        return false;
+    }
+    if (size == 0) {
+        error = "Empty image";
+        return false;
+    }
+    // The pool (~100KB) is only allocated by the first stream and kept
+    if (!_pool.begin(FLASHER_STREAM_DEPTH, BLOCK_SIZE)) {
+        error = "Out of memory";
+        return false;
+    }
+
+    // Whatever the last stream left behind
+    finishTee(false);
+    _pool.reclaim();
+
+    _teeName = teeName;
+    if (_teeName.length()) {
+        String path = "/" + _teeName;
+        _tee = SDStorage.createFile(path.c_str());
+        if (!_tee) {
+            error = "Failed to create " + _teeName;
+            return false;
+        }
+        // Also voids a load of the old file still in progress
+        Images.invalidate(path.c_str());
+        Pinned.unpin(_teeName);
+    }
+
+    _size = size;
+    _received = 0;
+    _taken = 0;
+    _stalls = 0;
+    _error = "";
+    _failed = false;
+    MD5Init(&_md5);
+    _generation++;
+    _active = true;
+    return true;
+}
+
+bool FlashStream::write(const uint8_t *data, size_t len) {
+    while (len) {
+        if (_failed) break;
+        if (!_fill) {
+            // Only if the web server ignored full() and the peer the window
+            if (!_pool.take(&_fill, 0)) {
+                fail("Upload overran the buffer");
+                break;
+            }
+            _fillLen = 0;
+        }
+
+        size_t n = min(len, (size_t)(BLOCK_SIZE - _fillLen));
+        n = min(n, (size_t)(_size - _received));
+        if (n == 0) {
+            fail("Body longer than announced");
+            break;
+        }
+        memcpy(_fill + _fillLen, data, n);
+        MD5Update(&_md5, _fill + _fillLen, n);
+        if (_received < sizeof(_header)) {
+            memcpy(_header + _received, data, min(n, (size_t)(sizeof(_header) - _received)));
+        }
+        _fillLen += n;
+        _received += n;
+        data += n;
+        len -= n;
+
+        if (_fillLen == BLOCK_SIZE || _received == _size) queueFill();
+    }
+
+    if (_failed) {
+        if (_fill) {
+            _pool.give(_fill);
+            _fill = nullptr;
+        }
+        finishTee(false);
+        return false;
+    }
+    if (full()) _stalls++;
+    return true;
+}
+
+// Free bytes in the block being filled and in the pool
+uint32_t FlashStream::room() const {
+    uint32_t bytes = _pool.available() * BLOCK_SIZE;
+    if (_fill) bytes += BLOCK_SIZE - _fillLen;
+    return bytes;
+}
+
+// Unacknowledged bytes shrink the peer's window by as much, so holding back
+// while less than a window is free never lets more arrive than fits
+bool FlashStream::full() const {
+    if (!_active || _failed) return false;
+    return room() < min(WINDOW, _size - _received);
+}
+
+// Hands the filled block to the flasher, with the digest once it is the last
+void FlashStream::queueFill() {
+    // Whole blocks are written with a single call, which SD and SPIFFS like best
+    if (_tee && _tee.write(_fill, _fillLen) != _fillLen) {
+        Serial.println("[Stream] Write to " + _teeName + " failed, not kept");
+        _tee.close();
+        SDStorage.remove(("/" + _teeName).c_str());
+        _teeName = "";
+    }
+    if (_received == _size) {
+        MD5Final(_digest, &_md5);
+        finishTee(true);
+    }
+
+    _pool.push({_fill, _fillLen});
+    _fill = nullptr;
+}
+
+void FlashStream::finishTee(bool complete) {
+    if (!_tee) return;
+    _tee.close();
+    String path = "/" + _teeName;
+    if (complete) {
+        Files.update(_teeName, _header, min(_size, (uint32_t)sizeof(_header)), _digest);
+        Serial.println("[Stream] Kept " + _teeName);
+    } else {
+        SDStorage.remove(path.c_str());
+        Files.remove(_teeName);
+    }
+    Images.invalidate(path.c_str());
+}
+
+void FlashStream::abort(uint32_t generation) {
+    if (generation != _generation) return;
+    if (_active && _received < _size) fail("Upload aborted");
+    if (_fill) {
+        _pool.give(_fill);
+        _fill = nullptr;
+    }
+    finishTee(false);
+}
+
+void FlashStream::fail(const char *error) {
+    if (_failed) return;
+    _error = error;
+    _failed = true;
+    Serial.printf("[Stream] %s after %u of %u bytes\n", error, _received, _size);
+}
+
+uint8_t *FlashStream::next(size_t *len) {
+    *len = 0;
+    if (_taken >= _size) return nullptr;
+
+    // Every block not queued is free or being filled, so the upload is late
+    BufferPool::Block block;
+    if (!_pool.pop(&block, pdMS_TO_TICKS(FLASHER_STREAM_WAIT_MS))) {
+        fail("Upload stalled");
+        return nullptr;
+    }
+    if (_failed) {
+        _pool.give(block.data);
+        return nullptr;
+    }
+    _taken += block.len;
+    *len = block.len;
+    return block.data;
+}
+
+void FlashStream::release(uint8_t *block) {
+    _pool.give(block);
+}
+
+void FlashStream::close() {
+    if (!_active) return;
+    if (_taken < _size) fail("Flasher gave up");
+    _pool.reclaim();
+    _active = false;
+}
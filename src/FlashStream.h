@@ -0,0 +1,80 @@
+#ifndef FLASH_STREAM_H
+#define FLASH_STREAM_H
+
+#include <Arduino.h>
+#include <lwip/opt.h>
+#include "SDStorage.h"
+#include "FileIndex.h"
+#include "BufferPool.h"
+#include "esp-loader/md5_hash.h"
+
+// Image data of a /flash_stream upload on its way to the target, so the
+// UART transfer starts while the upload is still arriving. The web server
+// copies the body into blocks of FLASHER_STUB_BLOCK_SIZE from a pool of
+// FLASHER_STREAM_DEPTH and queues them; the flasher task writes them out and
+// hands them back. The web server never waits for a block: once the pool
+// has less room left than the peer may still send (the TCP window), it
+// stops acknowledging the body, and acknowledges it again as blocks come
+// back. One stream at a time.
+class FlashStream {
+public:
+    static const uint32_t BLOCK_SIZE = FLASHER_STUB_BLOCK_SIZE;
+    // Most a peer sends without further acknowledgement
+    static const uint32_t WINDOW = TCP_WND;
+
+    // Web server side. open() readies a stream of size bytes, also written
+    // to teeName on storage unless that is empty. write() takes the body in
+    // any chunks and returns false once the stream failed. full() tells the
+    // web server to hold back acknowledging what it wrote so far.
+    bool open(uint32_t size, const String &teeName, String &error);
+    bool write(const uint8_t *data, size_t len);
+    bool full() const;
+    // Client of the stream generation() was at its open() went away, no-op
+    // once all data arrived or a later stream was opened
+    void abort(uint32_t generation);
+    uint32_t generation() const { return _generation; }
+
+    // Flasher task side. next() returns the next block, all BLOCK_SIZE long
+    // but the last, or nullptr if the upload failed or stalled. digest() is
+    // valid once the last block was taken. close() ends the stream, a
+    // stream not received in full counts as failed.
+    uint8_t *next(size_t *len);
+    void release(uint8_t *block);
+    void digest(uint8_t out[16]) { memcpy(out, _digest, sizeof(_digest)); }
+    void close();
+
+    bool active() const { return _active; }
+    bool failed() const { return _failed; }
+    const char *error() const { return _error; }
+    // Times the upload was held back, i.e. the UART is the bottleneck
+    uint32_t stalls() const { return _stalls; }
+
+private:
+    uint32_t room() const;
+    void fail(const char *error);
+    void queueFill();
+    void finishTee(bool complete);
+
+    BufferPool _pool;
+
+    volatile bool _active = false;
+    volatile bool _failed = false;
+    const char *_error = "";
+    uint32_t _size = 0;
+    uint32_t _received = 0;
+    uint32_t _taken = 0;
+    uint8_t *_fill = nullptr; // Block the web server is filling
+    size_t _fillLen = 0;
+    MD5Context _md5;
+    uint8_t _digest[16];
+    uint8_t _header[FileIndex::HEADER_SIZE];
+    volatile uint32_t _stalls = 0;
+    uint32_t _generation = 0;
+
+    File _tee;
+    String _teeName;
+};
+
+extern FlashStream Feed;
+
+#endif
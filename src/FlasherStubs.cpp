@@ -0,0 +1,87 @@
+#include "FlasherStubs.h"
+#include "SDStorage.h"
+#include <ArduinoJson.h>
+#include "mbedtls/base64.h"
+
+FlasherStubs Stubs;
+
+// Indexed by target_chip_t, names as in esptool's targets/stub_flasher directory
+static const char *STUB_FILES[ESP_MAX_CHIP] = {
+    "/stub_flasher_8266.json",
+    "/stub_flasher_32.json",
+    "/stub_flasher_32s2.json",
+    "/stub_flasher_32c3.json",
+    "/stub_flasher_32s3.json",
+};
+
+void FlasherStubs::begin() {
+    for (int chip = 0; chip < ESP_MAX_CHIP; chip++) {
+        if (load((target_chip_t)chip, STUB_FILES[chip])) {
+            esp_loader_register_stub((target_chip_t)chip, &_stubs[chip]);
+            Serial.printf("Flasher stub loaded: %s\n", STUB_FILES[chip]);
+        }
+    }
+}
+
+bool FlasherStubs::isLoaded(target_chip_t chip) {
+    return chip < ESP_MAX_CHIP && _stubs[chip].text != nullptr;
+}
+
+uint8_t *FlasherStubs::decode(const char *base64, uint32_t *size) {
+    size_t len = strlen(base64);
+    size_t decodedLen = 0;
+    // First call only reports the decoded size
+    mbedtls_base64_decode(NULL, 0, &decodedLen, (const unsigned char *)base64, len);
+    if (decodedLen == 0) return nullptr;
+
+    uint8_t *buffer = (uint8_t *)malloc(decodedLen);
+    if (!buffer) return nullptr;
+
+    if (mbedtls_base64_decode(buffer, decodedLen, &decodedLen, (const unsigned char *)base64, len) != 0) {
+        free(buffer);
+        return nullptr;
+    }
+    *size = decodedLen;
+    return buffer;
+}
+
+bool FlasherStubs::load(target_chip_t chip, const char *path) {
+    File file = SDStorage.openFile(path);
+    if (!file) return false;
+
+    // Base64 strings are copied into the document, so it needs about the file size
+    DynamicJsonDocument doc(file.size() + 1024);
+    DeserializationError error = deserializeJson(doc, file);
+    file.close();
+    if (error) {
+        Serial.printf("Stub %s: JSON error %s\n", path, error.c_str());
+        return false;
+    }
+
+    esp_loader_stub_t stub = {};
+    stub.entry = doc["entry"].as<uint32_t>();
+    stub.text_start = doc["text_start"].as<uint32_t>();
+    stub.data_start = doc["data_start"].as<uint32_t>();
+
+    uint32_t textSize = 0;
+    uint32_t dataSize = 0;
+    uint8_t *text = decode(doc["text"] | "", &textSize);
+    uint8_t *data = nullptr;
+    if (doc.containsKey("data")) {
+        data = decode(doc["data"] | "", &dataSize);
+    }
+
+    if (!text || stub.entry == 0) {
+        Serial.printf("Stub %s: Invalid image\n", path);
+        free(text);
+        free(data);
+        return false;
+    }
+
+    stub.text = text;
+    stub.text_size = textSize;
+    stub.data = data;
+    stub.data_size = dataSize;
+    _stubs[chip] = stub;
+    return true;
+}
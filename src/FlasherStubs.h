@@ -0,0 +1,25 @@
+#ifndef FLASHER_STUBS_H
+#define FLASHER_STUBS_H
+
+#include <Arduino.h>
+#include "esp-loader/esp_loader.h"
+
+// Flasher stubs are not bundled with the firmware. They are read from storage
+// in the JSON format esptool ships them in (stub_flasher_<chip>.json), so
+// copying the files from an esptool release is all that is needed.
+class FlasherStubs {
+public:
+    // Loads every stub found on storage and registers it with the loader
+    void begin();
+    bool isLoaded(target_chip_t chip);
+
+private:
+    bool load(target_chip_t chip, const char *path);
+    uint8_t *decode(const char *base64, uint32_t *size);
+
+    esp_loader_stub_t _stubs[ESP_MAX_CHIP] = {};
+};
+
+extern FlasherStubs Stubs;
+
+#endif
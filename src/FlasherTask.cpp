@@ -4,178 +4,1080 @@
 #include "esp-loader/esp_loader.h"
 #include "esp-loader/esp_targets.h"
 #include "esp-loader/serial_io.h"
+#include "esp-loader/esp32_port.h"
+#include "esp-loader/md5_hash.h"
+#include "FlashCompressor.h"
+#include "BlockReader.h"
+#include "ImageCache.h"
+#include "PinnedImages.h"
+#include "FlashPlan.h"
+#include "JobProgress.h"
+#include "JobQueue.h"
+#include "AutoFlash.h"
+#include "LogRing.h"
+#include "FileIndex.h"
+#include "FlasherStubs.h"
+#include "FlashStream.h"
+#include <Preferences.h>
 
 // Note: Ensure esp-loader files are compatible with this include path or adjust.
 
 FlasherTask Flasher;
 
 static TaskHandle_t xFlasherTaskHandle = NULL;
+
+// The running job, copied out of its FlashJob. Only the flasher task touches these.
+static FlashJobType jobType = JOB_WRITE;
 static std::vector<FlashFile> fileQueue;
-static String targetChip = "esp32";
-static volatile int flashProgress = 0;
+static FlashFile readJob;
+static uint32_t readSize = 0;
+static FlashOptions jobOptions;
 static volatile bool flashingActive = false;
 static String flashStatus = "Ready";
 
-// --- ESP Loader IO Callbacks ---
-// Must be extern "C" to link with esp_loader.c
+// --- ESP Loader IO ---
+// UART, pins and timer callbacks live in esp-loader/esp32_port.c.
+// Debug output goes to the console here, must be extern "C" to link with esp_loader.c
+
+extern "C" void loader_port_debug_print(const char *str) {
+    Serial.print(str);
+}
+
 
-static int32_t s_time_end;
+// Further target ports driven in gang mode, see FLASHER_GANG_PORTS
+struct GangPort {
+    uint32_t uart;
+    uint32_t txPin;
+    uint32_t rxPin;
+    uint32_t rstPin;
+    uint32_t bootPin;
+};
 
-extern "C" {
+static const GangPort GANG_PORTS[] = FLASHER_GANG_PORTS;
+static const size_t GANG_SIZE = 1 + sizeof(GANG_PORTS) / sizeof(GANG_PORTS[0]);
 
-uint32_t loader_port_remaining_time(void) {
-    int32_t remaining = (s_time_end - millis());
-    return (remaining > 0) ? remaining : 0;
+static esp_loader_error_t initPort(const GangPort &port) {
+    loader_esp32_config_t portConfig = {};
+    portConfig.baud_rate = FLASHER_BAUD_RATE;
+    portConfig.uart_port = port.uart;
+    portConfig.uart_rx_pin = port.rxPin;
+    portConfig.uart_tx_pin = port.txPin;
+    portConfig.reset_trigger_pin = port.rstPin;
+    portConfig.gpio0_trigger_pin = port.bootPin;
+    portConfig.rx_buffer_size = TARGET_UART_RX_BUFFER;
+    portConfig.tx_buffer_size = TARGET_UART_TX_BUFFER;
+    portConfig.rx_timeout_threshold = TARGET_UART_RX_TIMEOUT;
+    portConfig.queue_size = 20;
+    return loader_port_esp32_init(&portConfig);
 }
 
-void loader_port_start_timer(uint32_t ms) {
-    s_time_end = millis() + ms;
+void FlasherTask::begin() {
+    // Setup Target UART and Pins. The first port initialized serves single target jobs.
+    if (initPort({TARGET_UART_PORT, TARGET_TX_PIN, TARGET_RX_PIN, TARGET_RST_PIN, TARGET_BOOT_PIN}) != ESP_LOADER_SUCCESS) {
+        Serial.println("Target UART init failed");
+    }
+    // Gang ports are set up at boot as well, so their targets are not left floating in reset
+    for (const auto &port : GANG_PORTS) {
+        if (initPort(port) != ESP_LOADER_SUCCESS) {
+            Serial.printf("Gang UART%u init failed\n", port.uart);
+        }
+    }
+
+    if (FLASHER_USE_STUB) {
+        Stubs.begin();
+    }
+    Images.begin();
+    Pinned.begin();
+    Progress.begin();
+    Jobs.begin();
+    Auto.begin();
+
+    xTaskCreatePinnedToCore(flasherTask, "FlasherTask", 8192, NULL, 1, &xFlasherTaskHandle, 1);
 }
 
-esp_loader_error_t loader_port_serial_write(const uint8_t *data, uint16_t size, uint32_t timeout) {
-    size_t written = Serial2.write(data, size);
-    if (written != size) return ESP_LOADER_ERROR_FAIL;
-    return ESP_LOADER_SUCCESS;
+// Summaries are stored with every record, long file lists are cut
+static const size_t SUMMARY_MAX = 160;
+
+static uint32_t submitJob(FlashJob *job, bool idleOnly = false) {
+    if (job->summary.length() > SUMMARY_MAX) {
+        job->summary = job->summary.substring(0, SUMMARY_MAX - 3) + "...";
+    }
+    return Jobs.submit(job, idleOnly);
 }
 
-esp_loader_error_t loader_port_serial_read(uint8_t *data, uint16_t size, uint32_t timeout) {
-    int read = 0;
-    int32_t time_end = millis() + timeout;
-    while (read < size) {
-        if (millis() > time_end) return ESP_LOADER_ERROR_TIMEOUT;
-        if (Serial2.available()) {
-            data[read++] = Serial2.read();
-        } else {
-            delay(1);
+uint32_t FlasherTask::flashFirmware(String targetName, std::vector<FlashFile> files, FlashOptions options) {
+    FlashJob *job = new FlashJob();
+    job->type = JOB_WRITE;
+    job->target = targetName;
+    job->files = files;
+    job->options = options;
+    job->summary = "Write " + targetName + (options.gang ? " (gang):" : ":");
+    for (const auto &f : files) {
+        job->summary += " " + f.name + "@0x" + String(f.address, HEX);
+    }
+    return submitJob(job);
+}
+
+uint32_t FlasherTask::readFlash(String targetName, uint32_t address, uint32_t size, String fileName) {
+    FlashJob *job = new FlashJob();
+    job->type = JOB_READ;
+    job->target = targetName;
+    job->file = {fileName, address};
+    job->size = size;
+    job->summary = "Read " + targetName + ": 0x" + String(address, HEX) + "+" + String(size) + " to " + fileName;
+    return submitJob(job);
+}
+
+uint32_t FlasherTask::flashStream(String targetName, uint32_t address, uint32_t size, String teeName,
+                                  FlashOptions options) {
+    FlashJob *job = new FlashJob();
+    job->type = JOB_STREAM;
+    job->target = targetName;
+    job->file = {teeName, address};
+    job->size = size;
+    job->options = options;
+    job->summary = "Stream " + targetName + ": " + String(size) + " bytes@0x" + String(address, HEX);
+    if (teeName.length()) job->summary += " to " + teeName;
+    return submitJob(job, true);
+}
+
+uint32_t FlasherTask::pinImage(String fileName) {
+    FlashJob *job = new FlashJob();
+    job->type = JOB_PIN;
+    job->file.name = fileName;
+    job->summary = "Pin " + fileName;
+    return submitJob(job);
+}
+
+bool FlasherTask::isFlashing() {
+    return flashingActive || Jobs.pending() > 0;
+}
+
+int FlasherTask::getProgress() {
+    return Progress.percent();
+}
+
+String FlasherTask::getStatus() {
+    return flashStatus;
+}
+
+void FlasherTask::setStatus(const String &msg) {
+    flashStatus = msg;
+    log(msg.c_str()); // Auto-log status changes
+}
+
+void FlasherTask::log(const char *msg) {
+    Logs.write(msg);
+}
+
+// Part of an image file written in one FLASH_BEGIN / FLASH_DEFL_BEGIN session
+struct FlashSegment {
+    uint32_t offset;   // In the image file, added to the image address on the target
+    uint32_t size;
+    bool erase = false; // All 0xFF, only erased and nothing is sent
+};
+
+static const uint32_t FLASH_SECTOR_SIZE = 0x1000;
+
+// Reads the next chunk of a segment, the file must be positioned at its data
+static size_t readChunk(ImageFile &binFile, uint8_t *buffer, uint32_t blockSize, uint32_t remaining) {
+    return binFile.read(buffer, min(blockSize, remaining));
+}
+
+// Streams the segment as-is, the loader pads the last block with 0xFF.
+// md5 may be null when the image digest is computed elsewhere.
+static esp_loader_error_t writeRaw(ImageFile &binFile, uint32_t address,
+                                   const FlashSegment &segment, BlockReader &reader,
+                                   uint32_t blockSize, MD5Context *md5) {
+    esp_loader_error_t err = esp_loader_flash_start(address + segment.offset, segment.size, blockSize);
+    if (err != ESP_LOADER_SUCCESS) {
+        flashStatus = "Erase Error: " + String(err);
+        return err;
+    }
+
+    reader.start(binFile, segment.offset, segment.size, blockSize, md5);
+    uint32_t written = 0;
+    while (written < segment.size) {
+        size_t len;
+        uint8_t *block = reader.next(&len);
+        if (!block) {
+            flashStatus = "Read Error";
+            err = ESP_LOADER_ERROR_FAIL;
+            break;
+        }
+        err = esp_loader_flash_write(block, len);
+        reader.release(block);
+        if (err != ESP_LOADER_SUCCESS) {
+            flashStatus = "Write Error: " + String(err);
+            break;
+        }
+        written += len;
+        Progress.advance(len);
+    }
+    reader.stop();
+    return err;
+}
+
+// Writes the /flash_stream upload as it arrives, compressed if compressor is
+// set. Stream blocks hold whole flash blocks, so each is sent in pieces of
+// blockSize and only the very last piece is short.
+static esp_loader_error_t writeStream(uint32_t address, uint32_t size, uint32_t blockSize,
+                                      FlashCompressor *compressor) {
+    esp_loader_error_t err = compressor
+        ? esp_loader_flash_deflate_start(address, size, FlashCompressor::compressBound(size), blockSize)
+        : esp_loader_flash_start(address, size, blockSize);
+    if (err != ESP_LOADER_SUCCESS) {
+        flashStatus = "Erase Error: " + String(err);
+        return err;
+    }
+
+    uint32_t written = 0;
+    while (written < size && err == ESP_LOADER_SUCCESS) {
+        size_t len;
+        uint8_t *block = Feed.next(&len);
+        if (!block) {
+            flashStatus = String("Stream Error: ") + Feed.error();
+            return ESP_LOADER_ERROR_FAIL;
         }
+        for (size_t offset = 0; offset < len && err == ESP_LOADER_SUCCESS; offset += blockSize) {
+            size_t piece = min((size_t)blockSize, len - offset);
+            err = compressor ? compressor->write(block + offset, piece)
+                             : esp_loader_flash_write(block + offset, piece);
+            Progress.advance(piece);
+        }
+        Feed.release(block);
+        written += len;
     }
+    if (err == ESP_LOADER_SUCCESS && compressor) err = compressor->finish();
+    if (err != ESP_LOADER_SUCCESS) flashStatus = "Write Error: " + String(err);
+    return err;
+}
+
+// Deflates the segment while it streams from storage. Progress and MD5 are
+// based on the uncompressed data, only the wire carries the zlib stream.
+static esp_loader_error_t writeCompressed(ImageFile &binFile, uint32_t address,
+                                          const FlashSegment &segment, BlockReader &reader,
+                                          uint32_t blockSize, MD5Context *md5,
+                                          FlashCompressor &compressor) {
+    esp_loader_error_t err = esp_loader_flash_deflate_start(address + segment.offset, segment.size,
+                                                            FlashCompressor::compressBound(segment.size),
+                                                            blockSize);
+    if (err != ESP_LOADER_SUCCESS) {
+        flashStatus = "Erase Error: " + String(err);
+        return err;
+    }
+
+    reader.start(binFile, segment.offset, segment.size, blockSize, md5);
+    uint32_t written = 0;
+    while (written < segment.size) {
+        size_t len;
+        uint8_t *block = reader.next(&len);
+        if (!block) {
+            flashStatus = "Read Error";
+            err = ESP_LOADER_ERROR_FAIL;
+            break;
+        }
+        err = compressor.write(block, len);
+        reader.release(block);
+        if (err != ESP_LOADER_SUCCESS) {
+            flashStatus = "Write Error: " + String(err);
+            break;
+        }
+        written += len;
+        Progress.advance(len);
+    }
+    reader.stop();
+    if (err != ESP_LOADER_SUCCESS) return err;
+
+    err = compressor.finish();
+    if (err != ESP_LOADER_SUCCESS) {
+        flashStatus = "Write Error: " + String(err);
+        return err;
+    }
+
+    Serial.printf("Compressed %u -> %u bytes\n", segment.size, compressor.compressedSize());
     return ESP_LOADER_SUCCESS;
 }
 
-void loader_port_delay_ms(uint32_t ms) {
-    delay(ms);
+// Word-wide scan, bails out at the first eight words holding data.
+// data comes from the heap allocated block buffer, so it is word aligned.
+static bool isErased(const uint8_t *data, size_t len) {
+    const uint32_t *words = (const uint32_t *)data;
+    size_t wordCount = len / 4;
+    size_t i = 0;
+
+    for (; i + 8 <= wordCount; i += 8) {
+        uint32_t all = words[i] & words[i + 1] & words[i + 2] & words[i + 3] &
+                       words[i + 4] & words[i + 5] & words[i + 6] & words[i + 7];
+        if (all != 0xFFFFFFFF) return false;
+    }
+    for (i *= 4; i < len; i++) {
+        if (data[i] != 0xFF) return false;
+    }
+    return true;
 }
 
-void loader_port_enter_bootloader(void) {
-    digitalWrite(TARGET_RST_PIN, LOW);
-    digitalWrite(TARGET_BOOT_PIN, LOW);
-    delay(50);
-    digitalWrite(TARGET_RST_PIN, HIGH); // Release Reset
-    delay(50);
-    digitalWrite(TARGET_BOOT_PIN, HIGH); // Release Boot
+// Appends a piece to the list, merged into the last one if contiguous and of the same kind
+static void appendSegment(std::vector<FlashSegment> &segments, const FlashSegment &piece) {
+    if (!segments.empty() && segments.back().erase == piece.erase &&
+        segments.back().offset + segments.back().size == piece.offset) {
+        segments.back().size += piece.size;
+    } else {
+        segments.push_back(piece);
+    }
 }
 
-void loader_port_reset_target(void) {
-    digitalWrite(TARGET_RST_PIN, LOW);
-    delay(50);
-    digitalWrite(TARGET_RST_PIN, HIGH);
+// Splits segments at runs of all-0xFF sectors, which are then only erased.
+// Runs shorter than FLASHER_SPARSE_MIN_GAP stay with the data around them, an
+// extra begin command would cost more than sending them. md5, if set, is
+// updated with all scanned data.
+static esp_loader_error_t splitSparse(ImageFile &binFile, std::vector<FlashSegment> &segments,
+                                      uint8_t *buffer, uint32_t blockSize, MD5Context *md5) {
+    std::vector<FlashSegment> result;
+
+    for (const auto &segment : segments) {
+        std::vector<FlashSegment> runs;
+        binFile.seek(segment.offset);
+
+        uint32_t scanned = 0;
+        while (scanned < segment.size) {
+            size_t len = readChunk(binFile, buffer, blockSize, segment.size - scanned);
+            if (len == 0) {
+                flashStatus = "Read Error";
+                return ESP_LOADER_ERROR_FAIL;
+            }
+            if (md5) MD5Update(md5, buffer, len);
+
+            for (size_t pos = 0; pos < len; pos += FLASH_SECTOR_SIZE) {
+                uint32_t sectorLen = min((size_t)FLASH_SECTOR_SIZE, len - pos);
+                FlashSegment piece = {segment.offset + scanned + (uint32_t)pos, sectorLen};
+                piece.erase = isErased(&buffer[pos], sectorLen);
+                appendSegment(runs, piece);
+            }
+            scanned += len;
+        }
+
+        for (auto run : runs) {
+            if (run.erase && run.size < FLASHER_SPARSE_MIN_GAP && runs.size() > 1) {
+                run.erase = false;
+            }
+            appendSegment(result, run);
+        }
+    }
+
+    segments.swap(result);
+    return ESP_LOADER_SUCCESS;
 }
 
-esp_loader_error_t loader_port_change_baudrate(uint32_t baudrate) {
-    Serial2.updateBaudRate(baudrate);
+// Hashes the image region by region and asks the target for the MD5 of the
+// same flash region. Regions that differ end up in segments, adjacent ones
+// merged so each run costs a single erase/write session. The digest of the
+// whole image is computed on the way, for the final verify.
+static esp_loader_error_t findChangedSegments(ImageFile &binFile, uint32_t address, uint32_t imageSize,
+                                              uint8_t *buffer, uint32_t blockSize, MD5Context *md5,
+                                              std::vector<FlashSegment> &segments) {
+    for (uint32_t offset = 0; offset < imageSize; offset += FLASHER_DELTA_REGION_SIZE) {
+        uint32_t regionSize = min((uint32_t)FLASHER_DELTA_REGION_SIZE, imageSize - offset);
+
+        MD5Context regionMd5;
+        MD5Init(&regionMd5);
+        uint32_t hashed = 0;
+        while (hashed < regionSize) {
+            size_t len = readChunk(binFile, buffer, blockSize, regionSize - hashed);
+            if (len == 0) {
+                flashStatus = "Read Error";
+                return ESP_LOADER_ERROR_FAIL;
+            }
+            MD5Update(&regionMd5, buffer, len);
+            MD5Update(md5, buffer, len);
+            hashed += len;
+        }
+
+        uint8_t imageDigest[16];
+        uint8_t flashDigest[16];
+        MD5Final(imageDigest, &regionMd5);
+        esp_loader_error_t err = esp_loader_flash_read_md5(address + offset, regionSize, flashDigest);
+        if (err != ESP_LOADER_SUCCESS) {
+            flashStatus = "Compare Error: " + String(err);
+            return err;
+        }
+
+        if (memcmp(imageDigest, flashDigest, sizeof(imageDigest)) != 0) {
+            if (!segments.empty() && segments.back().offset + segments.back().size == offset) {
+                segments.back().size += regionSize;
+            } else {
+                segments.push_back({offset, regionSize});
+            }
+        }
+        Progress.advance(regionSize);
+    }
     return ESP_LOADER_SUCCESS;
 }
 
-void loader_port_debug_print(const char *str) {
-    Serial.print(str);
+// Reads the region chunk by chunk and appends each chunk to the file
+// before requesting the next, so the dump never has to fit in RAM.
+static bool readToFile(uint8_t *buffer, uint32_t chunkSize) {
+    File dumpFile = SDStorage.createFile(("/" + readJob.name).c_str());
+    if (!dumpFile) {
+        flashStatus = "Error: Cannot create " + readJob.name;
+        return false;
+    }
+
+    flashStatus = "Reading to " + readJob.name;
+    Serial.println(flashStatus);
+
+    MD5Context md5;
+    MD5Init(&md5);
+    uint32_t done = 0;
+    bool success = true;
+    while (done < readSize) {
+        uint32_t len = min(chunkSize, readSize - done);
+        esp_loader_error_t err = esp_loader_flash_read(buffer, readJob.address + done, len);
+        if (err != ESP_LOADER_SUCCESS) {
+            flashStatus = "Read Error: " + String(err);
+            success = false;
+            break;
+        }
+        if (dumpFile.write(buffer, len) != len) {
+            flashStatus = "Error: Storage full";
+            success = false;
+            break;
+        }
+        MD5Update(&md5, buffer, len);
+        done += len;
+        Progress.advance(len);
+    }
+    dumpFile.close();
+    Images.invalidate(("/" + readJob.name).c_str());
+    Pinned.unpin(readJob.name);
+    uint8_t digest[16];
+    MD5Final(digest, &md5);
+    Files.update(readJob.name, nullptr, 0, success ? digest : nullptr);
+
+    if (success) {
+        Serial.printf("Read %u bytes from 0x%x\n", readSize, readJob.address);
+    }
+    return success;
 }
 
-} // extern "C"
+static const uint32_t BAUD_LADDER[] = FLASHER_BAUD_LADDER;
 
+// Negotiates the fastest rate of the ladder, starting from the best rate this
+// fixture (target UART) reached before, and remembers the result in NVS.
+static esp_loader_error_t negotiateBaudrate(uint32_t uart, uint32_t *baudrate) {
+    Preferences prefs;
+    char key[16];
+    char sessionsKey[16];
+    snprintf(key, sizeof(key), "baud_uart%u", uart);
+    snprintf(sessionsKey, sizeof(sessionsKey), "baud_n_uart%u", uart);
 
-void FlasherTask::begin() {
-    // Setup Target Serial
-    Serial2.begin(FLASHER_BAUD_RATE, SERIAL_8N1, TARGET_RX_PIN, TARGET_TX_PIN);
-    
-    // Setup Pins
-    pinMode(TARGET_RST_PIN, OUTPUT);
-    digitalWrite(TARGET_RST_PIN, HIGH);
-    pinMode(TARGET_BOOT_PIN, OUTPUT);
-    digitalWrite(TARGET_BOOT_PIN, HIGH);
+    prefs.begin("flasher", false);
+    uint32_t proven = prefs.getUInt(key, 0);
+    uint32_t sessions = prefs.getUInt(sessionsKey, 0);
 
-    xTaskCreatePinnedToCore(flasherTask, "FlasherTask", 8192, NULL, 1, &xFlasherTaskHandle, 1);
+    // A rate below the top is only a hint: after FLASHER_BAUD_RETRY sessions
+    // the whole ladder is tried again, one noisy session is not for good
+    size_t count = sizeof(BAUD_LADDER) / sizeof(BAUD_LADDER[0]);
+    size_t first = 0;
+    if (sessions < FLASHER_BAUD_RETRY) {
+        while (proven != 0 && first < count && BAUD_LADDER[first] > proven) {
+            first++;
+        }
+    }
+
+    esp_loader_error_t err = esp_loader_negotiate_baudrate(&BAUD_LADDER[first], count - first, baudrate);
+    if (err == ESP_LOADER_ERROR_UNSUPPORTED_FUNC) {
+        // ESP8266 ROM loader stays at the connect rate
+        err = ESP_LOADER_SUCCESS;
+    } else if (err == ESP_LOADER_SUCCESS) {
+        if (*baudrate != proven) prefs.putUInt(key, *baudrate);
+        // Counts sessions held below the top since the ladder was last tried in full
+        uint32_t held = (*baudrate == proven && first > 0) ? sessions + 1 : 0;
+        if (held != sessions) prefs.putUInt(sessionsKey, held);
+    }
+    prefs.end();
+    return err;
 }
 
-bool FlasherTask::flashFirmware(String targetName, std::vector<FlashFile> files) {
-    if (flashingActive) return false;
-    fileQueue = files;
-    targetChip = targetName;
-    flashingActive = true;
-    xTaskNotifyGive(xFlasherTaskHandle); // Wake up task
-    return true;
+// Pinned copy first, then the PSRAM cache, which falls back to storage.
+// A fixture reflashing the same files should never read from storage.
+static ImageFile openImage(const String &name) {
+    const char *source = "pinned partition";
+    ImageFile image = Pinned.open(name);
+    if (!image) {
+        image = Images.open(("/" + name).c_str());
+        source = image.data() ? "PSRAM" : "storage";
+    }
+    if (image) {
+        Serial.printf("%s: read from %s (cache %u hits, %u misses)\n", name.c_str(), source,
+                      Images.hits(), Images.misses());
+    }
+    // Uploads and flash reads record the digest, verify then needs no hashing
+    uint8_t digest[16];
+    FileInfo info;
+    if (image && !image.digest(digest) && Files.find(name, info) && info.hasDigest && info.size == image.size()) {
+        image.setDigest(info.md5);
+    }
+    return image;
 }
 
-bool FlasherTask::isFlashing() {
-    return flashingActive;
+static void pinProgress(uint32_t bytes) {
+    Progress.advance(bytes);
 }
 
-int FlasherTask::getProgress() {
-    return flashProgress;
+// Opens the files of a session as one image
+static ImageFile openSession(const FlashSession &session) {
+    if (session.parts.size() == 1) return openImage(session.parts[0].name);
+
+    std::vector<ImageFile::Part> parts;
+    for (const auto &part : session.parts) {
+        ImageFile image = openImage(part.name);
+        // Replaced since the plan was made, it may not fit its slot any more
+        if (!image || image.size() != part.size) return ImageFile();
+        parts.push_back({part.offset, image});
+    }
+    return ImageFile(parts, session.size);
 }
 
-String FlasherTask::getStatus() {
-    return flashStatus;
+// Which side of the read pipeline waited on the other. Reader stalls mean the
+// UART is kept busy, sender stalls mean storage cannot keep up with it.
+static void logStalls(BlockReader &reader) {
+    Serial.printf("[Pipeline] reader stalled %u times, sender stalled %u times\n",
+                  reader.readerStalls(), reader.senderStalls());
+    reader.resetStalls();
+}
+
+// Round trips of the phase that just ended, shows where a job spends its time on the wire
+static void logRoundTrips(const char *phase) {
+    Serial.printf("[%s] %u round trips\n", phase, esp_loader_get_round_trips());
+    esp_loader_reset_round_trips();
 }
 
-// Max log size to prevent OOM
-const size_t MAX_LOG_SIZE = 200;
+// --- Gang Programming ---
+// Every target port gets a loader context of its own. The flasher task reads
+// each block from storage once and sends the same buffer to all targets
+// still in the job through the non-blocking engine, stepping every context
+// in turn. Steps made of several commands (connect, erase, verify) run on a
+// worker task per target instead. A target failing a step is dropped and
+// the others carry on.
 
-void FlasherTask::setStatus(String msg) {
-    flashStatus = msg;
-    log(msg); // Auto-log status changes
+enum GangOp {
+    GANG_CONNECT,
+    GANG_BEGIN,
+    GANG_DEFLATE_BEGIN,
+    GANG_ERASE,
+    GANG_VERIFY,
+    GANG_FINISH
+};
+
+// Step all workers run on their targets, filled in before they are woken up
+struct GangStep {
+    GangOp op;
+    uint32_t address;
+    uint32_t size;
+    uint32_t compressedSize;
+    uint32_t blockSize;
+    uint8_t md5[16];
+};
+
+struct GangTarget {
+    uint32_t uart = 0;
+    esp_loader_t *loader = nullptr;
+    TaskHandle_t task = NULL;
+    bool alive = false;
+    bool sending = false; // Block submitted, response outstanding
+    bool stub = false;
+    target_chip_t chip = ESP_UNKNOWN_CHIP;
+    uint32_t baudrate = 0;
+    esp_loader_error_t err = ESP_LOADER_SUCCESS;
+    String status;
+};
+
+static GangTarget gangTargets[GANG_SIZE];
+static GangStep gangStep;
+static SemaphoreHandle_t gangDone = NULL;
+
+static esp_loader_error_t runGangStep(GangTarget &target, const GangStep &step) {
+    switch (step.op) {
+    case GANG_CONNECT: {
+        esp_loader_connect_args_t connect_config = ESP_LOADER_CONNECT_DEFAULT();
+        connect_config.load_stub = FLASHER_USE_STUB;
+        connect_config.baudrate = FLASHER_BAUD_RATE;
+        // Resets the target into the bootloader itself
+        RETURN_ON_ERROR( esp_loader_connect(&connect_config) );
+        target.chip = esp_loader_get_target();
+        target.stub = esp_loader_is_stub_running();
+        target.baudrate = FLASHER_BAUD_RATE;
+        RETURN_ON_ERROR( negotiateBaudrate(target.uart, &target.baudrate) );
+        Serial.printf("UART%u: target %d at %u baud\n", target.uart, target.chip, target.baudrate);
+        return ESP_LOADER_SUCCESS;
+    }
+    case GANG_BEGIN:
+        return esp_loader_flash_start(step.address, step.size, step.blockSize);
+    case GANG_DEFLATE_BEGIN:
+        return esp_loader_flash_deflate_start(step.address, step.size, step.compressedSize, step.blockSize);
+    case GANG_ERASE:
+        return esp_loader_flash_erase_region(step.address, step.size);
+    case GANG_VERIFY:
+        return esp_loader_flash_verify_known_md5(step.address, step.size, step.md5);
+    case GANG_FINISH:
+        loader_port_change_baudrate(FLASHER_BAUD_RATE);
+        esp_loader_reset_target();
+        return ESP_LOADER_SUCCESS;
+    }
+    return ESP_LOADER_ERROR_INVALID_PARAM;
 }
 
-void FlasherTask::log(String msg) {
-    if (_logs.size() >= MAX_LOG_SIZE) {
-        _logs.erase(_logs.begin()); // Remove oldest
+static void gangWorker(void *pvParameters) {
+    GangTarget *target = (GangTarget *)pvParameters;
+    esp_loader_bind(target->loader);
+
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        target->err = runGangStep(*target, gangStep);
+        xSemaphoreGive(gangDone);
+    }
+}
+
+// Contexts (~33KB each) and workers are only created by the first gang job
+static bool gangBegin() {
+    if (gangDone) return true;
+
+    gangDone = xSemaphoreCreateCounting(GANG_SIZE, 0);
+    if (!gangDone) return false;
+
+    for (size_t i = 0; i < GANG_SIZE; i++) {
+        GangTarget &target = gangTargets[i];
+        target.uart = (i == 0) ? TARGET_UART_PORT : GANG_PORTS[i - 1].uart;
+        loader_esp32_port_t *port = loader_port_esp32_get(target.uart);
+        // Targets without a port or memory are reported failed by every job
+        if (!port) continue;
+        target.loader = esp_loader_create(port);
+        if (!target.loader) continue;
+        xTaskCreatePinnedToCore(gangWorker, "GangWorker", 6144, &target, 1, &target.task, 1);
     }
-    // Add timestamp or format if needed? For now just raw msg.
-    _logs.push_back(msg);
-    // Serial is already handled by callers usually, but good to ensure
-    // Serial.println("LOG: " + msg); 
+    return true;
 }
 
-std::vector<String> FlasherTask::getLogs(size_t start_index) {
-    std::vector<String> newLogs;
-    if (start_index < _logs.size()) {
-        for (size_t i = start_index; i < _logs.size(); i++) {
-            newLogs.push_back(_logs[i]);
+static void updateGangStatus() {
+    String status;
+    for (const auto &target : gangTargets) {
+        if (status.length()) status += " | ";
+        status += "UART" + String(target.uart) + ": " + target.status;
+    }
+    flashStatus = status;
+}
+
+// Sets the status of every target still in the job
+static void setGangStatus(const String &msg) {
+    for (auto &target : gangTargets) {
+        if (target.alive) target.status = msg;
+    }
+    updateGangStatus();
+}
+
+// Drops the targets that failed the step just run. Returns the number of targets left.
+static size_t gangCollect(const char *phase) {
+    size_t alive = 0;
+    bool dropped = false;
+    for (auto &target : gangTargets) {
+        if (!target.alive) continue;
+        if (target.err != ESP_LOADER_SUCCESS) {
+            target.alive = false;
+            target.status = String(phase) + " Error: " + String(target.err);
+            Serial.printf("UART%u: %s\n", target.uart, target.status.c_str());
+            dropped = true;
+        } else {
+            alive++;
+        }
+    }
+    if (dropped) updateGangStatus();
+    return alive;
+}
+
+// Runs gangStep on every target still in the job and waits for all of them.
+// Targets failing it are dropped. Returns the number of targets left.
+static size_t gangRun(const char *phase) {
+    size_t started = 0;
+    for (auto &target : gangTargets) {
+        if (!target.alive) continue;
+        xTaskNotifyGive(target.task);
+        started++;
+    }
+    for (size_t i = 0; i < started; i++) {
+        xSemaphoreTake(gangDone, portMAX_DELAY);
+    }
+    return gangCollect(phase);
+}
+
+// Sends one block to every target still in the job, all UARTs transmitting
+// at once, and waits for all responses. A step never waits on a port, so
+// the task only sleeps a tick when none of them moved on.
+static size_t gangSend(const uint8_t *data, uint32_t size, bool deflate) {
+    for (auto &target : gangTargets) {
+        target.sending = false;
+        if (!target.alive) continue;
+        // Whole padded blocks only, so the shared buffer is only read
+        target.err = deflate ? esp_loader_async_flash_deflate_write(target.loader, data, size)
+                             : esp_loader_async_flash_write(target.loader, (void *)data, size);
+        target.sending = target.err == ESP_LOADER_SUCCESS;
+    }
+
+    bool pending = true;
+    while (pending) {
+        pending = false;
+        for (auto &target : gangTargets) {
+            if (!target.sending) continue;
+            if (esp_loader_async_step(target.loader) == ESP_LOADER_ASYNC_DONE) {
+                target.err = esp_loader_async_result(target.loader, NULL);
+                target.sending = false;
+            } else {
+                pending = true;
+            }
         }
+        if (pending) vTaskDelay(1);
     }
-    return newLogs;
+    return gangCollect("Write");
 }
 
-size_t FlasherTask::getLogCount() {
-    return _logs.size();
+// Compressed blocks of the one zlib stream go to all targets
+static esp_loader_error_t gangDeflateSink(const uint8_t *block, uint32_t len) {
+    return gangSend(block, len, true) ? ESP_LOADER_SUCCESS : ESP_LOADER_ERROR_FAIL;
+}
+
+static size_t gangAlive() {
+    size_t alive = 0;
+    for (const auto &target : gangTargets) alive += target.alive;
+    return alive;
+}
+
+// Sends one segment to all targets. Returns false on a host side error
+// (storage, compressor), targets failing are only dropped from the job.
+static bool gangWriteSegment(ImageFile &binFile, uint32_t address,
+                             const FlashSegment &segment, BlockReader &reader, uint32_t blockSize,
+                             MD5Context *md5, bool compress, FlashCompressor &compressor) {
+    gangStep.address = address + segment.offset;
+    gangStep.size = segment.size;
+    gangStep.blockSize = blockSize;
+
+    if (segment.erase) {
+        gangStep.op = GANG_ERASE;
+        gangRun("Erase");
+        return true;
+    }
+
+    if (compress) {
+        gangStep.op = GANG_DEFLATE_BEGIN;
+        gangStep.compressedSize = FlashCompressor::compressBound(segment.size);
+    } else {
+        gangStep.op = GANG_BEGIN;
+    }
+    if (!gangRun("Erase")) return true;
+
+    // Each segment is a zlib stream of its own
+    if (compress && !compressor.begin(blockSize)) {
+        flashStatus = "Compression Error";
+        return false;
+    }
+
+    reader.start(binFile, segment.offset, segment.size, blockSize, md5);
+    bool hostOk = true;
+    uint32_t written = 0;
+    while (written < segment.size) {
+        size_t len;
+        uint8_t *block = reader.next(&len);
+        if (!block) {
+            flashStatus = "Read Error";
+            hostOk = false;
+            break;
+        }
+
+        size_t alive;
+        if (compress) {
+            // Sink fails once no target is left
+            hostOk = compressor.write(block, len) == ESP_LOADER_SUCCESS || !gangAlive();
+            if (!hostOk) flashStatus = "Compression Error";
+            alive = gangAlive();
+        } else {
+            // Padded here, the loader would otherwise pad the shared block for every target
+            memset(block + len, 0xFF, blockSize - len);
+            alive = gangSend(block, blockSize, false);
+        }
+        reader.release(block);
+        if (!hostOk || !alive) break;
+
+        written += len;
+        Progress.advance(len);
+    }
+    reader.stop();
+    if (!hostOk || written < segment.size) return hostOk;
+
+    if (compress && compressor.finish() != ESP_LOADER_SUCCESS && gangAlive()) {
+        flashStatus = "Compression Error";
+        return false;
+    }
+    return true;
+}
+
+// Flashes the sessions of plan to all target ports. Delta mode is per target and not
+// available here; sparse scanning and compression are done once for all.
+static bool gangJob(const FlashPlan &plan, uint8_t *buffer, BlockReader &reader, FlashCompressor &compressor) {
+    if (!gangBegin()) {
+        flashStatus = "Gang Error: Out of memory";
+        return false;
+    }
+
+    for (auto &target : gangTargets) {
+        target.alive = target.task != NULL;
+        target.status = target.alive ? "Connecting..." : "Port Error";
+    }
+    updateGangStatus();
+
+    Progress.setPhase("Connecting");
+    gangStep.op = GANG_CONNECT;
+    size_t alive = gangRun("Connect");
+
+    // The image is built for one chip, boards of another kind are dropped
+    target_chip_t chip = ESP_UNKNOWN_CHIP;
+    bool stub = true;
+    uint32_t baudrate = UINT32_MAX;
+    for (auto &target : gangTargets) {
+        if (!target.alive) continue;
+        if (chip == ESP_UNKNOWN_CHIP) chip = target.chip;
+        if (target.chip != chip) {
+            target.alive = false;
+            target.status = "Error: Different chip";
+            alive--;
+            continue;
+        }
+        stub = stub && target.stub;
+        baudrate = min(baudrate, target.baudrate);
+    }
+    // Each block waits for the slowest target
+    if (alive) Progress.setTarget(chip, baudrate);
+
+    // The slowest loader sets block size and features for the whole gang
+    uint32_t blockSize = stub ? FLASHER_STUB_BLOCK_SIZE : FLASHER_BLOCK_SIZE;
+    bool romOnly = chip == ESP8266_CHIP && !stub;
+    bool compress = jobOptions.compress && !romOnly;
+    bool verify = jobOptions.verify && !romOnly;
+    bool storageOk = true;
+
+    if (compress && !compressor.begin(blockSize)) {
+        Serial.println("Compression unavailable, flashing uncompressed");
+        compress = false;
+    }
+    compressor.setSink(gangDeflateSink);
+
+    plan.log(blockSize, false, verify);
+    for (const auto &session : plan.sessions()) {
+        Progress.plan(JobProgress::WRITE, session.size);
+        if (verify) Progress.plan(JobProgress::VERIFY, session.size);
+    }
+    int sessionCount = 0;
+    for (const auto &session : plan.sessions()) {
+        if (!alive) break;
+        sessionCount++;
+        String name = session.name();
+        String statusMsg = "Flashing " + String(sessionCount) + "/" + String(plan.sessions().size()) + ": " + name;
+        setGangStatus(statusMsg);
+        Serial.println(statusMsg);
+        Progress.setItem(name, sessionCount, plan.sessions().size());
+
+        ImageFile binFile = openSession(session);
+        if (!binFile) {
+            flashStatus = "Error: " + name + " missing";
+            storageOk = false;
+            break;
+        }
+
+        uint32_t binSize = binFile.size();
+        MD5Context md5;
+        MD5Init(&md5);
+
+        std::vector<FlashSegment> segments;
+        segments.push_back({0, binSize});
+        uint8_t digest[16];
+        bool digestKnown = binFile.digest(digest);
+        MD5Context *writeMd5 = digestKnown ? nullptr : &md5;
+        if (jobOptions.sparse) {
+            if (splitSparse(binFile, segments, buffer, blockSize, &md5) != ESP_LOADER_SUCCESS) {
+                binFile.close();
+                storageOk = false;
+                break;
+            }
+            writeMd5 = nullptr;
+        }
+
+        Progress.setPhase("Writing");
+        Progress.enter(JobProgress::WRITE);
+        for (const auto &segment : segments) {
+            if (segment.erase) Progress.skip(JobProgress::WRITE, segment.size);
+            storageOk = gangWriteSegment(binFile, session.address, segment, reader, blockSize,
+                                         writeMd5, compress, compressor);
+            if (!storageOk || !gangAlive()) break;
+        }
+        binFile.close();
+        if (!storageOk) break;
+
+        alive = gangAlive();
+
+        if (verify && alive) {
+            setGangStatus("Verifying " + name);
+            Progress.setPhase("Verifying");
+            Progress.enter(JobProgress::VERIFY);
+            gangStep.op = GANG_VERIFY;
+            gangStep.address = session.address;
+            gangStep.size = binSize;
+            if (digestKnown) {
+                memcpy(gangStep.md5, digest, sizeof(digest));
+            } else {
+                MD5Final(gangStep.md5, &md5);
+            }
+            alive = gangRun("Verify");
+            Progress.advance(binSize);
+        }
+    }
+    compressor.setSink(nullptr);
+    logStalls(reader);
+
+    size_t succeeded = 0;
+    for (auto &target : gangTargets) {
+        if (!target.alive) continue;
+        if (storageOk) {
+            target.status = "Success";
+            succeeded++;
+        } else {
+            target.status = "Aborted";
+        }
+    }
+    String storageError = storageOk ? "" : flashStatus;
+    updateGangStatus();
+    if (!storageOk) flashStatus = storageError + " | " + flashStatus;
+    Serial.printf("Gang: %u of %u targets flashed\n", succeeded, GANG_SIZE);
+
+    // Every target that was reached goes back to its application
+    for (auto &target : gangTargets) {
+        target.alive = target.task != NULL;
+    }
+    gangStep.op = GANG_FINISH;
+    gangRun("Reset");
+
+    return succeeded == GANG_SIZE;
 }
 
 void FlasherTask::flasherTask(void *pvParameters) {
     // Setup esp-loader config
     esp_loader_connect_args_t connect_config = ESP_LOADER_CONNECT_DEFAULT();
+    connect_config.load_stub = FLASHER_USE_STUB;
+    connect_config.baudrate = FLASHER_BAUD_RATE;
+    // Heap buffer, the task stack is too small for a flash block
+    uint8_t *buffer = (uint8_t *)malloc(max(FLASHER_BLOCK_SIZE, FLASHER_STUB_BLOCK_SIZE));
+    FlashCompressor compressor;
+    // Storage reads and hashing run ahead of the UART on a task of their own
+    BlockReader reader;
+    bool readerReady = reader.begin(max(FLASHER_BLOCK_SIZE, FLASHER_STUB_BLOCK_SIZE), FLASHER_READ_AHEAD);
 
+    FlashJob *job = nullptr;
     while (true) {
-        // Wait for notification
-        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
-        
-        if (fileQueue.empty()) {
+        // Every way out of the last job ends up here, Progress has its outcome
+        if (job) {
+            bool success = Progress.succeeded();
+            String result = flashStatus;
+            Auto.finished(job, success, result, esp_loader_get_session()->mac);
+            // Lets an upload still arriving know it is no longer taken
+            if (job->type == JOB_STREAM) Feed.close();
+            Jobs.finish(job, success, result);
+        }
+
+        // A queued job starts right away. The wait is bounded so that auto
+        // mode, once armed, can probe for boards while nothing is queued.
+        job = Jobs.next(FLASHER_AUTO_PROBE_MS);
+        if (!job) {
+            Auto.poll();
+            continue;
+        }
+        jobType = job->type;
+        fileQueue = job->files;
+        jobOptions = job->options;
+        readJob = job->file;
+        readSize = job->size;
+        flashingActive = true;
+        Progress.start();
+
+        if (jobType == JOB_WRITE && fileQueue.empty()) {
             flashStatus = "Error: No files";
+            Progress.finish(false);
+            flashingActive = false;
+            continue;
+        }
+        if (jobType == JOB_WRITE && !readerReady) {
+            flashStatus = "Error: Out of memory";
+            Progress.finish(false);
+            flashingActive = false;
+            continue;
+        }
+
+        // Checked before the target is touched
+        FlashPlan plan;
+        String planError;
+        if (jobType == JOB_WRITE && !plan.build(fileQueue, planError)) {
+            flashStatus = "Error: " + planError;
+            Serial.println(flashStatus);
+            Progress.finish(false);
             flashingActive = false;
             continue;
         }
 
         flashStatus = "Starting...";
-        flashProgress = 0;
-        Serial.println("Flasher Task Started.");
+        Serial.printf("Flasher Task Started, job #%u.\n", job->id);
+
+        if (jobType == JOB_PIN) {
+            flashStatus = "Pinning " + readJob.name;
+            Serial.println(flashStatus);
+            File source = SDStorage.openFile(("/" + readJob.name).c_str());
+            if (source) {
+                Progress.plan(JobProgress::COPY, source.size());
+                source.close();
+            }
+            Progress.setPhase("Pinning");
+            Progress.setItem(readJob.name, 1, 1);
+            Progress.enter(JobProgress::COPY);
+            String error;
+            bool success = Pinned.pin(readJob.name, buffer, max(FLASHER_BLOCK_SIZE, FLASHER_STUB_BLOCK_SIZE),
+                                      error, pinProgress);
+            if (success) {
+                flashStatus = "Pinned " + readJob.name;
+            } else {
+                flashStatus = "Pin Error: " + error;
+            }
+            Serial.println(flashStatus);
+            Progress.finish(success);
+            flashingActive = false;
+            continue;
+        }
+
+        if (jobType == JOB_WRITE && jobOptions.gang) {
+            bool success = gangJob(plan, buffer, reader, compressor);
+            Progress.finish(success);
+            compressor.end();
+            Serial.println(success ? "\nAll Targets Flashed Successfully!" : "\nGang Job Failed on some Targets!");
+            flashingActive = false;
+            continue;
+        }
         
         // Reset Target into Bootloader
         loader_port_enter_bootloader();
 
         // Connect
         flashStatus = "Connecting...";
+        Progress.setPhase("Connecting");
+        esp_loader_reset_round_trips();
         esp_loader_error_t err = esp_loader_connect(&connect_config);
         if (err != ESP_LOADER_SUCCESS) {
             flashStatus = "Connect Error: " + String(err);
             Serial.printf("Connect Error: %d\n", err);
+            Progress.finish(false);
             flashingActive = false;
             continue;
         }
@@ -184,79 +1086,231 @@ void FlasherTask::flasherTask(void *pvParameters) {
         // Get Target Info
         target_chip_t target = esp_loader_get_target(); 
         Serial.printf("Detected Target: %d\n", target);
+        if (job->chip != ESP_UNKNOWN_CHIP && target != job->chip) {
+            flashStatus = "Error: Wrong chip, expected " + job->target;
+            Serial.println(flashStatus);
+            Progress.finish(false);
+            esp_loader_reset_target();
+            flashingActive = false;
+            continue;
+        }
+        const esp_loader_session_t *session = esp_loader_get_session();
+        Serial.printf("MAC: %02x:%02x:%02x:%02x:%02x:%02x, Flash ID: 0x%06x (%u KB)\n",
+                      session->mac[0], session->mac[1], session->mac[2],
+                      session->mac[3], session->mac[4], session->mac[5],
+                      session->flash_id, session->flash_size / 1024);
+        logRoundTrips("Connect");
+
+        // Stub takes larger blocks and lifts the ESP8266 ROM limitations below
+        bool stub = esp_loader_is_stub_running();
+        uint32_t blockSize = stub ? FLASHER_STUB_BLOCK_SIZE : FLASHER_BLOCK_SIZE;
+        Serial.println(stub ? "Flasher stub running" : "Using ROM loader");
 
-        // Set Higher Baudrate
+        // Highest baud rate this fixture has proven, or the whole ladder the first time
         flashStatus = "Setting Baudrate...";
-        if (esp_loader_change_baudrate(FLASHER_HIGHER_BAUD) == ESP_LOADER_SUCCESS) {
-             Serial2.updateBaudRate(FLASHER_HIGHER_BAUD);
-             Serial.println("Baudrate Updated");
-        } else {
-             Serial.println("Failed to change baudrate, continuing at default");
+        Progress.setPhase("Setting Baudrate");
+        uint32_t baudrate = FLASHER_BAUD_RATE;
+        err = negotiateBaudrate(TARGET_UART_PORT, &baudrate);
+        if (err != ESP_LOADER_SUCCESS) {
+            flashStatus = "Connect Error: " + String(err);
+            Serial.printf("Baudrate negotiation lost the target: %d\n", err);
+            esp_loader_reset_target();
+            Progress.finish(false);
+            flashingActive = false;
+            continue;
         }
+        Serial.printf("Baudrate: %u\n", baudrate);
+        logRoundTrips("Baudrate");
+        Progress.setTarget(target, baudrate);
 
-        // --- Multi-File Flash Loop ---
-        int fileCount = 0;
-        int totalFiles = fileQueue.size();
         bool globalSuccess = true;
 
-        for (const auto& f : fileQueue) {
-            fileCount++;
-            String statusMsg = "Flashing " + String(fileCount) + "/" + String(totalFiles) + ": " + f.name;
-            flashStatus = statusMsg;
-            Serial.println(statusMsg);
-
-            File binFile = SDStorage.openFile(("/" + f.name).c_str());
-            if (!binFile) {
-                flashStatus = "Error: " + f.name + " missing";
-                Serial.println(flashStatus);
-                globalSuccess = false;
-                break;
+        if (jobType == JOB_READ) {
+            Progress.plan(JobProgress::READ, readSize);
+            Progress.setPhase("Reading");
+            Progress.setItem(readJob.name, 1, 1);
+            Progress.enter(JobProgress::READ);
+            globalSuccess = readToFile(buffer, blockSize);
+            logRoundTrips("Read");
+        } else if (jobType == JOB_STREAM) {
+            bool romOnly = target == ESP8266_CHIP && !stub;
+            bool compress = jobOptions.compress && !romOnly;
+            bool verify = jobOptions.verify && !romOnly;
+            if (compress && !compressor.begin(blockSize)) {
+                Serial.println("Compression unavailable, flashing uncompressed");
+                compress = false;
             }
 
-            uint32_t binSize = binFile.size();
-            uint32_t flashAddress = f.address;
-            
-            err = esp_loader_flash_start(flashAddress, binSize, 4096);
-            if (err != ESP_LOADER_SUCCESS) {
-                flashStatus = "Erase Error: " + String(err);
-                binFile.close();
-                globalSuccess = false;
-                break;
+            String name = readJob.name.length() ? readJob.name : "upload";
+            flashStatus = "Streaming " + name;
+            Serial.println(flashStatus);
+            Progress.plan(JobProgress::WRITE, readSize);
+            if (verify) Progress.plan(JobProgress::VERIFY, readSize);
+            Progress.setItem(name, 1, 1);
+            Progress.setPhase("Writing");
+            Progress.enter(JobProgress::WRITE);
+            err = writeStream(readJob.address, readSize, blockSize, compress ? &compressor : nullptr);
+            logRoundTrips("Write");
+            Serial.printf("Stream: upload waited %u times for the UART\n", Feed.stalls());
+
+            // The digest was taken as the upload arrived
+            if (err == ESP_LOADER_SUCCESS && verify) {
+                flashStatus = "Verifying " + name;
+                Progress.setPhase("Verifying");
+                Progress.enter(JobProgress::VERIFY);
+                uint8_t digest[16];
+                Feed.digest(digest);
+                err = esp_loader_flash_verify_known_md5(readJob.address, readSize, digest);
+                Progress.advance(readSize);
+                if (err != ESP_LOADER_SUCCESS) flashStatus = "Verify Error: " + name;
+                logRoundTrips("Verify");
             }
+            globalSuccess = err == ESP_LOADER_SUCCESS;
+        } else {
+            // ESP8266 ROM can neither inflate nor compute flash MD5
+            bool romOnly = target == ESP8266_CHIP && !stub;
+            bool compress = jobOptions.compress && !romOnly;
+            bool verify = jobOptions.verify && !romOnly;
+            bool delta = jobOptions.delta && !romOnly;
+            bool sparse = jobOptions.sparse;
+
+            // --- Multi-File Flash Loop ---
+            // One pass per erase session, files merged by the plan form one image
+            plan.log(blockSize, delta, verify);
+            for (const auto &session : plan.sessions()) {
+                if (delta) Progress.plan(JobProgress::COMPARE, session.size);
+                Progress.plan(JobProgress::WRITE, session.size);
+                if (verify) Progress.plan(JobProgress::VERIFY, session.size);
+            }
+            int sessionCount = 0;
+            int totalSessions = plan.sessions().size();
 
-            uint8_t buffer[4096]; // Use larger buffer usually safe with esp-loader
-            uint32_t written = 0;
+            for (const auto &session : plan.sessions()) {
+                sessionCount++;
+                String name = session.name();
+                String statusMsg = "Flashing " + String(sessionCount) + "/" + String(totalSessions) + ": " + name;
+                flashStatus = statusMsg;
+                Serial.println(statusMsg);
+                Progress.setItem(name, sessionCount, totalSessions);
 
-             while (binFile.available()) {
-                size_t len = binFile.read(buffer, sizeof(buffer));
-                err = esp_loader_flash_write(buffer, len);
-                if (err != ESP_LOADER_SUCCESS) {
-                    flashStatus = "Write Error: " + String(err);
+                ImageFile binFile = openSession(session);
+                if (!binFile) {
+                    flashStatus = "Error: " + name + " missing";
+                    Serial.println(flashStatus);
+                    globalSuccess = false;
                     break;
                 }
-                written += len;
-                // Progress is relative to current file for simplicity, 
-                // or we could calculate total job progress. Stick to per-file for now.
-                flashProgress = (written * 100) / binSize; 
-            }
-            binFile.close();
 
-            if (err != ESP_LOADER_SUCCESS) {
-                globalSuccess = false;
-                break;
+                uint32_t binSize = binFile.size();
+                uint32_t flashAddress = session.address;
+
+                MD5Context md5;
+                MD5Init(&md5);
+
+                // Without delta the whole image is one segment, hashed while it is written
+                std::vector<FlashSegment> segments;
+                // Pinned images come with their digest
+                uint8_t digest[16];
+                bool digestKnown = binFile.digest(digest);
+                MD5Context *writeMd5 = digestKnown ? nullptr : &md5;
+                if (delta) {
+                    flashStatus = "Comparing " + name;
+                    Progress.setPhase("Comparing");
+                    Progress.enter(JobProgress::COMPARE);
+                    err = findChangedSegments(binFile, flashAddress, binSize, buffer, blockSize, &md5, segments);
+                    writeMd5 = nullptr;
+                    if (err == ESP_LOADER_SUCCESS) {
+                        uint32_t changed = 0;
+                        for (const auto &segment : segments) changed += segment.size;
+                        Progress.skip(JobProgress::WRITE, binSize - changed);
+                        if (segments.empty()) Progress.skip(JobProgress::VERIFY, binSize);
+                        Serial.printf("%s: %u of %u bytes changed in %u segments\n",
+                                      name.c_str(), changed, binSize, segments.size());
+                    }
+                    logRoundTrips("Compare");
+                } else {
+                    segments.push_back({0, binSize});
+                }
+
+                // Sparse scan hashes the data when delta did not
+                if (sparse && err == ESP_LOADER_SUCCESS) {
+                    flashStatus = "Scanning " + name;
+                    Progress.setPhase("Scanning");
+                    err = splitSparse(binFile, segments, buffer, blockSize, writeMd5);
+                    writeMd5 = nullptr;
+                    uint32_t skipped = 0;
+                    for (const auto &segment : segments) {
+                        if (segment.erase) skipped += segment.size;
+                    }
+                    Progress.skip(JobProgress::WRITE, skipped);
+                    Serial.printf("%s: %u bytes of 0xFF only erased\n", name.c_str(), skipped);
+                }
+
+                if (!segments.empty()) {
+                    flashStatus = statusMsg;
+                    Progress.setPhase("Writing");
+                    Progress.enter(JobProgress::WRITE);
+                }
+
+                for (const auto &segment : segments) {
+                    if (err != ESP_LOADER_SUCCESS) break;
+
+                    if (segment.erase) {
+                        err = esp_loader_flash_erase_region(flashAddress + segment.offset, segment.size);
+                        if (err != ESP_LOADER_SUCCESS) {
+                            flashStatus = "Erase Error: " + String(err);
+                        }
+                        continue;
+                    }
+
+                    if (compress && !compressor.begin(blockSize)) {
+                        Serial.println("Compression unavailable, flashing uncompressed");
+                        compress = false;
+                    }
+
+                    if (compress) {
+                        err = writeCompressed(binFile, flashAddress, segment, reader, blockSize, writeMd5, compressor);
+                    } else {
+                        err = writeRaw(binFile, flashAddress, segment, reader, blockSize, writeMd5);
+                    }
+                }
+                binFile.close();
+                logRoundTrips("Write");
+                logStalls(reader);
+
+                // Unchanged images already matched region by region
+                if (err == ESP_LOADER_SUCCESS && verify && !segments.empty()) {
+                    flashStatus = "Verifying " + name;
+                    Progress.setPhase("Verifying");
+                    Progress.enter(JobProgress::VERIFY);
+                    if (!digestKnown) MD5Final(digest, &md5);
+                    err = esp_loader_flash_verify_known_md5(flashAddress, binSize, digest);
+                    Progress.advance(binSize);
+                    if (err != ESP_LOADER_SUCCESS) {
+                        flashStatus = "Verify Error: " + name;
+                    }
+                    logRoundTrips("Verify");
+                }
+
+                if (err != ESP_LOADER_SUCCESS) {
+                    globalSuccess = false;
+                    break;
+                }
             }
         }
+        compressor.end();
+        Progress.finish(globalSuccess);
 
         // Verification or Finish
         if (globalSuccess) {
             flashStatus = "Success";
-            Serial.println("\nAll Files Flashed Successfully!");
+            Serial.println(jobType == JOB_READ ? "\nFlash Read Successfully!" : "\nAll Files Flashed Successfully!");
         } else {
             Serial.println("\nFlash Job Failed!");
         }
         
         // Restore default baud
-        Serial2.updateBaudRate(FLASHER_BAUD_RATE);
+        loader_port_change_baudrate(FLASHER_BAUD_RATE);
         esp_loader_reset_target(); 
         
         flashingActive = false;
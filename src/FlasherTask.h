@@ -3,6 +3,7 @@
 
 #include <Arduino.h>
 #include <vector>
+#include "ConfigFile.h"
 #include "esp-loader/esp_loader.h"
 
 struct FlashFile {
@@ -10,21 +11,38 @@ struct FlashFile {
     uint32_t address;
 };
 
+struct FlashOptions {
+    bool compress = FLASHER_COMPRESS;
+    bool verify = FLASHER_VERIFY;
+    bool delta = FLASHER_DELTA;
+    bool sparse = FLASHER_SPARSE;
+    bool gang = false; // Flash every target port at once (FLASHER_GANG_PORTS)
+};
+
 class FlasherTask {
 public:
     void begin();
-    bool flashFirmware(String targetName, std::vector<FlashFile> files);
-    bool isFlashing();
+    // Jobs are queued behind the running one (see JobQueue). Each call
+    // returns the job id, 0 when the queue is full.
+    uint32_t flashFirmware(String targetName, std::vector<FlashFile> files, FlashOptions options = FlashOptions());
+    // Dumps size bytes of the target's flash at address into fileName on storage
+    uint32_t readFlash(String targetName, uint32_t address, uint32_t size, String fileName);
+    // Flashes the /flash_stream upload being received (see FlashStream) at
+    // address, size bytes. teeName is only for the job list. Refused (0)
+    // while another job is queued or running, the stream cannot wait.
+    uint32_t flashStream(String targetName, uint32_t address, uint32_t size, String teeName,
+                         FlashOptions options = FlashOptions());
+    // Copies fileName from storage into the pinned images partition
+    uint32_t pinImage(String fileName);
+    bool isFlashing(); // A job is running or waiting
     int getProgress();
     String getStatus();
-    void setStatus(String msg);
-    void log(String msg);
-    std::vector<String> getLogs(size_t start_index);
-    size_t getLogCount();
+    void setStatus(const String &msg);
+    // Activity log for the web UI, see LogRing
+    void log(const char *msg);
 
 private:
     static void flasherTask(void *pvParameters);
-    std::vector<String> _logs;
 };
 
 extern FlasherTask Flasher;
@@ -0,0 +1,242 @@
+#include "ImageCache.h"
+#include "SDStorage.h"
+#include "ConfigFile.h"
+#include <esp_heap_caps.h>
+
+ImageCache Images;
+
+CachedImage::~CachedImage() {
+    heap_caps_free(data);
+}
+
+ImageFile::ImageFile(std::vector<Part> parts, size_t size)
+    : _parts(std::make_shared<std::vector<Part>>(std::move(parts))), _size(size) {}
+
+size_t ImageFile::size() const {
+    return _data || _parts ? _size : _file.size();
+}
+
+size_t ImageFile::position() const {
+    return _data || _parts ? _pos : _file.position();
+}
+
+bool ImageFile::seek(uint32_t pos) {
+    if (!_data && !_parts) return _file.seek(pos);
+    if (pos > _size) return false;
+    _pos = pos;
+    return true;
+}
+
+size_t ImageFile::read(uint8_t *buffer, size_t len) {
+    if (_parts) return readParts(buffer, len);
+    if (!_data && _fill) {
+        uint32_t pos = _file.position();
+        if (pos > _fill->filled && !fillGap(pos)) _fill.reset();
+        len = _file.read(buffer, len);
+        if (_fill) fillFrom(pos, buffer, len);
+        return len;
+    }
+    if (!_data) return _file.read(buffer, len);
+    len = min(len, _size - _pos);
+    memcpy(buffer, _data + _pos, len);
+    _pos += len;
+    return len;
+}
+
+size_t ImageFile::readParts(uint8_t *buffer, size_t len) {
+    len = min(len, _size - _pos);
+    size_t done = 0;
+    while (done < len) {
+        uint32_t pos = _pos + done;
+        size_t chunk = len - done;
+
+        // Part holding pos, or the gap up to the next one
+        Part *part = nullptr;
+        for (auto &p : *_parts) {
+            if (pos < p.offset) {
+                chunk = min(chunk, (size_t)(p.offset - pos));
+                break;
+            }
+            if (pos < p.offset + p.image.size()) {
+                part = &p;
+                chunk = min(chunk, p.offset + p.image.size() - pos);
+                break;
+            }
+        }
+
+        if (part) {
+            // Parts are read front to back, storage files rarely need a seek
+            if (part->image.position() != pos - part->offset) part->image.seek(pos - part->offset);
+            chunk = part->image.read(buffer + done, chunk);
+            if (chunk == 0) break;
+        } else {
+            memset(buffer + done, 0xFF, chunk);
+        }
+        done += chunk;
+    }
+    _pos += done;
+    return done;
+}
+
+void ImageFile::fillCache(ImageCache *cache, std::shared_ptr<CachedImage> image, uint32_t generation) {
+    _fill = std::make_shared<Fill>(Fill{cache, image, generation, 0});
+}
+
+// Copies what was just read at pos beyond the bytes already in place
+void ImageFile::fillFrom(uint32_t pos, const uint8_t *data, size_t len) {
+    CachedImage &image = *_fill->image;
+    if (pos + len <= _fill->filled) return;
+    size_t skip = _fill->filled - pos;
+    memcpy(image.data + _fill->filled, data + skip, len - skip);
+    _fill->filled = pos + len;
+
+    if (_fill->filled == image.size) {
+        _fill->cache->publish(_fill->image, _fill->generation);
+        _fill.reset();
+    }
+}
+
+// A read skipping ahead, e.g. to a changed segment: loads the bytes in
+// between, so the fill stays in one piece
+bool ImageFile::fillGap(uint32_t pos) {
+    CachedImage &image = *_fill->image;
+    _file.seek(_fill->filled);
+    while (_fill->filled < pos) {
+        size_t len = _file.read(image.data + _fill->filled, pos - _fill->filled);
+        if (len == 0) break;
+        _fill->filled += len;
+    }
+    _file.seek(pos);
+    return _fill->filled == pos;
+}
+
+void ImageFile::close() {
+    _fill.reset();
+    if (_file) _file.close();
+    if (_parts) {
+        for (auto &part : *_parts) part.image.close();
+    }
+    _parts.reset();
+    _owner.reset();
+    _data = nullptr;
+}
+
+void ImageFile::setDigest(const uint8_t digest[16]) {
+    memcpy(_digest, digest, sizeof(_digest));
+    _hasDigest = true;
+}
+
+bool ImageFile::digest(uint8_t digest[16]) const {
+    if (_hasDigest) memcpy(digest, _digest, sizeof(_digest));
+    return _hasDigest;
+}
+
+void ImageCache::begin() {
+    if (_lock) return;
+    _lock = xSemaphoreCreateMutex();
+
+    size_t psram = heap_caps_get_total_size(MALLOC_CAP_SPIRAM);
+    _capacity = min((size_t)FLASHER_IMAGE_CACHE_SIZE, psram / 2);
+    if (_capacity) {
+        Serial.printf("Image cache: %u KB of PSRAM\n", _capacity / 1024);
+    } else {
+        Serial.println("Image cache disabled, no PSRAM");
+    }
+}
+
+ImageFile ImageCache::open(const char *path) {
+    File file = SDStorage.openFile(path);
+    if (!file || !_lock) return ImageFile(file);
+
+    size_t size = file.size();
+    time_t lastWrite = file.getLastWrite();
+
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    for (auto it = _entries.begin(); it != _entries.end(); ++it) {
+        std::shared_ptr<CachedImage> image = *it;
+        if (image->path != path) continue;
+
+        if (image->size == size && image->lastWrite == lastWrite) {
+            _entries.splice(_entries.begin(), _entries, it);
+            _hits++;
+            xSemaphoreGive(_lock);
+            file.close();
+            return ImageFile(image, image->data, image->size);
+        }
+        // Changed behind our back, e.g. written over by a read job
+        drop(it);
+        break;
+    }
+    _misses++;
+    uint32_t generation = _generation;
+    xSemaphoreGive(_lock);
+
+    ImageFile image(file);
+    std::shared_ptr<CachedImage> entry = allocate(size, path);
+    if (entry) {
+        entry->lastWrite = lastWrite;
+        image.fillCache(this, entry, generation);
+    }
+    return image;
+}
+
+// PSRAM for an image of size bytes, evicting older entries to make room.
+// Null if it does not fit.
+std::shared_ptr<CachedImage> ImageCache::allocate(size_t size, const char *path) {
+    if (size == 0 || size > _capacity) return nullptr;
+
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    bool room = reserve(size);
+    xSemaphoreGive(_lock);
+    if (!room) return nullptr;
+
+    uint8_t *data = (uint8_t *)heap_caps_malloc(size, MALLOC_CAP_SPIRAM);
+    if (!data) return nullptr;
+    return std::shared_ptr<CachedImage>(new CachedImage{path, size, 0, data});
+}
+
+void ImageCache::publish(std::shared_ptr<CachedImage> image, uint32_t generation) {
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    // Invalidated while filling, the copy may be of a half written file
+    if (generation == _generation && reserve(image->size)) {
+        _entries.push_front(image);
+        _used += image->size;
+    }
+    xSemaphoreGive(_lock);
+}
+
+// Evicts least recently used entries until size more bytes fit
+bool ImageCache::reserve(size_t size) {
+    while (_used + size > _capacity && !_entries.empty()) {
+        drop(std::prev(_entries.end()));
+    }
+    return _used + size <= _capacity;
+}
+
+void ImageCache::drop(std::list<std::shared_ptr<CachedImage>>::iterator it) {
+    _used -= (*it)->size;
+    _entries.erase(it);
+}
+
+void ImageCache::invalidate(const char *path) {
+    if (!_lock) return;
+
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    _generation++;
+    for (auto it = _entries.begin(); it != _entries.end(); ++it) {
+        if ((*it)->path == path) {
+            drop(it);
+            break;
+        }
+    }
+    xSemaphoreGive(_lock);
+}
+
+size_t ImageCache::count() {
+    if (!_lock) return 0;
+
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    size_t entries = _entries.size();
+    xSemaphoreGive(_lock);
+    return entries;
+}
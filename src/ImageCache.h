@@ -0,0 +1,129 @@
+#ifndef IMAGE_CACHE_H
+#define IMAGE_CACHE_H
+
+#include <Arduino.h>
+#include <FS.h>
+#include <list>
+#include <memory>
+#include <vector>
+
+// Image in PSRAM, shared by the cache and the ImageFiles reading it so an
+// entry dropped while a job still reads it lives until the job is done
+struct CachedImage {
+    String path;
+    size_t size;
+    time_t lastWrite;
+    uint8_t *data;
+
+    ~CachedImage();
+};
+
+class ImageCache;
+
+// Image opened for flashing: a view of memory holding the whole image (PSRAM
+// cache, pinned partition), the file on storage, or several of those joined
+// into one image. Reads like a File.
+class ImageFile {
+public:
+    struct Part;
+    struct Fill;
+
+    ImageFile() {}
+    explicit ImageFile(File file) : _file(file) {}
+    // owner keeps data valid for as long as a copy of this ImageFile exists
+    ImageFile(std::shared_ptr<const void> owner, const uint8_t *data, size_t size)
+        : _owner(owner), _data(data), _size(size) {}
+    // parts laid out at their offsets in size bytes, gaps read as 0xFF
+    ImageFile(std::vector<Part> parts, size_t size);
+
+    explicit operator bool() const { return _data || _parts || _file; }
+    // Whole image, null when it is read from storage
+    const uint8_t *data() const { return _data; }
+    size_t size() const;
+    size_t position() const;
+    bool seek(uint32_t pos);
+    size_t read(uint8_t *buffer, size_t len);
+    void close();
+
+    // MD5 of the whole image, when known without reading it
+    void setDigest(const uint8_t digest[16]);
+    bool digest(uint8_t digest[16]) const;
+
+    // Copies what is read from the file into image, which cache takes once
+    // all of it has been read
+    void fillCache(ImageCache *cache, std::shared_ptr<CachedImage> image, uint32_t generation);
+
+private:
+    size_t readParts(uint8_t *buffer, size_t len);
+    void fillFrom(uint32_t pos, const uint8_t *data, size_t len);
+    bool fillGap(uint32_t pos);
+
+    File _file;
+    std::shared_ptr<Fill> _fill;
+    std::shared_ptr<std::vector<Part>> _parts;
+    std::shared_ptr<const void> _owner;
+    const uint8_t *_data = nullptr;
+    size_t _size = 0;
+    size_t _pos = 0;
+    bool _hasDigest = false;
+    uint8_t _digest[16];
+};
+
+struct ImageFile::Part {
+    uint32_t offset;
+    ImageFile image;
+};
+
+// Cache entry being filled by the reads of an ImageFile. Bytes up to
+// filled are in place.
+struct ImageFile::Fill {
+    ImageCache *cache;
+    std::shared_ptr<CachedImage> image;
+    uint32_t generation;
+    size_t filled;
+};
+
+// Keeps recently flashed images in PSRAM, so a fixture flashing the same
+// files over and over only reads them from storage once. Entries are keyed
+// by path, size and modification time, least recently used ones go first
+// when FLASHER_IMAGE_CACHE_SIZE is reached. Boards without PSRAM always read
+// from storage.
+class ImageCache {
+public:
+    void begin();
+
+    // Opens path from the cache. On a miss the image is read from storage
+    // and copied into PSRAM on the way, it joins the cache once the job
+    // has read all of it.
+    ImageFile open(const char *path);
+
+    // Adds an image filled by an ImageFile, unless invalidated since open()
+    void publish(std::shared_ptr<CachedImage> image, uint32_t generation);
+
+    // Drops the entry of path, to be called whenever the file changes
+    void invalidate(const char *path);
+
+    uint32_t hits() const { return _hits; }
+    uint32_t misses() const { return _misses; }
+    size_t used() const { return _used; }
+    size_t capacity() const { return _capacity; }
+    size_t count();
+
+private:
+    std::shared_ptr<CachedImage> allocate(size_t size, const char *path);
+    bool reserve(size_t size);
+    void drop(std::list<std::shared_ptr<CachedImage>>::iterator it);
+
+    // Most recently used first
+    std::list<std::shared_ptr<CachedImage>> _entries;
+    SemaphoreHandle_t _lock = NULL;
+    size_t _capacity = 0;
+    size_t _used = 0;
+    uint32_t _hits = 0;
+    uint32_t _misses = 0;
+    uint32_t _generation = 0; // Bumped by invalidate(), voids fills in progress
+};
+
+extern ImageCache Images;
+
+#endif
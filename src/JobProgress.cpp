@@ -0,0 +1,201 @@
+#include "JobProgress.h"
+#include <Preferences.h>
+
+JobProgress Progress;
+
+// Rates need a few seconds of data before they beat the history
+static const uint32_t MIN_MEASURE_MS = 2000;
+
+void JobProgress::begin() {
+    if (!_lock) _lock = xSemaphoreCreateMutex();
+}
+
+void JobProgress::start() {
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    _active = true;
+    _success = false;
+    _phase = "Starting...";
+    _item = "";
+    _itemIndex = 0;
+    _itemCount = 0;
+    _chip = 0;
+    _baud = 0;
+    _inPass = false;
+    _rate = 0;
+    for (int i = 0; i < PASS_COUNT; i++) {
+        _history[i] = 0;
+        _total[i] = 0;
+        _done[i] = 0;
+        _time[i] = 0;
+    }
+    _start = millis();
+    xSemaphoreGive(_lock);
+}
+
+void JobProgress::setTarget(uint32_t chip, uint32_t baud) {
+    char key[16];
+    snprintf(key, sizeof(key), "r%u_%u", chip, baud);
+    float history[PASS_COUNT] = {};
+
+    Preferences prefs;
+    prefs.begin("flasher", true);
+    if (prefs.getBytesLength(key) == sizeof(history)) {
+        prefs.getBytes(key, history, sizeof(history));
+    }
+    prefs.end();
+
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    _chip = chip;
+    _baud = baud;
+    memcpy(_history, history, sizeof(history));
+    xSemaphoreGive(_lock);
+}
+
+void JobProgress::setPhase(const String &phase) {
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    _phase = phase;
+    xSemaphoreGive(_lock);
+}
+
+void JobProgress::setItem(const String &name, uint32_t index, uint32_t count) {
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    _item = name;
+    _itemIndex = index;
+    _itemCount = count;
+    xSemaphoreGive(_lock);
+}
+
+void JobProgress::plan(Pass pass, uint32_t bytes) {
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    _total[pass] += bytes;
+    xSemaphoreGive(_lock);
+}
+
+void JobProgress::skip(Pass pass, uint32_t bytes) {
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    _total[pass] -= min(bytes, _total[pass] - _done[pass]);
+    xSemaphoreGive(_lock);
+}
+
+// Books the time since the last tick to the current pass. Lock held.
+void JobProgress::tick() {
+    uint32_t now = millis();
+    if (_inPass) _time[_pass] += now - _tick;
+    _tick = now;
+}
+
+void JobProgress::enter(Pass pass) {
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    tick();
+    _pass = pass;
+    _inPass = true;
+    _rate = 0;
+    xSemaphoreGive(_lock);
+}
+
+void JobProgress::advance(uint32_t bytes) {
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    uint32_t last = _tick;
+    tick();
+    _done[_pass] += bytes;
+    if (_tick > last) {
+        float sample = bytes * 1000.0f / (_tick - last);
+        _rate = _rate > 0 ? 0.7f * _rate + 0.3f * sample : sample;
+    }
+    xSemaphoreGive(_lock);
+}
+
+void JobProgress::finish(bool success) {
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    tick();
+    _inPass = false;
+    _active = false;
+    _success = success;
+    _end = _tick;
+    _phase = success ? "Done" : "Failed";
+
+    // Blend into the history, one slow job should not skew it for good
+    bool measured = false;
+    float history[PASS_COUNT];
+    for (int i = 0; i < PASS_COUNT; i++) {
+        history[i] = _history[i];
+        if (_time[i] < MIN_MEASURE_MS || _done[i] == 0) continue;
+        float rate = _done[i] * 1000.0f / _time[i];
+        history[i] = history[i] > 0 ? 0.7f * history[i] + 0.3f * rate : rate;
+        measured = true;
+    }
+    if (success) {
+        for (int i = 0; i < PASS_COUNT; i++) _done[i] = _total[i];
+    }
+    uint32_t chip = _chip;
+    uint32_t baud = _baud;
+    xSemaphoreGive(_lock);
+
+    if (!success || !measured || baud == 0) return;
+
+    char key[16];
+    snprintf(key, sizeof(key), "r%u_%u", chip, baud);
+    Preferences prefs;
+    prefs.begin("flasher", false);
+    prefs.putBytes(key, history, sizeof(history));
+    prefs.end();
+}
+
+// Measured rate once there is enough data, else history, else a guess from
+// the baud rate (10 bits per byte on the wire). Lock held.
+float JobProgress::rateOf(Pass pass) {
+    if (_time[pass] >= MIN_MEASURE_MS && _done[pass] > 0) {
+        return _done[pass] * 1000.0f / _time[pass];
+    }
+    if (_history[pass] > 0) return _history[pass];
+
+    float wire = _baud ? _baud / 10.0f : 11520.0f;
+    switch (pass) {
+        case COMPARE:
+        case VERIFY: return 1000000.0f; // Target hashes its flash much faster than the UART
+        case COPY:   return 200000.0f;
+        default:     return wire;
+    }
+}
+
+JobProgress::Snapshot JobProgress::snapshot() {
+    Snapshot s = {};
+
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    float doneTime = 0;
+    float totalTime = 0;
+    for (int i = 0; i < PASS_COUNT; i++) {
+        uint32_t done = min(_done[i], _total[i]);
+        float rate = rateOf((Pass)i);
+        doneTime += done / rate;
+        totalTime += _total[i] / rate;
+        s.done += done;
+        s.total += _total[i];
+    }
+
+    s.active = _active;
+    s.phase = _phase;
+    s.item = _item;
+    s.itemIndex = _itemIndex;
+    s.itemCount = _itemCount;
+    s.percent = totalTime > 0 ? (uint8_t)(doneTime * 100 / totalTime) : 0;
+    if (_inPass) {
+        s.rate = _rate;
+        s.average = _time[_pass] ? _done[_pass] * 1000.0f / _time[_pass] : 0;
+    }
+    s.elapsed = ((_active ? millis() : _end) - _start) / 1000;
+    s.remaining = _active ? (uint32_t)(totalTime - doneTime) : 0;
+    xSemaphoreGive(_lock);
+    return s;
+}
+
+bool JobProgress::succeeded() {
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    bool success = _success;
+    xSemaphoreGive(_lock);
+    return success;
+}
+
+uint8_t JobProgress::percent() {
+    return snapshot().percent;
+}
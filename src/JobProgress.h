@@ -0,0 +1,91 @@
+#ifndef JOB_PROGRESS_H
+#define JOB_PROGRESS_H
+
+#include <Arduino.h>
+
+// Progress of the whole job rather than of the file being written. A job is
+// planned as bytes to pass through each kind of work (compare, write,
+// verify, ...). Every pass has a rate in bytes/s, measured while it runs and
+// otherwise taken from earlier jobs with the same chip and baud rate (NVS),
+// so percent and remaining time account for passes not started yet.
+class JobProgress {
+public:
+    enum Pass {
+        COMPARE,  // Flash MD5 per region, delta mode
+        WRITE,    // Erase and write, rate is of image bytes (before compression)
+        VERIFY,   // Flash MD5 of whole images
+        READ,     // Flash read back
+        COPY,     // Storage to pinned partition, no target
+        PASS_COUNT
+    };
+
+    struct Snapshot {
+        bool active;
+        String phase;
+        String item;        // Session or file being processed
+        uint32_t itemIndex; // 1 based, 0 before the first
+        uint32_t itemCount;
+        uint8_t percent;
+        uint32_t done;      // Bytes over all passes
+        uint32_t total;
+        uint32_t rate;      // Bytes/s of the current pass, recent blocks only
+        uint32_t average;   // Bytes/s of the current pass over the job
+        uint32_t elapsed;   // Seconds
+        uint32_t remaining; // Seconds, estimated
+    };
+
+    void begin();
+
+    // New job, nothing planned yet
+    void start();
+    // Selects the rate history, known once connected. baud 0 for host only jobs.
+    void setTarget(uint32_t chip, uint32_t baud);
+    void setPhase(const String &phase);
+    void setItem(const String &name, uint32_t index, uint32_t count);
+
+    // Adds work to the plan, or takes back work found to be unnecessary
+    void plan(Pass pass, uint32_t bytes);
+    void skip(Pass pass, uint32_t bytes);
+
+    // Time from enter() on counts towards the rate of pass, so erase waits
+    // before the first block are part of the write rate
+    void enter(Pass pass);
+    void advance(uint32_t bytes);
+
+    // Stores the rates measured by a successful job for the next one
+    void finish(bool success);
+    bool succeeded();
+
+    Snapshot snapshot();
+    uint8_t percent();
+
+private:
+    float rateOf(Pass pass);
+    void tick();
+
+    SemaphoreHandle_t _lock = NULL;
+    bool _active = false;
+    bool _success = false;
+    String _phase = "Ready";
+    String _item;
+    uint32_t _itemIndex = 0;
+    uint32_t _itemCount = 0;
+
+    uint32_t _chip = 0;
+    uint32_t _baud = 0;
+    float _history[PASS_COUNT] = {};
+
+    Pass _pass = WRITE;
+    bool _inPass = false;
+    uint32_t _total[PASS_COUNT] = {};
+    uint32_t _done[PASS_COUNT] = {};
+    uint32_t _time[PASS_COUNT] = {}; // ms spent in each pass
+    uint32_t _tick = 0;
+    uint32_t _start = 0;
+    uint32_t _end = 0;
+    float _rate = 0;            // Smoothed rate of the current pass
+};
+
+extern JobProgress Progress;
+
+#endif
@@ -0,0 +1,241 @@
+#include "JobQueue.h"
+#include "SDStorage.h"
+#include "ConfigFile.h"
+#include <ArduinoJson.h>
+#include <time.h>
+
+JobQueue Jobs;
+
+// New history while it is written, renamed to FLASHER_JOB_FILE when complete
+static const char *JOB_FILE_TEMP = FLASHER_JOB_FILE ".new";
+
+static const char *STATE_NAMES[] = {"queued", "running", "done", "failed", "cancelled"};
+
+const char *JobRecord::stateName(State state) {
+    return STATE_NAMES[state];
+}
+
+static bool parseState(const char *name, JobRecord::State *state) {
+    for (int i = 0; i <= JobRecord::CANCELLED; i++) {
+        if (name && strcmp(name, STATE_NAMES[i]) == 0) {
+            *state = (JobRecord::State)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+void JobQueue::begin() {
+    if (_lock) return;
+    // Cancelled jobs may leave counts behind, next() skips those
+    _ready = xSemaphoreCreateCounting(FLASHER_JOB_QUEUE, 0);
+    _lock = xSemaphoreCreateMutex();
+
+    File file = SDStorage.openFile(FLASHER_JOB_FILE);
+    if (file) {
+        // Left over by a save cut short
+        SDStorage.remove(JOB_FILE_TEMP);
+    } else if (SDStorage.rename(JOB_FILE_TEMP, FLASHER_JOB_FILE)) {
+        // Reset between removing the old file and renaming the new one
+        file = SDStorage.openFile(FLASHER_JOB_FILE);
+    }
+    if (!file) return;
+
+    bool interrupted = false;
+    while (file.available()) {
+        String line = file.readStringUntil('\n');
+        StaticJsonDocument<512> doc;
+        if (deserializeJson(doc, line)) continue;
+
+        JobRecord record;
+        record.id = doc["id"] | 0;
+        if (record.id == 0 || !parseState(doc["state"], &record.state)) continue;
+        record.summary = doc["summary"].as<String>();
+        record.result = doc["result"].as<String>();
+        record.queued = doc["queued"] | 0;
+        record.duration = doc["duration"] | 0;
+
+        if (record.state == JobRecord::QUEUED || record.state == JobRecord::RUNNING) {
+            record.state = JobRecord::FAILED;
+            record.result = "Interrupted by reboot";
+            interrupted = true;
+        }
+        _nextId = max(_nextId, record.id + 1);
+        _records.push_back(record);
+    }
+    file.close();
+
+    trim();
+    if (interrupted) save();
+    Serial.printf("[Jobs] %u in history, next id %u\n", _records.size(), _nextId);
+}
+
+uint32_t JobQueue::submit(FlashJob *job, bool idleOnly) {
+    if (!_lock) {
+        delete job;
+        return 0;
+    }
+
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    if (_jobs.size() >= FLASHER_JOB_QUEUE || (idleOnly && (!_jobs.empty() || _running))) {
+        xSemaphoreGive(_lock);
+        delete job;
+        return 0;
+    }
+    job->id = _nextId++;
+    JobRecord record = {job->id, JobRecord::QUEUED, job->summary, "", (uint32_t)time(nullptr), 0};
+    _records.push_back(record);
+    _jobs.push_back(job);
+    uint32_t id = job->id;
+    save();
+    xSemaphoreGive(_lock);
+
+    xSemaphoreGive(_ready);
+    return id;
+}
+
+bool JobQueue::cancel(uint32_t id) {
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    JobRecord *record = recordOf(id);
+    bool cancelled = false;
+    for (auto it = _jobs.begin(); record && it != _jobs.end(); ++it) {
+        if ((*it)->id != id) continue;
+        delete *it;
+        _jobs.erase(it);
+        record->state = JobRecord::CANCELLED;
+        record->result = "Cancelled";
+        save();
+        cancelled = true;
+        break;
+    }
+    xSemaphoreGive(_lock);
+
+    // Its count, unless next() took it already and finds the FIFO empty
+    if (cancelled) xSemaphoreTake(_ready, 0);
+    return cancelled;
+}
+
+FlashJob *JobQueue::next(uint32_t waitMs) {
+    TickType_t ticks = waitMs == portMAX_DELAY ? portMAX_DELAY : pdMS_TO_TICKS(waitMs);
+    while (true) {
+        if (xSemaphoreTake(_ready, ticks) != pdTRUE) return nullptr;
+
+        xSemaphoreTake(_lock, portMAX_DELAY);
+        FlashJob *job = nullptr;
+        if (!_jobs.empty()) {
+            job = _jobs.front();
+            _jobs.pop_front();
+            JobRecord *record = recordOf(job->id);
+            if (record) record->state = JobRecord::RUNNING;
+            _running = job->id;
+            _startedMs = millis();
+            save();
+        }
+        xSemaphoreGive(_lock);
+
+        if (job) {
+            Serial.printf("[Jobs] #%u started: %s\n", job->id, job->summary.c_str());
+            return job;
+        }
+        // Count of a cancelled job
+        if (ticks != portMAX_DELAY) return nullptr;
+    }
+}
+
+void JobQueue::finish(FlashJob *job, bool success, const String &result) {
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    JobRecord *record = recordOf(job->id);
+    if (record) {
+        record->state = success ? JobRecord::DONE : JobRecord::FAILED;
+        record->result = result;
+        record->duration = (millis() - _startedMs) / 1000;
+    }
+    _running = 0;
+    trim();
+    save();
+    xSemaphoreGive(_lock);
+
+    Serial.printf("[Jobs] #%u %s: %s\n", job->id, success ? "done" : "failed", result.c_str());
+    delete job;
+}
+
+size_t JobQueue::pending() {
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    size_t count = _jobs.size();
+    xSemaphoreGive(_lock);
+    return count;
+}
+
+std::vector<JobRecord> JobQueue::records() {
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    std::vector<JobRecord> copy(_records.begin(), _records.end());
+    xSemaphoreGive(_lock);
+    return copy;
+}
+
+bool JobQueue::find(uint32_t id, JobRecord &record) {
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    JobRecord *found = recordOf(id);
+    if (found) record = *found;
+    xSemaphoreGive(_lock);
+    return found != nullptr;
+}
+
+// Lock held
+JobRecord *JobQueue::recordOf(uint32_t id) {
+    for (auto &record : _records) {
+        if (record.id == id) return &record;
+    }
+    return nullptr;
+}
+
+// Drops the oldest finished records beyond the history size. Lock held.
+void JobQueue::trim() {
+    size_t finished = 0;
+    for (const auto &record : _records) {
+        if (record.state != JobRecord::QUEUED && record.state != JobRecord::RUNNING) finished++;
+    }
+    for (auto it = _records.begin(); finished > FLASHER_JOB_HISTORY && it != _records.end();) {
+        if (it->state == JobRecord::QUEUED || it->state == JobRecord::RUNNING) {
+            ++it;
+            continue;
+        }
+        it = _records.erase(it);
+        finished--;
+    }
+}
+
+// Rewrites the whole file, it holds a few KB at most. Written to a new file
+// that replaces the old one, so a reset never loses the history. Lock held.
+void JobQueue::save() {
+    _changes++;
+    File file = SDStorage.createFile(JOB_FILE_TEMP);
+    if (!file) {
+        Serial.println("[Jobs] Failed to write " FLASHER_JOB_FILE);
+        return;
+    }
+    for (const auto &record : _records) {
+        StaticJsonDocument<512> doc;
+        doc["id"] = record.id;
+        doc["state"] = JobRecord::stateName(record.state);
+        doc["summary"] = record.summary;
+        doc["result"] = record.result;
+        doc["queued"] = record.queued;
+        doc["duration"] = record.duration;
+        serializeJson(doc, file);
+        file.print('\n');
+    }
+    bool written = file.getWriteError() == 0;
+    file.close();
+    if (!written) {
+        Serial.println("[Jobs] Failed to write " FLASHER_JOB_FILE);
+        SDStorage.remove(JOB_FILE_TEMP);
+        return;
+    }
+
+    // Neither SD nor SPIFFS rename over an existing file
+    SDStorage.remove(FLASHER_JOB_FILE);
+    if (!SDStorage.rename(JOB_FILE_TEMP, FLASHER_JOB_FILE)) {
+        Serial.println("[Jobs] Failed to replace " FLASHER_JOB_FILE);
+    }
+}
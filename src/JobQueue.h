@@ -0,0 +1,92 @@
+#ifndef JOB_QUEUE_H
+#define JOB_QUEUE_H
+
+#include <Arduino.h>
+#include <vector>
+#include <deque>
+#include "FlasherTask.h"
+
+enum FlashJobType {
+    JOB_WRITE,  // Flash files to the target
+    JOB_READ,   // Dump a flash region of the target to file.name
+    JOB_PIN,    // Copy file.name into the pinned images partition, no target involved
+    JOB_STREAM  // Flash size bytes of the /flash_stream upload (see FlashStream) at file.address
+};
+
+// Everything the flasher task needs to run a job, copied at submission so
+// nothing is shared with the web server's task afterwards
+struct FlashJob {
+    uint32_t id = 0;
+    FlashJobType type = JOB_WRITE;
+    String target;
+    std::vector<FlashFile> files; // JOB_WRITE
+    FlashOptions options;
+    FlashFile file;               // JOB_READ, JOB_PIN, JOB_STREAM
+    uint32_t size = 0;            // JOB_READ, JOB_STREAM
+    String summary;               // One line for the job list
+    target_chip_t chip = ESP_UNKNOWN_CHIP; // Refused unless the target is this chip, if known
+};
+
+struct JobRecord {
+    enum State { QUEUED, RUNNING, DONE, FAILED, CANCELLED };
+
+    uint32_t id;
+    State state;
+    String summary;
+    String result;      // Status line the job ended with
+    uint32_t queued;    // time(), seconds since boot unless the clock was set
+    uint32_t duration;  // Seconds running
+
+    static const char *stateName(State state);
+};
+
+// FIFO of jobs for the flasher task. Jobs are submitted from any task and
+// counted on a semaphore the flasher task waits on, so the next one starts
+// as soon as the last ends. A cancelled job leaves the FIFO right away and
+// frees its place. Every job has a record that outlives it: the last
+// FLASHER_JOB_HISTORY finished ones are kept in FLASHER_JOB_FILE on storage,
+// one JSON object per line, rewritten through a temporary file.
+class JobQueue {
+public:
+    // Loads the history. Jobs that were queued or running at reboot are
+    // recorded as failed, they are not run again.
+    void begin();
+
+    // Takes ownership of job and assigns its id, 0 when the queue is full.
+    // With idleOnly also 0 unless no other job is queued or running, so
+    // the job is the next to run.
+    uint32_t submit(FlashJob *job, bool idleOnly = false);
+    // Drops a job that has not started yet
+    bool cancel(uint32_t id);
+
+    // Flasher task side. next() waits up to waitMs for a job to be due and
+    // hands it over (nullptr on timeout), finish() records the outcome and
+    // frees it.
+    FlashJob *next(uint32_t waitMs = portMAX_DELAY);
+    void finish(FlashJob *job, bool success, const String &result);
+
+    size_t pending();
+    bool running() const { return _running != 0; }
+    // Bumped by every change to the records, to tell when to resend them
+    uint32_t changes() const { return _changes; }
+    std::vector<JobRecord> records();
+    bool find(uint32_t id, JobRecord &record);
+
+private:
+    JobRecord *recordOf(uint32_t id);
+    void trim();
+    void save();
+
+    std::deque<FlashJob *> _jobs;   // Queued, in order. Lock held.
+    SemaphoreHandle_t _ready = NULL; // Given once per submitted job
+    SemaphoreHandle_t _lock = NULL;
+    std::deque<JobRecord> _records; // Oldest first
+    uint32_t _nextId = 1;
+    volatile uint32_t _running = 0;
+    volatile uint32_t _changes = 0;
+    uint32_t _startedMs = 0;
+};
+
+extern JobQueue Jobs;
+
+#endif
@@ -0,0 +1,23 @@
+#include "LogRing.h"
+
+LogRing Logs;
+
+LogRing::Slot &LogRing::claim(uint32_t *seq) {
+    *seq = _head.fetch_add(1, std::memory_order_relaxed);
+    Slot &slot = _slots[*seq % FLASHER_LOG_LINES];
+    // Readers of the line held so far see it change from here on
+    slot.seq.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.ms = millis();
+    return slot;
+}
+
+void LogRing::write(const char *text) {
+    uint32_t seq;
+    Slot &slot = claim(&seq);
+    size_t len = strnlen(text, FLASHER_LOG_LINE - 1);
+    memcpy(slot.text, text, len);
+    slot.text[len] = '\0';
+    slot.len = len;
+    slot.seq.store(seq + 1, std::memory_order_release);
+}
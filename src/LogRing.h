@@ -0,0 +1,90 @@
+#ifndef LOG_RING_H
+#define LOG_RING_H
+
+#include <Arduino.h>
+#include <atomic>
+#include "ConfigFile.h"
+
+// Activity log shown by the web UI. A fixed ring of FLASHER_LOG_LINES lines,
+// every line numbered by a sequence that only grows. Writers from any task
+// claim the next sequence with an atomic increment and copy their text into
+// its slot, so logging never allocates, locks or waits. Readers keep a
+// cursor (the next sequence they want) and copy one line at a time to the
+// stack, never to the heap; a slot overwritten while it is copied is
+// detected by its sequence and skipped.
+class LogRing {
+public:
+    struct Line {
+        uint32_t seq;
+        uint32_t ms;      // millis() when written
+        const char *text; // Copy on the reader's stack, valid during the callback only
+        size_t len;
+    };
+
+    // Text longer than FLASHER_LOG_LINE - 1 is cut
+    void write(const char *text);
+
+    // Calls fn(line) for every line from cursor on, oldest first, until fn
+    // returns false; that line counts as read all the same. Returns the
+    // cursor for the next call. Lines that were
+    // overwritten before they could be read are added to dropped.
+    template <typename Fn>
+    uint32_t read(uint32_t cursor, Fn fn, uint32_t *dropped = nullptr);
+
+    // Sequence of the next line written
+    uint32_t head() const { return _head.load(std::memory_order_acquire); }
+
+private:
+    struct Slot {
+        std::atomic<uint32_t> seq{0}; // Sequence + 1 once written, 0 while being written
+        uint32_t ms;
+        uint16_t len;
+        char text[FLASHER_LOG_LINE];
+    };
+
+    Slot &claim(uint32_t *seq);
+
+    Slot _slots[FLASHER_LOG_LINES];
+    std::atomic<uint32_t> _head{0};
+};
+
+template <typename Fn>
+uint32_t LogRing::read(uint32_t cursor, Fn fn, uint32_t *dropped) {
+    uint32_t head = this->head();
+    uint32_t oldest = head > FLASHER_LOG_LINES ? head - FLASHER_LOG_LINES : 0;
+    // A cursor ahead of the ring is from before a reboot
+    if (cursor > head) cursor = oldest;
+    if (cursor < oldest) {
+        if (dropped) *dropped += oldest - cursor;
+        cursor = oldest;
+    }
+
+    // One line is copied to the stack to check it was not overwritten meanwhile
+    char text[FLASHER_LOG_LINE];
+    for (; cursor < head; cursor++) {
+        Slot &slot = _slots[cursor % FLASHER_LOG_LINES];
+        if (slot.seq.load(std::memory_order_acquire) != cursor + 1) {
+            // Still being written, or already reused by a later line
+            if (this->head() - cursor < FLASHER_LOG_LINES) break;
+            if (dropped) (*dropped)++;
+            continue;
+        }
+
+        uint32_t ms = slot.ms;
+        size_t len = min((size_t)slot.len, sizeof(text) - 1);
+        memcpy(text, slot.text, len);
+        text[len] = '\0';
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.seq.load(std::memory_order_relaxed) != cursor + 1) {
+            if (dropped) (*dropped)++;
+            continue;
+        }
+
+        if (!fn(Line{cursor, ms, text, len})) return cursor + 1;
+    }
+    return cursor;
+}
+
+extern LogRing Logs;
+
+#endif
@@ -0,0 +1,276 @@
+#include "PinnedImages.h"
+#include "SDStorage.h"
+#include "esp-loader/md5_hash.h"
+#include <stddef.h>
+
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+typedef esp_partition_mmap_handle_t pin_mmap_handle_t;
+#define PIN_MMAP_DATA ESP_PARTITION_MMAP_DATA
+#define pin_munmap esp_partition_munmap
+#else
+typedef spi_flash_mmap_handle_t pin_mmap_handle_t;
+#define PIN_MMAP_DATA SPI_FLASH_MMAP_DATA
+#define pin_munmap spi_flash_munmap
+#endif
+
+PinnedImages Pinned;
+
+static const uint32_t PIN_MAGIC = 0x534e4950; // "PINS"
+static const uint32_t SECTOR_SIZE = 0x1000;
+static const uint32_t DATA_START = 2 * SECTOR_SIZE;
+
+// Unmaps the image once the last ImageFile reading it is gone
+struct PinMapping {
+    pin_mmap_handle_t handle;
+    ~PinMapping() { pin_munmap(handle); }
+};
+
+static uint32_t alignSector(uint32_t size) {
+    return (size + SECTOR_SIZE - 1) & ~(SECTOR_SIZE - 1);
+}
+
+void PinnedImages::indexDigest(const Index &index, uint8_t digest[16]) {
+    MD5Context md5;
+    MD5Init(&md5);
+    MD5Update(&md5, (const uint8_t *)&index, offsetof(Index, digest));
+    MD5Final(digest, &md5);
+}
+
+void PinnedImages::begin() {
+    if (_lock) return;
+    _lock = xSemaphoreCreateMutex();
+
+    _partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+                                          FLASHER_PIN_PARTITION);
+    if (!_partition) {
+        Serial.println("No \"" FLASHER_PIN_PARTITION "\" partition, image pinning disabled");
+        return;
+    }
+
+    // Newest valid copy wins, the other one may be half written
+    Index slots[2];
+    bool valid[2] = {loadIndex(0, slots[0]), loadIndex(1, slots[1])};
+    if (valid[0] && (!valid[1] || slots[0].sequence > slots[1].sequence)) {
+        _index = slots[0];
+    } else if (valid[1]) {
+        _index = slots[1];
+    } else {
+        _index = {};
+        _index.magic = PIN_MAGIC;
+    }
+    Serial.printf("Pinned images: %u, %u KB free\n", _index.count, freeSpace() / 1024);
+}
+
+bool PinnedImages::loadIndex(uint32_t slot, Index &index) {
+    if (esp_partition_read(_partition, slot * SECTOR_SIZE, &index, sizeof(index)) != ESP_OK) {
+        return false;
+    }
+    uint8_t digest[16];
+    indexDigest(index, digest);
+    return index.magic == PIN_MAGIC && index.count <= FLASHER_PIN_MAX &&
+           memcmp(digest, index.digest, sizeof(digest)) == 0;
+}
+
+// Writes the index over the older of the two copies
+bool PinnedImages::saveIndex() {
+    _index.sequence++;
+    indexDigest(_index, _index.digest);
+
+    uint32_t offset = (_index.sequence % 2) * SECTOR_SIZE;
+    return esp_partition_erase_range(_partition, offset, SECTOR_SIZE) == ESP_OK &&
+           esp_partition_write(_partition, offset, &_index, sizeof(_index)) == ESP_OK;
+}
+
+int PinnedImages::find(const String &name) {
+    for (uint32_t i = 0; i < _index.count; i++) {
+        if (name == _index.entries[i].name) return i;
+    }
+    return -1;
+}
+
+void PinnedImages::remove(int entry) {
+    _index.count--;
+    _index.entries[entry] = _index.entries[_index.count];
+}
+
+// Lowest offset where size bytes fit between the pinned images
+bool PinnedImages::allocate(uint32_t size, uint32_t *offset) {
+    uint32_t start = DATA_START;
+    bool moved = true;
+    while (moved) {
+        moved = false;
+        for (uint32_t i = 0; i < _index.count; i++) {
+            uint32_t entryStart = _index.entries[i].offset;
+            uint32_t entryEnd = entryStart + alignSector(_index.entries[i].size);
+            if (entryStart < start + size && entryEnd > start) {
+                start = entryEnd;
+                moved = true;
+            }
+        }
+    }
+    if (start + size > _partition->size) return false;
+    *offset = start;
+    return true;
+}
+
+bool PinnedImages::pin(const String &name, uint8_t *buffer, size_t size, String &error,
+                       void (*progress)(uint32_t bytes)) {
+    if (!_partition) {
+        error = "No " FLASHER_PIN_PARTITION " partition";
+        return false;
+    }
+    if (name.length() >= sizeof(Entry::name)) {
+        error = "Name too long";
+        return false;
+    }
+
+    File file = SDStorage.openFile(("/" + name).c_str());
+    if (!file) {
+        error = name + " missing";
+        return false;
+    }
+    uint32_t imageSize = file.size();
+    if (imageSize == 0) {
+        file.close();
+        error = name + " is empty";
+        return false;
+    }
+
+    // The old copy goes first, its space may be reused right away
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    int old = find(name);
+    if (old >= 0) {
+        remove(old);
+        saveIndex();
+    }
+    uint32_t offset;
+    bool room = _index.count < FLASHER_PIN_MAX && allocate(alignSector(imageSize), &offset);
+    xSemaphoreGive(_lock);
+    if (!room) {
+        file.close();
+        error = "Partition full";
+        return false;
+    }
+
+    if (esp_partition_erase_range(_partition, offset, alignSector(imageSize)) != ESP_OK) {
+        file.close();
+        error = "Erase failed";
+        return false;
+    }
+
+    MD5Context md5;
+    MD5Init(&md5);
+    uint32_t copied = 0;
+    while (copied < imageSize) {
+        size_t len = file.read(buffer, min((uint32_t)size, imageSize - copied));
+        if (len == 0) break;
+        if (esp_partition_write(_partition, offset + copied, buffer, len) != ESP_OK) break;
+        MD5Update(&md5, buffer, len);
+        copied += len;
+        if (progress) progress(len);
+    }
+    file.close();
+    if (copied < imageSize) {
+        error = "Copy failed";
+        return false;
+    }
+
+    Entry entry = {};
+    strcpy(entry.name, name.c_str());
+    entry.offset = offset;
+    entry.size = imageSize;
+    MD5Final(entry.md5, &md5);
+
+    // Read back, the digest is what verify jobs trust later on
+    MD5Init(&md5);
+    for (uint32_t checked = 0; checked < imageSize; ) {
+        uint32_t len = min((uint32_t)size, imageSize - checked);
+        if (esp_partition_read(_partition, offset + checked, buffer, len) != ESP_OK) break;
+        MD5Update(&md5, buffer, len);
+        checked += len;
+    }
+    uint8_t digest[16];
+    MD5Final(digest, &md5);
+    if (memcmp(digest, entry.md5, sizeof(digest)) != 0) {
+        error = "Verify failed";
+        return false;
+    }
+
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    _index.entries[_index.count++] = entry;
+    bool saved = saveIndex();
+    xSemaphoreGive(_lock);
+    if (!saved) error = "Index write failed";
+    return saved;
+}
+
+bool PinnedImages::unpin(const String &name) {
+    if (!_partition) return false;
+
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    int entry = find(name);
+    bool found = entry >= 0;
+    if (found) {
+        remove(entry);
+        saveIndex();
+    }
+    xSemaphoreGive(_lock);
+    return found;
+}
+
+bool PinnedImages::isPinned(const String &name) {
+    if (!_partition) return false;
+
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    bool found = find(name) >= 0;
+    xSemaphoreGive(_lock);
+    return found;
+}
+
+ImageFile PinnedImages::open(const String &name) {
+    if (!_partition) return ImageFile();
+
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    int i = find(name);
+    Entry entry;
+    if (i >= 0) entry = _index.entries[i];
+    xSemaphoreGive(_lock);
+    if (i < 0) return ImageFile();
+
+    const void *data;
+    pin_mmap_handle_t handle;
+    if (esp_partition_mmap(_partition, entry.offset, entry.size, PIN_MMAP_DATA, &data, &handle) != ESP_OK) {
+        Serial.printf("Cannot map pinned %s\n", entry.name);
+        return ImageFile();
+    }
+
+    auto mapping = std::make_shared<PinMapping>();
+    mapping->handle = handle;
+    ImageFile image(mapping, (const uint8_t *)data, entry.size);
+    image.setDigest(entry.md5);
+    return image;
+}
+
+std::vector<String> PinnedImages::list() {
+    std::vector<String> names;
+    if (!_partition) return names;
+
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    for (uint32_t i = 0; i < _index.count; i++) {
+        names.push_back(String(_index.entries[i].name) + "|" + String(_index.entries[i].size));
+    }
+    xSemaphoreGive(_lock);
+    return names;
+}
+
+uint32_t PinnedImages::freeSpace() {
+    if (!_partition) return 0;
+
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    uint32_t used = DATA_START;
+    for (uint32_t i = 0; i < _index.count; i++) {
+        used += alignSector(_index.entries[i].size);
+    }
+    xSemaphoreGive(_lock);
+    return _partition->size > used ? _partition->size - used : 0;
+}
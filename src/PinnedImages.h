@@ -0,0 +1,69 @@
+#ifndef PINNED_IMAGES_H
+#define PINNED_IMAGES_H
+
+#include <Arduino.h>
+#include <vector>
+#include <esp_partition.h>
+#include "ConfigFile.h"
+#include "ImageCache.h"
+
+// Images copied from storage into a data partition of the host's own flash
+// (FLASHER_PIN_PARTITION). Jobs read them through a memory mapping, which
+// is much faster than SD and survives reboots. The partition starts with
+// two index sectors written alternately, so a power loss while pinning
+// leaves the previous index intact. Images follow, sector aligned.
+class PinnedImages {
+public:
+    // Loads the index, pinning is unavailable without the partition
+    void begin();
+    bool available() const { return _partition != nullptr; }
+
+    // Copies name from storage into the partition, replacing an older copy.
+    // buffer (size bytes) is used for the copy, progress gets the bytes of
+    // every chunk copied. Slow, erases and writes flash, so only to be called
+    // from the flasher task.
+    bool pin(const String &name, uint8_t *buffer, size_t size, String &error,
+             void (*progress)(uint32_t bytes) = nullptr);
+    bool unpin(const String &name);
+    bool isPinned(const String &name);
+
+    // Maps the pinned copy of name, an empty ImageFile if there is none
+    ImageFile open(const String &name);
+
+    // Pinned images as "name|size"
+    std::vector<String> list();
+    uint32_t freeSpace();
+
+private:
+    struct Entry {
+        char name[32];
+        uint32_t offset;
+        uint32_t size;
+        uint8_t md5[16];
+    };
+
+    struct Index {
+        uint32_t magic;
+        uint32_t sequence;
+        uint32_t count;
+        Entry entries[FLASHER_PIN_MAX];
+        uint8_t digest[16]; // MD5 of all fields above
+    };
+    static_assert(sizeof(Index) <= 0x1000, "Pin index must fit a sector");
+
+    static void indexDigest(const Index &index, uint8_t digest[16]);
+
+    bool loadIndex(uint32_t slot, Index &index);
+    bool saveIndex();
+    int find(const String &name);
+    void remove(int entry);
+    bool allocate(uint32_t size, uint32_t *offset);
+
+    const esp_partition_t *_partition = nullptr;
+    SemaphoreHandle_t _lock = NULL;
+    Index _index = {};
+};
+
+extern PinnedImages Pinned;
+
+#endif
@@ -41,51 +41,115 @@ void SDManager::printCardInfo() {
     #endif
 }
 
-std::vector<String> SDManager::listFiles(const char * dirname) {
-    std::vector<String> fileList;
+fs::FS &SDManager::fs() {
     #ifdef USE_SD_CARD
-        listDir(SD, dirname, 0, fileList);
+        return SD;
     #else
-        listDir(SPIFFS, dirname, 0, fileList);
+        return SPIFFS;
     #endif
-    return fileList;
 }
 
-File SDManager::openFile(const char * path) {
-    #ifdef USE_SD_CARD
-        return SD.open(path);
-    #else
-        return SPIFFS.open(path);
-    #endif
+bool SDManager::walk(const char * dirname, uint8_t levels, size_t maxCount,
+                     const std::function<void(File &file, const String &path)> &visit) {
+    size_t count = 0;
+    String dir = dirname;
+    while (dir.endsWith("/")) dir = dir.substring(0, dir.length() - 1);
+    return walkDir(dir, levels, maxCount, count, visit);
 }
 
-void SDManager::listDir(fs::FS &fs, const char * dirname, uint8_t levels, std::vector<String> &fileList) {
-    File root = fs.open(dirname);
+bool SDManager::walkDir(const String &dirname, uint8_t levels, size_t maxCount, size_t &count,
+                        const std::function<void(File &file, const String &path)> &visit) {
+    File root = fs().open(dirname.length() ? dirname.c_str() : "/");
     if (!root) {
         Serial.println("Failed to open directory");
-        return;
+        return true;
     }
     if (!root.isDirectory()) {
         Serial.println("Not a directory");
-        return;
+        return true;
     }
 
     File file = root.openNextFile();
     while (file) {
+        // name() is only the last part. SPIFFS has no directories, entries
+        // of its root carry their folders, so only path() has all of it.
+        String path = file.path();
+
         if (file.isDirectory()) {
-            if (levels) {
-                listDir(fs, file.name(), levels - 1, fileList);
-            }
+            if (levels && !walkDir(path, levels - 1, maxCount, count, visit)) return false;
         } else {
-            String fileName = String(file.name());
-            Serial.printf("Found file: %s (%u bytes)\n", fileName.c_str(), file.size());
-            // Filter for .bin files only
-            if (fileName.endsWith(".bin")) {
-                 // Format: /filename.bin|Size
-                 String fileEntry = fileName + "|" + String(file.size());
-                 fileList.push_back(fileEntry);
-            }
+            if (count >= maxCount) return false;
+            count++;
+            String relative = path.substring(1);
+            visit(file, relative);
         }
         file = root.openNextFile();
     }
+    return true;
+}
+
+File SDManager::openFile(const char * path) {
+    return fs().open(path);
+}
+
+File SDManager::createFile(const char * path) {
+    makeParents(path);
+    return fs().open(path, FILE_WRITE);
+}
+
+File SDManager::appendFile(const char * path) {
+    makeParents(path);
+    return fs().open(path, FILE_APPEND);
+}
+
+bool SDManager::exists(const char * path) {
+    return fs().exists(path);
+}
+
+bool SDManager::remove(const char * path) {
+    if (!fs().exists(path) || !fs().remove(path)) return false;
+    removeEmptyParents(path);
+    return true;
+}
+
+bool SDManager::rename(const char * from, const char * to) {
+    if (!fs().exists(from)) return false;
+    makeParents(to);
+    if (!fs().rename(from, to)) return false;
+    removeEmptyParents(from);
+    return true;
+}
+
+// mkdir for every folder on the way to path. SPIFFS takes '/' in names as is.
+void SDManager::makeParents(const char * path) {
+    #ifdef USE_SD_CARD
+        String p = path;
+        for (int slash = p.indexOf('/', 1); slash > 0; slash = p.indexOf('/', slash + 1)) {
+            String dir = p.substring(0, slash);
+            if (!SD.exists(dir)) SD.mkdir(dir);
+        }
+    #endif
+}
+
+// rmdir fails on folders that still hold something, which ends the climb
+void SDManager::removeEmptyParents(const char * path) {
+    #ifdef USE_SD_CARD
+        String p = path;
+        for (int slash = p.lastIndexOf('/'); slash > 0; slash = p.lastIndexOf('/')) {
+            p = p.substring(0, slash);
+            if (!SD.rmdir(p)) break;
+        }
+    #endif
+}
+
+bool SDManager::validPath(const String &path) {
+    if (!path.length() || path.indexOf('\\') >= 0) return false;
+    int start = 0;
+    while (true) {
+        int slash = path.indexOf('/', start);
+        String part = slash < 0 ? path.substring(start) : path.substring(start, slash);
+        if (!part.length() || part == "." || part == "..") return false;
+        if (slash < 0) return true;
+        start = slash + 1;
+    }
 }
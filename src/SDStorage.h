@@ -10,16 +10,37 @@
     #include <SPIFFS.h>
 #endif
 #include <vector>
+#include <functional>
 
+// Paths are absolute ("/product/v1/app.bin") unless noted. Images may live
+// in folders, per product or version; SPIFFS has no real folders but takes
+// the same paths as plain names.
 class SDManager {
 public:
     bool begin();
-    std::vector<String> listFiles(const char * dirname);
+    // Calls visit(file, path) for every file below dirname, descending at
+    // most levels folders and stopping after maxCount files. path is
+    // relative to the root. Returns false if maxCount cut it short.
+    bool walk(const char * dirname, uint8_t levels, size_t maxCount,
+              const std::function<void(File &file, const String &path)> &visit);
     File openFile(const char * path);
+    File createFile(const char * path); // Truncates an existing file, creates missing folders
+    File appendFile(const char * path); // Writes go to the end, creates a missing file
+    bool exists(const char * path);
+    bool remove(const char * path);     // Folders left empty go as well
+    bool rename(const char * from, const char * to); // Creates missing folders of to
     void printCardInfo();
 
+    // A path relative to the root that is safe to use: no empty, "." or ".."
+    // parts and no backslashes
+    static bool validPath(const String &path);
+
 private:
-    void listDir(fs::FS &fs, const char * dirname, uint8_t levels, std::vector<String> &fileList);
+    fs::FS &fs();
+    void makeParents(const char * path);
+    void removeEmptyParents(const char * path);
+    bool walkDir(const String &dirname, uint8_t levels, size_t maxCount, size_t &count,
+                 const std::function<void(File &file, const String &path)> &visit);
 };
 
 extern SDManager SDStorage;
@@ -0,0 +1,138 @@
+#include "UploadWriter.h"
+
+UploadWriter Uploads;
+
+static_assert(FLASHER_UPLOAD_BUFFER % 4096 == 0, "Upload pieces must cover whole sectors");
+
+// Longest the web server waits for storage to take a piece, kept below the
+// watchdog of its task
+static const uint32_t STORAGE_WAIT_MS = 4000;
+
+bool UploadWriter::begin() {
+    if (_task) return true;
+
+    // One more for the drain marker
+    if (!_pool.begin(FLASHER_UPLOAD_BUFFERS, FLASHER_UPLOAD_BUFFER, 1)) return false;
+    if (!_drained) _drained = xSemaphoreCreateBinary();
+    if (!_drained) return false;
+
+    // Mostly waits on storage, so any core will do
+    return xTaskCreatePinnedToCore(writerTask, "UploadWriter", 4096, this, 1, &_task, tskNO_AFFINITY) == pdPASS;
+}
+
+bool UploadWriter::open(const String &path) {
+    if (_open) abort();
+    if (!begin()) {
+        Serial.println("[Upload] Out of memory");
+        return false;
+    }
+
+    _file = SDStorage.createFile(path.c_str());
+    if (!_file) return false;
+    _open = true;
+    _path = path;
+    _fillLen = 0;
+    _failed = false;
+    _error = "";
+    MD5Init(&_md5);
+    return true;
+}
+
+bool UploadWriter::write(const uint8_t *data, size_t len) {
+    if (!_open) return false;
+
+    while (len && !_failed) {
+        if (!_fill && !_pool.take(&_fill, pdMS_TO_TICKS(STORAGE_WAIT_MS))) {
+            fail("Storage too slow");
+            break;
+        }
+
+        size_t n = min(len, (size_t)FLASHER_UPLOAD_BUFFER - _fillLen);
+        memcpy(_fill + _fillLen, data, n);
+        _fillLen += n;
+        data += n;
+        len -= n;
+
+        if (_fillLen == FLASHER_UPLOAD_BUFFER) queueFill();
+    }
+    return !_failed;
+}
+
+void UploadWriter::queueFill() {
+    _pool.push({_fill, _fillLen});
+    _fill = nullptr;
+    _fillLen = 0;
+}
+
+// Waits until the task has written every piece queued so far
+void UploadWriter::drain() {
+    _pool.push({nullptr, 0});
+    xSemaphoreTake(_drained, portMAX_DELAY);
+}
+
+bool UploadWriter::finish(uint8_t md5[16]) {
+    if (!_open) return false;
+
+    if (_fill) {
+        if (_fillLen) queueFill();
+        else {
+            _pool.give(_fill);
+            _fill = nullptr;
+        }
+    }
+    drain();
+    MD5Final(md5, &_md5);
+    _file.close();
+    _open = false;
+
+    if (_failed) {
+        Serial.printf("[Upload] %s, removing %s\n", _error, _path.c_str());
+        SDStorage.remove(_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+void UploadWriter::abort() {
+    if (!_open) return;
+
+    if (_fill) {
+        _pool.give(_fill);
+        _fill = nullptr;
+    }
+    fail("Aborted");
+    drain();
+    _file.close();
+    _open = false;
+    SDStorage.remove(_path.c_str());
+}
+
+void UploadWriter::fail(const char *error) {
+    if (_failed) return;
+    _error = error;
+    _failed = true;
+}
+
+void UploadWriter::writerTask(void *pvParameters) {
+    UploadWriter *writer = (UploadWriter *)pvParameters;
+
+    while (true) {
+        BufferPool::Block piece;
+        writer->_pool.pop(&piece, portMAX_DELAY);
+        if (!piece.data) {
+            xSemaphoreGive(writer->_drained);
+            continue;
+        }
+
+        // Pieces after a failure are only handed back
+        if (!writer->_failed) {
+            MD5Update(&writer->_md5, piece.data, piece.len);
+            size_t written = writer->_file.write(piece.data, piece.len);
+            if (written != piece.len) {
+                Serial.printf("[Upload] Short write, %u of %u bytes\n", written, piece.len);
+                writer->fail(written ? "Short write, storage full?" : "Write failed");
+            }
+        }
+        writer->_pool.give(piece.data);
+    }
+}
@@ -0,0 +1,56 @@
+#ifndef UPLOAD_WRITER_H
+#define UPLOAD_WRITER_H
+
+#include <Arduino.h>
+#include "SDStorage.h"
+#include "BufferPool.h"
+#include "esp-loader/md5_hash.h"
+
+// Writes an upload to storage behind the web server. Data arrives in chunks
+// of whatever size the network hands over (often ~1.4KB), which would make
+// SD sectors and SPIFFS pages be rewritten several times each. The writer
+// collects it into FLASHER_UPLOAD_BUFFER pieces, so every write starts on a
+// sector boundary and covers whole sectors but the last, and hands them to a
+// task of its own that hashes and writes them while the next piece fills.
+// One upload at a time.
+class UploadWriter {
+public:
+    // Creates (truncates) path, folders included. Buffers and the task are
+    // set up by the first upload and kept.
+    bool open(const String &path);
+    // Copies data into the current piece, false once anything failed
+    bool write(const uint8_t *data, size_t len);
+    // Writes what is left and closes the file. False if any write was short
+    // or failed, the file is removed then. md5 receives the digest of all
+    // data written.
+    bool finish(uint8_t md5[16]);
+    // Drops the upload and removes the file
+    void abort();
+
+    bool active() const { return _open; }
+    const char *error() const { return _error; }
+
+private:
+    bool begin();
+    void queueFill();
+    void drain();
+    void fail(const char *error);
+    static void writerTask(void *pvParameters);
+
+    TaskHandle_t _task = NULL;
+    BufferPool _pool;   // A piece without data asks the task to report back once all before it are written
+    SemaphoreHandle_t _drained = NULL;
+
+    File _file;
+    bool _open = false;
+    String _path;
+    uint8_t *_fill = nullptr;
+    size_t _fillLen = 0;
+    MD5Context _md5;
+    volatile bool _failed = false;
+    const char *_error = "";
+};
+
+extern UploadWriter Uploads;
+
+#endif
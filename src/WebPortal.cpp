@@ -3,11 +3,201 @@
 // #include <SPIFFS.h> // Handled by SDStorage.h based on config
 #include "ConfigFile.h"
 #include <ArduinoJson.h>
+#include <StreamString.h>
 #include "FlasherTask.h"
 #include "OTAUpdate.h"
+#include "ImageCache.h"
+#include "PinnedImages.h"
+#include "JobProgress.h"
+#include "JobQueue.h"
+#include "AutoFlash.h"
+#include "LogRing.h"
+#include "FileIndex.h"
+#include "FlashStream.h"
+#include "UploadWriter.h"
+#include "esp-loader/md5_hash.h"
 
 // OTA State
 static bool shouldUpdateFirmware = false;
+static String flashBody;
+// Why the last /upload failed, empty if it did not
+static String uploadError;
+// A /flash_stream upload, kept in the request's _tempObject (freed with the
+// request), so a second upload cannot disturb the one being flashed
+struct StreamUpload {
+    uint32_t job;        // 0 unless the job was queued
+    uint32_t generation; // Feed stream this upload fills
+    uint32_t unacked;    // Body bytes held back from the TCP window
+    int code;            // HTTP status it was refused or failed with
+    char error[64];
+};
+// Keeps a /logs response or log event small, the rest follows with the next one
+static const uint32_t LOGS_PER_POLL = 64;
+
+// Push channel: status, progress, jobs, auto mode and new log lines are
+// sent to every listener as they change, at most every WEB_PUSH_INTERVAL_MS
+static AsyncEventSource events("/events");
+static String pushedStatus;
+static String pushedProgress;
+static String pushedAuto;
+static uint32_t pushedJobs = 0; // Jobs.changes() when the list was last pushed
+static uint32_t pushedLog = 0;  // Next log sequence to push
+static uint32_t lastPush = 0;
+// The page shows this many jobs, a "jobs" event carries no more
+static const size_t JOBS_PUSHED = 10;
+
+// Progress snapshot as served by /progress and pushed as "progress" events
+static String progressJson(bool withStatus) {
+    JobProgress::Snapshot p = Progress.snapshot();
+    DynamicJsonDocument doc(512);
+    doc["active"] = p.active;
+    doc["phase"] = p.phase;
+    doc["item"] = p.item;
+    doc["itemIndex"] = p.itemIndex;
+    doc["itemCount"] = p.itemCount;
+    doc["percent"] = p.percent;
+    doc["done"] = p.done;
+    doc["total"] = p.total;
+    doc["rate"] = p.rate;
+    doc["average"] = p.average;
+    doc["elapsed"] = p.elapsed;
+    doc["remaining"] = p.remaining;
+    if(withStatus) doc["status"] = Flasher.getStatus();
+
+    String output;
+    serializeJson(doc, output);
+    return output;
+}
+
+// Newest last records of the job list, as served by /jobs and pushed as
+// "jobs" events, oldest first
+static String jobsJson(size_t last) {
+    std::vector<JobRecord> records = Jobs.records();
+    size_t first = records.size() > last ? records.size() - last : 0;
+    DynamicJsonDocument doc(1024 + (records.size() - first) * 384);
+    JsonArray array = doc.to<JsonArray>();
+    for(size_t i = first; i < records.size(); i++) {
+        const JobRecord &r = records[i];
+        JsonObject obj = array.createNestedObject();
+        obj["id"] = r.id;
+        obj["state"] = JobRecord::stateName(r.state);
+        obj["summary"] = r.summary;
+        obj["result"] = r.result;
+        obj["queued"] = r.queued;
+        obj["duration"] = r.duration;
+    }
+
+    String output;
+    serializeJson(doc, output);
+    return output;
+}
+
+// Auto mode stats as served by /auto and, without the recent boards, pushed
+// as "auto" events
+static String autoJson(bool withRecent) {
+    AutoFlash::Stats a = Auto.stats();
+    std::vector<AutoFlash::Board> boards;
+    if(withRecent) boards = Auto.recent();
+    DynamicJsonDocument doc(1024 + boards.size() * 256);
+    doc["enabled"] = a.enabled;
+    doc["state"] = a.state;
+    doc["recipe"] = a.recipe;
+    doc["boards"] = a.boards;
+    doc["passed"] = a.passed;
+    doc["failed"] = a.failed;
+    doc["lastMs"] = a.lastMs;
+    doc["minMs"] = a.minMs;
+    doc["maxMs"] = a.maxMs;
+    doc["avgMs"] = a.avgMs;
+    doc["pitchMs"] = a.pitchMs;
+    if(withRecent) {
+        JsonArray recent = doc.createNestedArray("recent");
+        for(const auto &b : boards) {
+            JsonObject obj = recent.createNestedObject();
+            obj["mac"] = b.mac;
+            obj["success"] = b.success;
+            obj["result"] = b.result;
+            obj["cycleMs"] = b.cycleMs;
+        }
+    }
+
+    String output;
+    serializeJson(doc, output);
+    return output;
+}
+
+// Log lines from index on, serialized straight from the ring. Returns the
+// index to continue from; "from" is the sequence of the first line sent.
+static uint32_t printLogs(Print &out, uint32_t index) {
+    out.print("{\"logs\":[");
+    uint32_t count = 0;
+    uint32_t dropped = 0;
+    uint32_t from = 0;
+    uint32_t next = Logs.read(index, [&](const LogRing::Line &line) {
+        if(count++) out.print(',');
+        else from = line.seq;
+        // A const char* is serialized in place, not copied into the document
+        StaticJsonDocument<16> doc;
+        doc.set(line.text);
+        serializeJson(doc, out);
+        return count < LOGS_PER_POLL;
+    }, &dropped);
+    out.printf("],\"from\":%u,\"nextIndex\":%u,\"dropped\":%u}", count ? from : next, next, dropped);
+    return next;
+}
+
+// Called from the main loop. Each kind of event is only sent when it changed.
+static void pushEvents() {
+    if(millis() - lastPush < WEB_PUSH_INTERVAL_MS) return;
+    lastPush = millis();
+
+    if(events.count() == 0) {
+        // New listeners catch up through /logs
+        pushedLog = Logs.head();
+        pushedStatus = "";
+        pushedProgress = "";
+        pushedAuto = "";
+        // The page loads the job list when it connects
+        pushedJobs = Jobs.changes();
+        return;
+    }
+
+    String status = Flasher.getStatus();
+    if(status != pushedStatus) {
+        events.send(status.c_str(), "status");
+        pushedStatus = status;
+    }
+
+    String progress = progressJson(false);
+    if(progress != pushedProgress) {
+        events.send(progress.c_str(), "progress");
+        pushedProgress = progress;
+    }
+
+    uint32_t jobChanges = Jobs.changes();
+    if(jobChanges != pushedJobs) {
+        events.send(jobsJson(JOBS_PUSHED).c_str(), "jobs");
+        pushedJobs = jobChanges;
+    }
+
+    String autoStats = autoJson(false);
+    if(autoStats != pushedAuto) {
+        events.send(autoStats.c_str(), "auto");
+        pushedAuto = autoStats;
+    }
+
+    if(Logs.head() != pushedLog) {
+        StreamString lines;
+        pushedLog = printLogs(lines, pushedLog);
+        events.send(lines.c_str(), "log");
+    }
+}
+
+// Answer to a job submission, the id as text for scripts to poll /job with
+static void sendJob(AsyncWebServerRequest *request, uint32_t id) {
+    if(id) request->send(200, "text/plain", String(id));
+    else request->send(409, "text/plain", "Job Queue Full");
+}
 static String updateFirmwareUrl = "";
 
 // Note: Ensure ArduinoJson is installed
@@ -36,6 +226,12 @@ const char index_html[] = R"rawliteral(
     #status { margin-top: 20px; padding: 15px; background: #e9ecef; border-radius: 6px; font-weight: bold; border-left: 5px solid #007bff; }
     .row-inputs { display: flex; gap: 10px; align-items: center; }
     .row-inputs select { flex-grow: 1; }
+    #jobProgress { display: none; margin-top: 10px; }
+    #jobProgress progress { width: 100%; height: 18px; }
+    #jobDetail { font-size: 13px; color: #555; }
+    #jobTable { width: 100%; font-size: 13px; border-collapse: collapse; }
+    #jobTable td { padding: 4px; border-bottom: 1px solid #eee; }
+    #jobTable button { padding: 2px 8px; font-size: 12px; }
   </style>
 </head>
 <body>
@@ -67,10 +263,42 @@ const char index_html[] = R"rawliteral(
 
     <!-- Actions -->
     <div class="section">
+      <label style="font-weight:normal;"><input type="checkbox" id="compress" checked> Compressed transfer</label>
+      <label style="font-weight:normal;"><input type="checkbox" id="delta" checked> Only changed regions</label>
+      <label style="font-weight:normal;"><input type="checkbox" id="sparse" checked> Skip empty (0xFF) blocks</label>
+      <label style="font-weight:normal;"><input type="checkbox" id="gang"> Gang (all target ports)</label>
       <button onclick="startFlash()">Start Flashing</button>
       <div id="status">Status: Ready</div>
+      <div id="jobProgress">
+        <progress id="jobBar" max="100" value="0"></progress>
+        <div id="jobDetail"></div>
+      </div>
     </div>
     
+    <!-- Job Queue -->
+    <div class="section">
+      <h3>Jobs</h3>
+      <table id="jobTable"></table>
+    </div>
+
+    <!-- Production Line -->
+    <div class="section">
+      <h3>Production Line</h3>
+      <label style="font-weight:normal;"><input type="checkbox" id="autoFlash" onchange="setAuto(this.checked)"> Flash every attached board with the recipe in %AUTO_MANIFEST%</label>
+      <div id="autoStats" style="font-size:13px; color:#555;"></div>
+    </div>
+
+    <!-- Flash Read-back -->
+    <div class="section">
+      <h3>Read Flash</h3>
+      <div class="row-inputs">
+        <input type="text" id="readAddr" value="0x0" style="width:90px;" title="Address">
+        <input type="text" id="readSize" value="0x400000" style="width:90px;" title="Size">
+        <input type="text" id="readName" value="dump.bin" title="File name">
+        <button onclick="startRead()">Read to File</button>
+      </div>
+    </div>
+
     <!-- System Logs -->
     <div class="section">
       <h3>Activity Log</h3>
@@ -89,6 +317,7 @@ const char index_html[] = R"rawliteral(
   let availableFiles = [];
   let lastStatus = "";
   let lastLogIndex = 0;
+  let pushActive = false;
 
   function log(msg) {
     const box = document.getElementById('sysLoop');
@@ -101,16 +330,18 @@ const char index_html[] = R"rawliteral(
     fetch('/logs?index=' + lastLogIndex)
         .then(res => res.json())
         .then(data => {
+            if(data.nextIndex < lastLogIndex) lastLogIndex = data.from; // Host rebooted
             if(data.logs && data.logs.length > 0) {
-                data.logs.forEach(l => log(l));
-                lastLogIndex = data.nextIndex;
+                // Pushed lines may have arrived meanwhile
+                data.logs.slice(Math.max(0, lastLogIndex - data.from)).forEach(l => log(l));
+                lastLogIndex = Math.max(lastLogIndex, data.nextIndex);
             }
         })
         .catch(e => console.log("Log poll error", e));
   }
   
-  // Poll logs frequently (500ms)
-  setInterval(fetchLogs, 500);
+  // Poll logs frequently (500ms), unless /events pushes them
+  setInterval(() => { if(!pushActive) fetchLogs(); }, 500);
 
   fetch('/list').then(res => res.json()).then(data => {
     availableFiles = data;
@@ -179,25 +410,146 @@ const char index_html[] = R"rawliteral(
     fetch('/flash', {
       method: 'POST',
       headers: { 'Content-Type': 'application/json' },
-      body: JSON.stringify({ target: chip, files: files })
+      body: JSON.stringify({ target: chip, files: files, compress: document.getElementById('compress').checked,
+                             delta: document.getElementById('delta').checked,
+                             sparse: document.getElementById('sparse').checked,
+                             gang: document.getElementById('gang').checked })
     })
-    .then(res => res.text())
-    .then(msg => log("Server: " + msg))
+    .then(submitted)
     .catch(err => log("Error: " + err));
   }
+
+  // Job submissions answer with the job id, or why it was not queued
+  function submitted(res) {
+    res.text().then(msg => log(res.ok ? "Queued job #" + msg : "Server: " + msg));
+    loadJobs();
+  }
+
+  function loadJobs() {
+    fetch('/jobs').then(res => res.json()).then(showJobs);
+  }
+
+  function showJobs(jobs) {
+    const table = document.getElementById('jobTable');
+    table.innerHTML = '';
+    jobs.slice(-10).reverse().forEach(j => {
+      const row = table.insertRow();
+      row.insertCell().innerText = '#' + j.id;
+      row.insertCell().innerText = j.state;
+      row.insertCell().innerText = j.summary;
+      row.insertCell().innerText = j.result + (j.duration ? ` (${formatTime(j.duration)})` : '');
+      const cell = row.insertCell();
+      if(j.state === 'queued') {
+        cell.innerHTML = `<button onclick="cancelJob(${j.id})">Cancel</button>`;
+      }
+    });
+  }
+
+  function cancelJob(id) {
+    fetch('/cancel_job?id=' + id).then(res => res.text()).then(msg => { log("Server: " + msg); loadJobs(); });
+  }
+
+  loadJobs();
+  setInterval(() => { if(!pushActive) loadJobs(); }, 3000);
+
+  function setAuto(enable) {
+    fetch('/auto?enable=' + (enable ? 1 : 0)).then(res => {
+      if(!res.ok) res.text().then(t => { alert(t); document.getElementById('autoFlash').checked = false; });
+      loadAuto();
+    });
+  }
+
+  function loadAuto() {
+    fetch('/auto').then(res => res.json()).then(showAuto);
+  }
+
+  function showAuto(a) {
+    document.getElementById('autoFlash').checked = a.enabled;
+    let text = `${a.state}`;
+    if(a.boards) {
+      text += ` · ${a.passed}/${a.boards} passed · cycle ${(a.avgMs / 1000).toFixed(1)} s avg`
+            + ` (${(a.minMs / 1000).toFixed(1)}-${(a.maxMs / 1000).toFixed(1)})`;
+      if(a.pitchMs) text += ` · one board every ${(a.pitchMs / 1000).toFixed(1)} s`;
+    }
+    document.getElementById('autoStats').innerText = text;
+  }
+
+  loadAuto();
+  setInterval(() => { if(!pushActive) loadAuto(); }, 3000);
   
+  function startRead() {
+    const chip = document.getElementById('targetChip').value;
+    const params = new URLSearchParams();
+    params.append('target', chip);
+    params.append('address', document.getElementById('readAddr').value);
+    params.append('size', document.getElementById('readSize').value);
+    params.append('name', document.getElementById('readName').value);
+
+    log("Sending Read Request...");
+    fetch('/read_flash', { method: 'POST', body: params })
+    .then(submitted)
+    .catch(err => log("Error: " + err));
+  }
+
+  function showStatus(txt) {
+    if(txt !== lastStatus) {
+      log(txt);
+      if(!txt.startsWith("Upload")) {
+         document.getElementById('status').innerText = txt;
+      }
+      lastStatus = txt;
+    }
+  }
+
   setInterval(() => {
-    fetch('/status').then(res => res.text()).then(txt => {
-       if(txt !== lastStatus) {
-         log(txt);
-         if(!txt.startsWith("Upload")) {
-            document.getElementById('status').innerText = txt;
-         }
-         lastStatus = txt;
-       }
-    });
+    if(!pushActive) fetch('/status').then(res => res.text()).then(showStatus);
+  }, 1000);
+
+  function formatRate(bps) {
+    return bps >= 1024 * 1024 ? (bps / 1048576).toFixed(1) + " MB/s" : (bps / 1024).toFixed(0) + " KB/s";
+  }
+
+  function formatTime(s) {
+    return Math.floor(s / 60) + ":" + String(s % 60).padStart(2, "0");
+  }
+
+  function showProgress(p) {
+    const box = document.getElementById('jobProgress');
+    if(!p.active && p.total === 0) { box.style.display = 'none'; return; }
+    box.style.display = 'block';
+    document.getElementById('jobBar').value = p.percent;
+    let detail = `${p.percent}% · ${p.phase}`;
+    if(p.item) detail += ` ${p.item} (${p.itemIndex}/${p.itemCount})`;
+    if(p.active && p.rate) detail += ` · ${formatRate(p.rate)} (avg ${formatRate(p.average)})`;
+    detail += p.active ? ` · ${formatTime(p.elapsed)} elapsed, ~${formatTime(p.remaining)} left`
+                       : ` · took ${formatTime(p.elapsed)}`;
+    document.getElementById('jobDetail').innerText = detail;
+  }
+
+  setInterval(() => {
+    if(!pushActive) fetch('/progress').then(res => res.json()).then(showProgress);
   }, 1000);
 
+  // Status, progress, jobs, auto mode and log lines are pushed while
+  // /events is connected, the polling above only runs without it
+  if(window.EventSource) {
+    const events = new EventSource('/events');
+    events.onopen = () => { pushActive = true; fetchLogs(); loadJobs(); loadAuto(); };
+    events.onerror = () => { pushActive = false; };
+    events.addEventListener('status', e => showStatus(e.data));
+    events.addEventListener('progress', e => showProgress(JSON.parse(e.data)));
+    events.addEventListener('jobs', e => showJobs(JSON.parse(e.data)));
+    events.addEventListener('auto', e => showAuto(JSON.parse(e.data)));
+    events.addEventListener('log', e => {
+      const d = JSON.parse(e.data);
+      if(d.nextIndex < lastLogIndex) lastLogIndex = d.from; // Host rebooted
+      // Missed lines are fetched, lines already shown skipped
+      if(d.from > lastLogIndex) { fetchLogs(); return; }
+      d.logs.slice(lastLogIndex - d.from).forEach(l => log(l));
+      lastLogIndex = Math.max(lastLogIndex, d.nextIndex);
+    });
+  }
+
   // Check for notification on load
   function checkNotification() {
       fetch('/update_check?cached=true') // Check without forcing a new request immediately if possible
@@ -354,6 +706,11 @@ const char files_html[] = R"rawliteral(
     .btn-dl { background-color: #6c757d; }
     .btn-ren { background-color: #ffc107; color: #212529 !important; }
     .btn-del { background-color: #dc3545; }
+    .btn-pin { background-color: #adb5bd; }
+    .btn-pin.pinned { background-color: #17a2b8; }
+    .folder-bar { display: flex; gap: 8px; align-items: center; margin-bottom: 10px; }
+    .folder-bar a { cursor: pointer; color: #007bff; }
+    .folder-row td { cursor: pointer; }
 
     input[type="file"] { display: none; }
   </style>
@@ -370,7 +727,7 @@ const char files_html[] = R"rawliteral(
         <!-- State 1: Choose File -->
         <label id="chooseWrapper" class="btn-choose">
             + Choose .bin File
-            <input type='file' id='uploadInput' name='upload' accept=".bin" onchange="handleFileSelect(this)">
+            <input type='file' id='uploadInput' name='upload' accept=".bin,.json" onchange="handleFileSelect(this)">
         </label>
 
         <!-- State 2: Confirm Upload -->
@@ -382,11 +739,17 @@ const char files_html[] = R"rawliteral(
     </div>
 
     <div class="table-container">
+      <div class="folder-bar">
+        <span id="folderPath"></span>
+        <button type="button" onclick="newFolder()" style="padding: 4px 10px; border: 1px solid #ccc; background: white; border-radius: 6px; cursor: pointer;">+ Folder</button>
+      </div>
+      <input type="text" id="fileFilter" placeholder="Filter by name prefix" oninput="reloadFiles()" style="width:100%; padding:8px; margin-bottom:10px; box-sizing:border-box;">
       <table id="fileManagerTable">
         <thead>
           <tr>
             <th>Name</th>
             <th>Size</th>
+            <th>Content</th>
             <th>Actions</th>
           </tr>
         </thead>
@@ -397,13 +760,16 @@ const char files_html[] = R"rawliteral(
 
 <script>
   let availableFiles = [];
+  let availableFolders = [];
+  let currentDir = ''; // Folder shown and uploaded into, '' is the root
 
   function handleFileSelect(input) {
     if (input.files && input.files[0]) {
         let file = input.files[0];
         
-        // Validate Extension
-        if (!file.name.toLowerCase().endsWith(".bin")) {
+        // Validate Extension (esptool flasher stubs are the only other files accepted)
+        const isStub = file.name.startsWith("stub_flasher_") && file.name.endsWith(".json");
+        if (!file.name.toLowerCase().endsWith(".bin") && !isStub) {
             alert("Only .bin files are allowed!");
             input.value = ""; 
             return;
@@ -444,26 +810,73 @@ const char files_html[] = R"rawliteral(
   }
 
   function reloadFiles() {
-    fetch('/list').then(res => res.json()).then(data => {
-        availableFiles = data;
+    const prefix = document.getElementById('fileFilter').value;
+    const dir = encodeURIComponent(currentDir);
+    Promise.all([
+        fetch('/list?dir=' + dir + '&prefix=' + encodeURIComponent(prefix)).then(res => res.json()),
+        fetch('/folders?dir=' + dir).then(res => res.json())
+    ]).then(([files, folders]) => {
+        availableFiles = files;
+        availableFolders = folders.filter(d => d.startsWith(prefix));
         renderFileManager();
     });
   }
 
+  function openFolder(dir) {
+    currentDir = dir;
+    document.getElementById('fileFilter').value = '';
+    reloadFiles();
+  }
+
+  // Folders exist once a file is uploaded into them
+  function newFolder() {
+    const name = prompt("Folder name (e.g. product/v1.2):");
+    if(!name) return;
+    if(name.split('/').some(p => p === '' || p === '.' || p === '..')) { alert("Invalid folder name"); return; }
+    openFolder(currentDir ? currentDir + '/' + name : name);
+  }
+
+  function renderFolderPath() {
+    let html = `<a onclick="openFolder('')">/</a>`;
+    let path = '';
+    if(currentDir) currentDir.split('/').forEach(part => {
+        path = path ? path + '/' + part : part;
+        html += ` <a onclick="openFolder('${path}')">${part}</a> /`;
+    });
+    document.getElementById('folderPath').innerHTML = html;
+  }
+
   function renderFileManager() {
+    renderFolderPath();
     const tbody = document.getElementById('fileListBody');
     tbody.innerHTML = '';
-    if(availableFiles.length === 0) {
-        tbody.innerHTML = '<tr><td colspan="3" style="text-align:center; padding: 20px; color: #777;">No files found on storage</td></tr>';
+    const base = currentDir ? currentDir + '/' : '';
+    if(currentDir) {
+        const up = currentDir.includes('/') ? currentDir.substring(0, currentDir.lastIndexOf('/')) : '';
+        const tr = document.createElement('tr');
+        tr.className = 'folder-row';
+        tr.innerHTML = `<td colspan="4" onclick="openFolder('${up}')">📁 ..</td>`;
+        tbody.appendChild(tr);
+    }
+    availableFolders.forEach(d => {
+        const tr = document.createElement('tr');
+        tr.className = 'folder-row';
+        tr.innerHTML = `<td colspan="4" onclick="openFolder('${base + d}')">📁 <strong>${d}</strong></td>`;
+        tbody.appendChild(tr);
+    });
+    if(availableFiles.length === 0 && availableFolders.length === 0) {
+        tbody.innerHTML += '<tr><td colspan="4" style="text-align:center; padding: 20px; color: #777;">No files found in this folder</td></tr>';
         return;
     }
     availableFiles.forEach(f => {
         const tr = document.createElement('tr');
         tr.innerHTML = `
-            <td><strong>${f.name}</strong></td>
+            <td><strong>${f.name.substring(base.length)}</strong></td>
             <td>${f.size}</td>
+            <td>${f.chip ? f.chip + ' ' : ''}${f.type}${f.segments ? ' (' + f.segments + ' segments)' : ''}</td>
             <td class="actions">
                 <button class="action-btn btn-dl" onclick="downloadFile('${f.name}')" title="Download">⬇</button>
+                <button class="action-btn btn-pin${f.pinned ? ' pinned' : ''}" onclick="togglePin('${f.name}', ${f.pinned})" title="${f.pinned ? 'Unpin' : 'Pin to host flash'}">📌</button>
                 <button class="action-btn btn-ren" onclick="renameFile('${f.name}')" title="Rename">✎</button>
                 <button class="action-btn btn-del" onclick="deleteFile('${f.name}')" title="Delete">🗑</button>
             </td>
@@ -514,7 +927,7 @@ const char files_html[] = R"rawliteral(
         btn.disabled = false; 
         btn.innerText = originalText; 
     };
-    xhr.open("POST", "/upload", true);
+    xhr.open("POST", currentDir ? "/upload?dir=" + encodeURIComponent(currentDir) : "/upload", true);
     xhr.send(formData);
   }
 
@@ -526,6 +939,7 @@ const char files_html[] = R"rawliteral(
   }
 
   function renameFile(oldName) {
+    // A path moves it to another folder
     const newName = prompt("New name (must end in .bin):", oldName);
     if(newName && newName !== oldName) {
         if(!newName.toLowerCase().endsWith(".bin")) { alert("Must end with .bin"); return; }
@@ -535,6 +949,15 @@ const char files_html[] = R"rawliteral(
     }
   }
 
+  function togglePin(name, pinned) {
+    fetch((pinned ? '/unpin?name=' : '/pin?name=') + encodeURIComponent(name)).then(res => {
+        if(!res.ok) { res.text().then(t => alert(t)); return; }
+        // Pinning copies the file in the background
+        if(!pinned) res.text().then(id => alert("Pinning " + name + " as job #" + id + ", see status"));
+        reloadFiles();
+    });
+  }
+
   function downloadFile(name) {
     window.location.href = "/download?name=" + encodeURIComponent(name);
   }
@@ -552,27 +975,109 @@ void WebPortal::begin() {
     server.on("/", HTTP_GET, [](AsyncWebServerRequest *request){
         String html = String(index_html);
         html.replace("%FIRMWARE_VERSION%", FIRMWARE_VERSION);
+        html.replace("%AUTO_MANIFEST%", FLASHER_AUTO_MANIFEST);
         request->send(200, "text/html", html);
     });
 
-    // List Files (For API)
+    // List Files (For API): JSON array from the file index, streamed in chunks.
+    // ?prefix= filters by path, ?offset= and ?limit= page through the
+    // matches, X-Total-Count tells how many match. With ?dir= only the files
+    // right in that folder are listed and prefix applies to their names.
     server.on("/list", HTTP_GET, [](AsyncWebServerRequest *request){
-        std::vector<String> files = SDStorage.listFiles("/");
-        // Should use ArduinoJson to build this properly
-        DynamicJsonDocument doc(4096);
-        JsonArray array = doc.to<JsonArray>();
-        
-        for(const auto &f : files) {
-            int sep = f.indexOf('|');
-            String name = f.substring(0, sep);
-            String size = f.substring(sep+1);
-            JsonObject obj = array.createNestedObject();
-            obj["name"] = name;
-            obj["size"] = size;
+        String prefix = request->hasParam("prefix") ? request->getParam("prefix")->value() : "";
+        bool direct = request->hasParam("dir");
+        if(direct) {
+            String dir = request->getParam("dir")->value();
+            if(dir.length() && !SDManager::validPath(dir)) {
+                request->send(400, "text/plain", "Invalid dir");
+                return;
+            }
+            if(dir.length()) prefix = dir + "/" + prefix;
         }
-        String output;
-        serializeJson(doc, output);
-        request->send(200, "application/json", output);
+        size_t offset = request->hasParam("offset") ? request->getParam("offset")->value().toInt() : 0;
+        size_t limit = request->hasParam("limit") ? request->getParam("limit")->value().toInt() : SIZE_MAX;
+
+        // Only the page is copied, the filler renders one file at a time
+        struct Listing {
+            std::vector<FileInfo> files;
+            size_t next = 0;
+            String pending = "[";
+            size_t sent = 0;
+        };
+        auto listing = std::make_shared<Listing>();
+        size_t total = Files.page(prefix, offset, limit, listing->files, direct);
+
+        AsyncWebServerResponse *response = request->beginChunkedResponse("application/json",
+            [listing](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+                size_t len = 0;
+                while(len < maxLen) {
+                    if(listing->sent == listing->pending.length()) {
+                        if(listing->next > listing->files.size()) break; // "]" sent
+                        listing->sent = 0;
+                        if(listing->next == listing->files.size()) {
+                            listing->pending = "]";
+                            listing->next++;
+                            continue;
+                        }
+
+                        const FileInfo &f = listing->files[listing->next];
+                        StaticJsonDocument<384> doc;
+                        doc["name"] = f.name;
+                        doc["size"] = f.size;
+                        doc["mtime"] = f.mtime;
+                        doc["type"] = f.type;
+                        if(f.chip.length()) doc["chip"] = f.chip;
+                        if(f.segments) doc["segments"] = f.segments;
+                        if(f.hasDigest) {
+                            char md5[33];
+                            for(int i = 0; i < 16; i++) sprintf(md5 + 2 * i, "%02x", f.md5[i]);
+                            doc["md5"] = md5;
+                        }
+                        doc["pinned"] = Pinned.isPinned(f.name);
+                        listing->pending = listing->next ? "," : "";
+                        String entry;
+                        serializeJson(doc, entry);
+                        listing->pending += entry;
+                        listing->next++;
+                    }
+                    size_t n = min(maxLen - len, listing->pending.length() - listing->sent);
+                    memcpy(buffer + len, listing->pending.c_str() + listing->sent, n);
+                    len += n;
+                    listing->sent += n;
+                }
+                return len;
+            });
+        response->addHeader("X-Total-Count", String(total));
+        request->send(response);
+    });
+
+    // Folders right in ?dir= (the root if missing) that hold .bin files
+    server.on("/folders", HTTP_GET, [](AsyncWebServerRequest *request){
+        String dir = request->hasParam("dir") ? request->getParam("dir")->value() : "";
+        if(dir.length() && !SDManager::validPath(dir)) {
+            request->send(400, "text/plain", "Invalid dir");
+            return;
+        }
+        AsyncResponseStream *response = request->beginResponseStream("application/json");
+        response->print("[");
+        bool first = true;
+        for(const String &name : Files.folders(dir)) {
+            if(!first) response->print(",");
+            first = false;
+            StaticJsonDocument<128> doc;
+            doc.set(name);
+            serializeJson(doc, *response);
+        }
+        response->print("]");
+        request->send(response);
+    });
+
+    // Rebuilds the file index after the card was changed elsewhere. Opens
+    // every file, so it runs on a task of its own and /list catches up later.
+    server.on("/rescan", HTTP_GET, [](AsyncWebServerRequest *request){
+        if(Files.startRescan()) request->send(202, "text/plain", "Rescan started");
+        else if(Files.scanning()) request->send(409, "text/plain", "Rescan running");
+        else request->send(500, "text/plain", "Rescan failed to start");
     });
 
     // File Manager UI
@@ -582,6 +1087,10 @@ void WebPortal::begin() {
 
     // Upload Handler
     server.on("/upload", HTTP_POST, [](AsyncWebServerRequest *request){
+        if(uploadError.length()) {
+            request->send(500, "text/plain", "Upload Failed: " + uploadError);
+            return;
+        }
         String target = "/";
         // if (request->hasParam("upload", true, true)) {
         //     AsyncWebParameter* p = request->getParam("upload", true, true);
@@ -591,49 +1100,151 @@ void WebPortal::begin() {
         request->redirect(target);
     }, WebPortal::handleUpload);
 
-    // Flash Handler (JSON POST)
+    // Flash Handler (JSON POST), queues a write job. The body arrives through
+    // the body handler below, the request handler runs once it is complete.
     server.on("/flash", HTTP_POST, [](AsyncWebServerRequest *request){
-        // Request body processing happens in onBody or we assume it's small enough?
-        // AsyncWebServer handles body in specific callback usually.
-        // We will register a body handler below.
-        request->send(200, "text/plain", "Flash Started");
+        Serial.println("Flash Request: " + flashBody);
+
+        DynamicJsonDocument doc(2048);
+        DeserializationError error = deserializeJson(doc, flashBody);
+        if (error) {
+            Serial.print("deserializeJson() failed: ");
+            Serial.println(error.c_str());
+            request->send(400, "text/plain", "JSON Error");
+            return;
+        }
+
+        String target = doc["target"].as<String>();
+        JsonArray files = doc["files"].as<JsonArray>();
+
+        std::vector<FlashFile> flashFiles;
+        for(JsonObject f : files) {
+            FlashFile ff;
+            ff.name = f["name"].as<String>();
+            // Parse address string (supports 0x prefix or int)
+            String addrStr = f["address"].as<String>();
+            ff.address = (uint32_t) strtol(addrStr.c_str(), NULL, 0); 
+            flashFiles.push_back(ff);
+        }
+
+        FlashOptions options;
+        if(doc.containsKey("compress")) options.compress = doc["compress"].as<bool>();
+        if(doc.containsKey("delta")) options.delta = doc["delta"].as<bool>();
+        if(doc.containsKey("sparse")) options.sparse = doc["sparse"].as<bool>();
+        if(doc.containsKey("gang")) options.gang = doc["gang"].as<bool>();
+
+        sendJob(request, Flasher.flashFirmware(target, flashFiles, options));
     }, NULL, [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total){
         // Accumulate body
-        static String jsonBody;
-        if(index == 0) jsonBody = "";
-        for(size_t i=0; i<len; i++) jsonBody += (char)data[i];
-        
-        if(index + len == total) {
-            Serial.println("Flash Request: " + jsonBody);
-            Flasher.setStatus("Parsing Flash Request...");
-            
-            DynamicJsonDocument doc(2048);
-            DeserializationError error = deserializeJson(doc, jsonBody);
-            if (error) {
-                Serial.print("deserializeJson() failed: ");
-                Serial.println(error.c_str());
-                Flasher.setStatus("JSON Error");
+        if(index == 0) flashBody = "";
+        for(size_t i=0; i<len; i++) flashBody += (char)data[i];
+    });
+
+    // Stream Flash Handler: the raw body (application/octet-stream) is the
+    // image, flashed at ?address= while it arrives. ?target=, ?compress= and
+    // ?verify= as for /flash, ?name= also keeps it on storage. Answers once
+    // the upload is through, the job may still be writing the rest.
+    server.on("/flash_stream", HTTP_POST, [](AsyncWebServerRequest *request){
+        StreamUpload *upload = (StreamUpload *)request->_tempObject;
+        if(!upload) request->send(400, "text/plain", "Missing image");
+        else if(upload->code) request->send(upload->code, "text/plain", upload->error);
+        else request->send(200, "text/plain", String(upload->job));
+    }, NULL, [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total){
+        if(index == 0) {
+            StreamUpload *upload = (StreamUpload *)calloc(1, sizeof(StreamUpload));
+            if(!upload) return;
+            request->_tempObject = upload;
+
+            String name = request->hasParam("name") ? request->getParam("name")->value() : "";
+            String error;
+            if(!request->hasParam("address")) {
+                upload->code = 400;
+                error = "Missing address";
+            } else if(total == 0) {
+                upload->code = 400;
+                error = "Missing image (Content-Length)";
+            } else if(name.length() && (!name.endsWith(".bin") || !SDManager::validPath(name))) {
+                upload->code = 400;
+                error = "Invalid name (.bin only)";
+            } else if(Flasher.isFlashing() || Jobs.pending() || Jobs.running()) {
+                // The upload cannot wait behind other jobs. flashStream()
+                // checks again, in case auto mode queues one meanwhile.
+                upload->code = 409;
+                error = "Flasher busy";
+            } else if(!Feed.open(total, name, error)) {
+                upload->code = 503;
+            }
+            if(upload->code) {
+                strlcpy(upload->error, error.c_str(), sizeof(upload->error));
+                Serial.println("Stream rejected: " + error);
                 return;
             }
 
-            String target = doc["target"].as<String>();
-            JsonArray files = doc["files"].as<JsonArray>();
-            
-            std::vector<FlashFile> flashFiles;
-            for(JsonObject f : files) {
-                FlashFile ff;
-                ff.name = f["name"].as<String>();
-                // Parse address string (supports 0x prefix or int)
-                String addrStr = f["address"].as<String>();
-                ff.address = (uint32_t) strtol(addrStr.c_str(), NULL, 0); 
-                flashFiles.push_back(ff);
-            }
-            
-            if(!Flasher.flashFirmware(target, flashFiles)) {
-                Serial.println("Flasher Busy!");
-                Flasher.setStatus("System Busy");
+            String target = request->hasParam("target") ? request->getParam("target")->value() : "esp32";
+            uint32_t address = (uint32_t) strtoul(request->getParam("address")->value().c_str(), NULL, 0);
+            FlashOptions options;
+            if(request->hasParam("compress")) options.compress = request->getParam("compress")->value() == "true";
+            if(request->hasParam("verify")) options.verify = request->getParam("verify")->value() == "true";
+            upload->job = Flasher.flashStream(target, address, total, name, options);
+            upload->generation = Feed.generation();
+            if(!upload->job) {
+                Feed.abort(upload->generation);
+                Feed.close();
+                upload->code = 409;
+                strlcpy(upload->error, "Flasher busy", sizeof(upload->error));
+                return;
             }
+            uint32_t generation = upload->generation;
+            request->onDisconnect([generation](){ Feed.abort(generation); });
+            // Acknowledges what was held back once the flasher handed blocks
+            // back. Polls come every ~0.5s from the async_tcp task, the same
+            // one the body arrives on. The request's own poll only sends a
+            // long response, this one is short.
+            request->client()->onPoll([](void *arg, AsyncClient *client){
+                StreamUpload *upload = (StreamUpload *)((AsyncWebServerRequest *)arg)->_tempObject;
+                if(!upload || !upload->unacked) return;
+                if(Feed.generation() == upload->generation && Feed.full()) return;
+                client->ack(upload->unacked);
+                upload->unacked = 0;
+            }, request);
         }
+
+        StreamUpload *upload = (StreamUpload *)request->_tempObject;
+        if(!upload || !upload->job || upload->code) return;
+        if(!Feed.write(data, len)) {
+            // The rest of the body is dropped, the job has the details
+            upload->code = 500;
+            snprintf(upload->error, sizeof(upload->error), "Stream Error: %s", Feed.error());
+        } else if(Feed.full()) {
+            // The peer stops at the window instead of the async_tcp task waiting
+            request->client()->ackLater();
+            upload->unacked += len;
+            return;
+        }
+        if(upload->unacked) {
+            request->client()->ack(upload->unacked);
+            upload->unacked = 0;
+        }
+    });
+
+    // Flash Read-back Handler
+    server.on("/read_flash", HTTP_POST, [](AsyncWebServerRequest *request){
+        if(!request->hasParam("address", true) || !request->hasParam("size", true) || !request->hasParam("name", true)) {
+            request->send(400, "text/plain", "Missing params");
+            return;
+        }
+        String target = request->hasParam("target", true) ? request->getParam("target", true)->value() : "esp32";
+        uint32_t address = (uint32_t) strtoul(request->getParam("address", true)->value().c_str(), NULL, 0);
+        uint32_t size = (uint32_t) strtoul(request->getParam("size", true)->value().c_str(), NULL, 0);
+        String name = request->getParam("name", true)->value();
+
+        // Dumps show up in the file manager, which only lists .bin files
+        if(size == 0 || !name.endsWith(".bin") || !SDManager::validPath(name)) {
+            request->send(400, "text/plain", "Invalid size or name (.bin only)");
+            return;
+        }
+
+        sendJob(request, Flasher.readFlash(target, address, size, name));
     });
 
     // Status Handler
@@ -641,37 +1252,141 @@ void WebPortal::begin() {
         request->send(200, "text/plain", Flasher.getStatus());
     });
 
-    // Logs Handler
-    server.on("/logs", HTTP_GET, [](AsyncWebServerRequest *request){
-        size_t index = 0;
-        if(request->hasParam("index")) {
-            index = request->getParam("index")->value().toInt();
+    // Pinned images: copied into the host's flash by the flasher task
+    server.on("/pin", HTTP_GET, [](AsyncWebServerRequest *request){
+        if(!request->hasParam("name")) {
+            request->send(400, "text/plain", "Missing name param");
+            return;
         }
-        
-        std::vector<String> newLogs = Flasher.getLogs(index);
-        DynamicJsonDocument doc(4096);
-        JsonArray arr = doc.createNestedArray("logs");
-        for(const auto &l : newLogs) {
-            arr.add(l);
+        if(!Pinned.available()) {
+            request->send(501, "text/plain", "No " FLASHER_PIN_PARTITION " partition");
+            return;
         }
-        doc["nextIndex"] = Flasher.getLogCount();
-        
+        sendJob(request, Flasher.pinImage(request->getParam("name")->value()));
+    });
+
+    server.on("/unpin", HTTP_GET, [](AsyncWebServerRequest *request){
+        if(!request->hasParam("name")) {
+            request->send(400, "text/plain", "Missing name param");
+            return;
+        }
+        if(Pinned.unpin(request->getParam("name")->value())) request->send(200, "text/plain", "Unpinned");
+        else request->send(404, "text/plain", "Not pinned");
+    });
+
+    server.on("/pinned", HTTP_GET, [](AsyncWebServerRequest *request){
+        DynamicJsonDocument doc(2048);
+        doc["free"] = Pinned.freeSpace();
+        JsonArray array = doc.createNestedArray("images");
+        for(const auto &p : Pinned.list()) {
+            int sep = p.indexOf('|');
+            JsonObject obj = array.createNestedObject();
+            obj["name"] = p.substring(0, sep);
+            obj["size"] = p.substring(sep+1).toInt();
+        }
+
+        String output;
+        serializeJson(doc, output);
+        request->send(200, "application/json", output);
+    });
+
+    // Whole-job progress, rates in bytes/s and times in seconds
+    server.on("/progress", HTTP_GET, [](AsyncWebServerRequest *request){
+        request->send(200, "application/json", progressJson(true));
+    });
+
+    // Push channel for the main page, polling the endpoints above still works
+    events.onConnect([](AsyncEventSourceClient *client){
+        client->send(Flasher.getStatus().c_str(), "status");
+        client->send(progressJson(false).c_str(), "progress");
+    });
+    server.addHandler(&events);
+
+    // Image cache counters
+    server.on("/cache", HTTP_GET, [](AsyncWebServerRequest *request){
+        DynamicJsonDocument doc(256);
+        doc["hits"] = Images.hits();
+        doc["misses"] = Images.misses();
+        doc["entries"] = Images.count();
+        doc["used"] = Images.used();
+        doc["capacity"] = Images.capacity();
+
         String output;
         serializeJson(doc, output);
         request->send(200, "application/json", output);
     });
 
+    // Job queue: records of queued, running and recent jobs, oldest first
+    server.on("/jobs", HTTP_GET, [](AsyncWebServerRequest *request){
+        request->send(200, "application/json", jobsJson(SIZE_MAX));
+    });
+
+    server.on("/job", HTTP_GET, [](AsyncWebServerRequest *request){
+        JobRecord r;
+        if(!request->hasParam("id") || !Jobs.find(request->getParam("id")->value().toInt(), r)) {
+            request->send(404, "text/plain", "No such job");
+            return;
+        }
+        DynamicJsonDocument doc(512);
+        doc["id"] = r.id;
+        doc["state"] = JobRecord::stateName(r.state);
+        doc["summary"] = r.summary;
+        doc["result"] = r.result;
+        doc["queued"] = r.queued;
+        doc["duration"] = r.duration;
+
+        String output;
+        serializeJson(doc, output);
+        request->send(200, "application/json", output);
+    });
+
+    server.on("/cancel_job", HTTP_GET, [](AsyncWebServerRequest *request){
+        if(!request->hasParam("id")) {
+            request->send(400, "text/plain", "Missing id param");
+            return;
+        }
+        if(Jobs.cancel(request->getParam("id")->value().toInt())) request->send(200, "text/plain", "Cancelled");
+        else request->send(409, "text/plain", "Job not queued");
+    });
+
+    // Production line mode: ?enable=0|1 arms or stops it, stats either way
+    server.on("/auto", HTTP_GET, [](AsyncWebServerRequest *request){
+        if(request->hasParam("enable")) {
+            String error;
+            if(!Auto.setEnabled(request->getParam("enable")->value().toInt() != 0, error)) {
+                request->send(400, "text/plain", error);
+                return;
+            }
+        }
+
+        request->send(200, "application/json", autoJson(true));
+    });
+
+    // Logs Handler: lines from ?index= on, for clients without /events
+    server.on("/logs", HTTP_GET, [](AsyncWebServerRequest *request){
+        uint32_t index = 0;
+        if(request->hasParam("index")) {
+            index = request->getParam("index")->value().toInt();
+        }
+
+        AsyncResponseStream *response = request->beginResponseStream("application/json");
+        printLogs(*response, index);
+        request->send(response);
+    });
+
     // Delete Handler
     server.on("/delete", HTTP_GET, [](AsyncWebServerRequest *request){
         if(request->hasParam("name")){
             String filename = request->getParam("name")->value();
+            if(!SDManager::validPath(filename)) {
+                request->send(400, "text/plain", "Invalid name");
+                return;
+            }
             String path = "/" + filename;
-            bool success = false;
-            #ifdef USE_SD_CARD
-                if(SD.exists(path)) success = SD.remove(path);
-            #else
-                if(SPIFFS.exists(path)) success = SPIFFS.remove(path);
-            #endif
+            bool success = SDStorage.remove(path.c_str());
+            Images.invalidate(path.c_str());
+            Pinned.unpin(filename);
+            if(success) Files.remove(filename);
             
             if(success) request->send(200, "text/plain", "Deleted " + filename);
             else request->send(500, "text/plain", "Delete Failed");
@@ -683,6 +1398,12 @@ void WebPortal::begin() {
     // Rename Handler
     server.on("/rename", HTTP_GET, [](AsyncWebServerRequest *request){
         if(request->hasParam("old") && request->hasParam("new")){
+            if(!SDManager::validPath(request->getParam("old")->value()) ||
+               !SDManager::validPath(request->getParam("new")->value())) {
+                request->send(400, "text/plain", "Invalid name");
+                return;
+            }
+            // Moves between folders as well
             String oldName = "/" + request->getParam("old")->value();
             String newName = "/" + request->getParam("new")->value();
             
@@ -692,12 +1413,12 @@ void WebPortal::begin() {
                  return;
             }
             
-            bool success = false;
-            #ifdef USE_SD_CARD
-                if(SD.exists(oldName)) success = SD.rename(oldName, newName);
-            #else
-                if(SPIFFS.exists(oldName)) success = SPIFFS.rename(oldName, newName);
-            #endif
+            bool success = SDStorage.rename(oldName.c_str(), newName.c_str());
+            Images.invalidate(oldName.c_str());
+            Images.invalidate(newName.c_str());
+            Pinned.unpin(oldName.substring(1));
+            Pinned.unpin(newName.substring(1));
+            if(success) Files.rename(oldName, newName);
             
             if(success) request->send(200, "text/plain", "Renamed to " + newName);
             else request->send(500, "text/plain", "Rename Failed");
@@ -711,19 +1432,17 @@ void WebPortal::begin() {
         if(request->hasParam("name")){
             String filename = request->getParam("name")->value();
             String path = "/" + filename;
-            
+            FileInfo info;
+            // Images resolve through the index, only other files are looked up on storage
+            if(!SDManager::validPath(filename) || (!Files.find(filename, info) && !SDStorage.exists(path.c_str()))) {
+                request->send(404, "text/plain", "File not found");
+                return;
+            }
             #ifdef USE_SD_CARD
-                if(SD.exists(path)) {
-                    request->send(SD, path, "application/octet-stream", true);
-                }
+                request->send(SD, path, "application/octet-stream", true);
             #else
-                if(SPIFFS.exists(path)) {
-                     request->send(SPIFFS, path, "application/octet-stream", true);
-                }
+                request->send(SPIFFS, path, "application/octet-stream", true);
             #endif
-            else {
-                request->send(404, "text/plain", "File not found");
-            }
         } else {
             request->send(400, "text/plain", "Missing name param");
         }
@@ -774,6 +1493,8 @@ void WebPortal::begin() {
 }
 
 void WebPortal::loop() {
+    pushEvents();
+
     // Handle OTA Update in Main Loop Context
     if(shouldUpdateFirmware && updateFirmwareUrl.length() > 0) {
         Flasher.setStatus("Starting OTA from Main Loop...");
@@ -798,43 +1519,56 @@ void WebPortal::loop() {
 
 // Helper to keep track of upload file across packets
 // Note: This simple static implementation assumes single-user, single-upload access.
-static File uploadFile;
-static String finalFilename; 
+// The data itself goes through Uploads, see UploadWriter.
+static String finalFilename;
+// Recorded in the file index once the upload completes
+static uint8_t uploadHeader[FileIndex::HEADER_SIZE];
+static size_t uploadHeaderLen = 0;
 
 void WebPortal::handleUpload(AsyncWebServerRequest *request, String filename, size_t index, uint8_t *data, size_t len, bool final) {
     if(!index){
-        // Begin Upload: Ensure any previous handle is closed
-        if(uploadFile) {
-            uploadFile.close();
-        }
+        // Begin Upload: Drop an upload whose client went away
+        Uploads.abort();
+        uploadError = "";
 
         Serial.printf("Upload Start: %s\n", filename.c_str());
         
-        // Validation: Only allow .bin files
-        if(!filename.endsWith(".bin") && !filename.endsWith(".BIN")) {
+        // Validation: Only allow .bin files (and esptool's flasher stubs)
+        bool isStub = filename.startsWith("stub_flasher_") && filename.endsWith(".json");
+        if(!filename.endsWith(".bin") && !filename.endsWith(".BIN") && !isStub) {
              Serial.println("Error: Upload rejected. Only .bin files allowed.");
              request->send(400, "text/plain", "Only .bin files allowed");
              // We can't easily stop the upload stream from here, but we can refuse to open the file.
              return; 
         }
 
+        // ?dir= puts it into a folder, created as needed
+        String dir = request->hasParam("dir") ? request->getParam("dir")->value() : "";
+        if(!SDManager::validPath(filename) || (dir.length() && (isStub || !SDManager::validPath(dir)))) {
+             Serial.println("Error: Upload rejected. Invalid folder.");
+             request->send(400, "text/plain", "Invalid folder");
+             return;
+        }
+
         finalFilename = filename;
         
-        #ifdef USE_SD_CARD
-            String path = "/" + filename;
-            if(SD.exists(path)) SD.remove(path);
-            uploadFile = SD.open(path, FILE_WRITE);
-        #else
+        #ifndef USE_SD_CARD
             // SPIFFS has a 32-char path limit (including /). Truncate if needed.
-            // Max filename length ~30 chars to be safe.
-            if(filename.length() > 30) {
+            // Max filename length ~30 chars to be safe, less the folder.
+            int maxLen = 30 - (dir.length() ? dir.length() + 1 : 0);
+            if(maxLen < 8) {
+                 Serial.println("Error: Upload rejected. Folder name too long for SPIFFS.");
+                 request->send(400, "text/plain", "Folder name too long");
+                 return;
+            }
+            if((int)filename.length() > maxLen) {
                 String ext = ".bin";
                 if(filename.lastIndexOf('.') != -1) {
                     ext = filename.substring(filename.lastIndexOf('.'));
                 }
                 
                 int extLen = ext.length();
-                int baseLen = 30 - extLen; 
+                int baseLen = maxLen - extLen; 
                 int half = (baseLen - 2) / 2; 
                 
                 String start = filename.substring(0, half);
@@ -842,29 +1576,39 @@ void WebPortal::handleUpload(AsyncWebServerRequest *request, String filename, si
                 
                 finalFilename = start + ".." + end + ext;
                 
-                Serial.printf("Filename too long (>30 chars). Smart Truncated: %s\n", finalFilename.c_str());
+                Serial.printf("Filename too long (>%d chars). Smart Truncated: %s\n", maxLen, finalFilename.c_str());
             } else {
                 finalFilename = filename;
             }
-            
-            String path = "/" + finalFilename;
-            if(SPIFFS.exists(path)) SPIFFS.remove(path);
-            uploadFile = SPIFFS.open(path, FILE_WRITE);
         #endif
+        if(dir.length()) finalFilename = dir + "/" + finalFilename;
+        
+        String path = "/" + finalFilename;
         
-        if(!uploadFile) {
+        // Also voids a load of the old file still in progress
+        Images.invalidate(path.c_str());
+        Pinned.unpin(finalFilename);
+
+        if(!Uploads.open(path)) {
             Serial.println("Error: Failed to open file for writing at " + String(finalFilename));
             // e.g. SD card missing or full
+            uploadError = "Cannot create " + finalFilename;
         } else {
             Flasher.setStatus("Uploading " + finalFilename + " (0%)");
+            uploadHeaderLen = 0;
         }
     }
     
     // Write Data
-    if(uploadFile){
-        if(uploadFile.write(data, len) != len){
-            Serial.println("Error: Write failed!");
+    if(Uploads.active()){
+        if(!Uploads.write(data, len)){
+            // Nothing more is written, the file goes once the upload ends
+            if(!uploadError.length()) Serial.printf("Error: Write failed! %s\n", Uploads.error());
+            uploadError = Uploads.error();
         }
+        size_t headerLen = min(len, sizeof(uploadHeader) - uploadHeaderLen);
+        memcpy(uploadHeader + uploadHeaderLen, data, headerLen);
+        uploadHeaderLen += headerLen;
         
         // Progress Calcs
         size_t total = request->contentLength();
@@ -878,10 +1622,20 @@ void WebPortal::handleUpload(AsyncWebServerRequest *request, String filename, si
     
     // Finalize
     if(final){
-        if(uploadFile){
-            uploadFile.close();
-            Serial.printf("Upload End: %s, %u bytes\n", finalFilename.c_str(), index+len);
-            Flasher.setStatus("Upload Complete: " + finalFilename);
+        if(Uploads.active()){
+            // Hashed as it was written, so verifying never reads it back
+            uint8_t digest[16];
+            bool ok = Uploads.finish(digest);
+            Images.invalidate(("/" + finalFilename).c_str());
+            if(ok) {
+                Files.update(finalFilename, uploadHeader, uploadHeaderLen, digest);
+                Serial.printf("Upload End: %s, %u bytes\n", finalFilename.c_str(), index+len);
+                Flasher.setStatus("Upload Complete: " + finalFilename);
+            } else {
+                uploadError = Uploads.error();
+                Files.remove(finalFilename);
+                Flasher.setStatus("Upload Failed: " + finalFilename + " (" + uploadError + ")");
+            }
         } else {
              // If file wasn't open (e.g. rejection), maybe log
              Serial.println("Upload finished but file was not open (Rejected?)");
@@ -0,0 +1,312 @@
+/* Copyright 2020 Espressif Systems (Shanghai) PTE LTD
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "esp32_port.h"
+#include "serial_io.h"
+#include "driver/uart.h"
+#include "driver/gpio.h"
+#include "esp_timer.h"
+#include "esp_idf_version.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+// One instance per UART, each can serve its own loader context
+struct loader_esp32_port {
+    uart_port_t uart_port;
+    QueueHandle_t uart_queue;
+    uint32_t reset_trigger_pin;
+    uint32_t gpio0_trigger_pin;
+    int32_t tx_buffer_size;
+    int64_t time_end;
+    bool installed;
+};
+
+static loader_esp32_port_t s_ports[UART_NUM_MAX];
+static loader_esp32_port_t *s_default_port = NULL;
+
+
+// Instance of the calling task's loader context, the first one initialized otherwise
+static inline loader_esp32_port_t *current_port(void)
+{
+    loader_esp32_port_t *port = (loader_esp32_port_t *)loader_port_instance();
+    return (port != NULL) ? port : s_default_port;
+}
+
+
+esp_loader_error_t loader_port_esp32_init(const loader_esp32_config_t *config)
+{
+    if (config->uart_port >= UART_NUM_MAX) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    loader_esp32_port_t *port = &s_ports[config->uart_port];
+    port->uart_port = config->uart_port;
+    port->reset_trigger_pin = config->reset_trigger_pin;
+    port->gpio0_trigger_pin = config->gpio0_trigger_pin;
+    port->tx_buffer_size = config->tx_buffer_size;
+
+    uart_config_t uart_config = {
+        .baud_rate = config->baud_rate,
+        .data_bits = UART_DATA_8_BITS,
+        .parity    = UART_PARITY_DISABLE,
+        .stop_bits = UART_STOP_BITS_1,
+        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+        .source_clk = UART_SCLK_DEFAULT,
+#endif
+    };
+
+    if (uart_param_config(port->uart_port, &uart_config) != ESP_OK) {
+        return ESP_LOADER_ERROR_FAIL;
+    }
+    if (uart_set_pin(port->uart_port, config->uart_tx_pin, config->uart_rx_pin,
+                     UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE) != ESP_OK) {
+        return ESP_LOADER_ERROR_FAIL;
+    }
+    if (uart_driver_install(port->uart_port, config->rx_buffer_size, config->tx_buffer_size,
+                            config->queue_size, &port->uart_queue, 0) != ESP_OK) {
+        return ESP_LOADER_ERROR_FAIL;
+    }
+    port->installed = true;
+
+    // Report received bytes after a short idle gap instead of the default 10 symbols
+    if (uart_set_rx_timeout(port->uart_port, config->rx_timeout_threshold) != ESP_OK) {
+        return ESP_LOADER_ERROR_FAIL;
+    }
+
+    gpio_reset_pin(port->reset_trigger_pin);
+    gpio_set_direction(port->reset_trigger_pin, GPIO_MODE_OUTPUT);
+    gpio_set_level(port->reset_trigger_pin, 1);
+
+    gpio_reset_pin(port->gpio0_trigger_pin);
+    gpio_set_direction(port->gpio0_trigger_pin, GPIO_MODE_OUTPUT);
+    gpio_set_level(port->gpio0_trigger_pin, 1);
+
+    if (s_default_port == NULL) {
+        s_default_port = port;
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+
+loader_esp32_port_t *loader_port_esp32_get(uint32_t uart_port)
+{
+    if (uart_port >= UART_NUM_MAX || !s_ports[uart_port].installed) {
+        return NULL;
+    }
+    return &s_ports[uart_port];
+}
+
+
+void loader_port_esp32_deinit(void)
+{
+    for (int i = 0; i < UART_NUM_MAX; i++) {
+        if (s_ports[i].installed) {
+            uart_driver_delete(s_ports[i].uart_port);
+            s_ports[i].installed = false;
+        }
+    }
+    s_default_port = NULL;
+}
+
+
+static uint32_t remaining_ms(int64_t deadline)
+{
+    int64_t remaining = deadline - esp_timer_get_time();
+    return (remaining > 0) ? (remaining + 999) / 1000 : 0;
+}
+
+
+// Blocks until the driver posts an event or the deadline passes.
+static esp_loader_error_t wait_uart_event(loader_esp32_port_t *port, int64_t deadline)
+{
+    uint32_t timeout = remaining_ms(deadline);
+    uart_event_t event;
+
+    if (timeout == 0) {
+        return ESP_LOADER_ERROR_TIMEOUT;
+    }
+
+    // Rounded up, a zero tick wait would return immediately
+    TickType_t ticks = (timeout + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS;
+    if (xQueueReceive(port->uart_queue, &event, ticks) != pdTRUE) {
+        return ESP_LOADER_ERROR_TIMEOUT;
+    }
+
+    if (event.type == UART_FIFO_OVF || event.type == UART_BUFFER_FULL) {
+        // Part of the response is lost, drop the rest so the next command starts clean
+        uart_flush_input(port->uart_port);
+        xQueueReset(port->uart_queue);
+        loader_port_debug_print("UART RX overflow\n");
+        return ESP_LOADER_ERROR_FAIL;
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+
+static esp_loader_error_t read_some(loader_esp32_port_t *port, uint8_t *data, uint16_t size,
+                                    uint16_t *received, int64_t deadline)
+{
+    size_t buffered = 0;
+
+    *received = 0;
+    uart_get_buffered_data_len(port->uart_port, &buffered);
+
+    // Events may be left over for bytes read already, so the buffer is checked again
+    while (buffered == 0) {
+        RETURN_ON_ERROR( wait_uart_event(port, deadline) );
+        uart_get_buffered_data_len(port->uart_port, &buffered);
+    }
+
+    int read = uart_read_bytes(port->uart_port, data, (buffered < size) ? buffered : size, 0);
+    if (read < 0) {
+        return ESP_LOADER_ERROR_FAIL;
+    }
+
+    *received = read;
+    return ESP_LOADER_SUCCESS;
+}
+
+
+esp_loader_error_t loader_port_serial_read_some(uint8_t *data, uint16_t size, uint16_t *received, uint32_t timeout)
+{
+    return read_some(current_port(), data, size, received, esp_timer_get_time() + (int64_t)timeout * 1000);
+}
+
+
+esp_loader_error_t loader_port_serial_read(uint8_t *data, uint16_t size, uint32_t timeout)
+{
+    int64_t deadline = esp_timer_get_time() + (int64_t)timeout * 1000;
+    uint16_t received;
+    loader_esp32_port_t *port = current_port();
+
+    while (size > 0) {
+        RETURN_ON_ERROR( read_some(port, data, size, &received, deadline) );
+        data += received;
+        size -= received;
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+
+esp_loader_error_t loader_port_serial_write(const uint8_t *data, uint16_t size, uint32_t timeout)
+{
+    loader_esp32_port_t *port = current_port();
+
+    if (uart_write_bytes(port->uart_port, (const char *)data, size) != size) {
+        return ESP_LOADER_ERROR_FAIL;
+    }
+
+    esp_err_t err = uart_wait_tx_done(port->uart_port, pdMS_TO_TICKS(timeout));
+
+    if (err == ESP_OK) {
+        return ESP_LOADER_SUCCESS;
+    } else if (err == ESP_ERR_TIMEOUT) {
+        return ESP_LOADER_ERROR_TIMEOUT;
+    } else {
+        return ESP_LOADER_ERROR_FAIL;
+    }
+}
+
+
+// The TX ring only takes data while it is idle, and at most half of it at a
+// time: the driver then never waits for room. Without a ring, only what fits
+// in the FIFO is taken.
+esp_loader_error_t loader_port_serial_write_some(const uint8_t *data, uint16_t size, uint16_t *written)
+{
+    loader_esp32_port_t *port = current_port();
+    int taken;
+
+    *written = 0;
+    if (port->tx_buffer_size > 0) {
+        if (uart_wait_tx_done(port->uart_port, 0) != ESP_OK) {
+            return ESP_LOADER_SUCCESS;
+        }
+        uint16_t chunk = port->tx_buffer_size / 2;
+        taken = uart_write_bytes(port->uart_port, (const char *)data, (size < chunk) ? size : chunk);
+    } else {
+        taken = uart_tx_chars(port->uart_port, (const char *)data, size);
+    }
+
+    if (taken < 0) {
+        return ESP_LOADER_ERROR_FAIL;
+    }
+
+    *written = taken;
+    return ESP_LOADER_SUCCESS;
+}
+
+
+void loader_port_flush_input(void)
+{
+    loader_esp32_port_t *port = current_port();
+
+    uart_flush_input(port->uart_port);
+    xQueueReset(port->uart_queue);
+}
+
+
+esp_loader_error_t loader_port_change_baudrate(uint32_t baudrate)
+{
+    esp_err_t err = uart_set_baudrate(current_port()->uart_port, baudrate);
+    return (err == ESP_OK) ? ESP_LOADER_SUCCESS : ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+}
+
+
+// Set GPIO0 LOW, then assert reset pin for 50 milliseconds.
+void loader_port_enter_bootloader(void)
+{
+    loader_esp32_port_t *port = current_port();
+
+    gpio_set_level(port->reset_trigger_pin, 0);
+    gpio_set_level(port->gpio0_trigger_pin, 0);
+    loader_port_delay_ms(50);
+    gpio_set_level(port->reset_trigger_pin, 1);
+    loader_port_delay_ms(50);
+    gpio_set_level(port->gpio0_trigger_pin, 1);
+}
+
+
+void loader_port_reset_target(void)
+{
+    loader_esp32_port_t *port = current_port();
+
+    gpio_set_level(port->reset_trigger_pin, 0);
+    loader_port_delay_ms(50);
+    gpio_set_level(port->reset_trigger_pin, 1);
+}
+
+
+void loader_port_delay_ms(uint32_t ms)
+{
+    vTaskDelay(ms / portTICK_PERIOD_MS);
+}
+
+
+void loader_port_start_timer(uint32_t ms)
+{
+    current_port()->time_end = esp_timer_get_time() + (int64_t)ms * 1000;
+}
+
+
+uint32_t loader_port_remaining_time(void)
+{
+    int64_t remaining = (current_port()->time_end - esp_timer_get_time()) / 1000;
+    return (remaining > 0) ? (uint32_t)remaining : 0;
+}
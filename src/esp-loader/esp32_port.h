@@ -0,0 +1,76 @@
+/* Copyright 2020 Espressif Systems (Shanghai) PTE LTD
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include "esp_loader.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    uint32_t baud_rate;             /*!< Initial baud rate */
+    uint32_t uart_port;             /*!< UART driven by the port */
+    uint32_t uart_rx_pin;           /*!< Connected to target TX */
+    uint32_t uart_tx_pin;           /*!< Connected to target RX */
+    uint32_t reset_trigger_pin;     /*!< Connected to target RST */
+    uint32_t gpio0_trigger_pin;     /*!< Connected to target GPIO0 (boot mode) */
+    int32_t rx_buffer_size;         /*!< UART driver RX ring buffer size */
+    int32_t tx_buffer_size;         /*!< UART driver TX ring buffer size, 0 makes writes blocking */
+    uint32_t rx_timeout_threshold;  /*!< Idle time, in UART symbols, after which received data is reported */
+    int32_t queue_size;             /*!< UART event queue length */
+} loader_esp32_config_t;
+
+/**
+ * @brief Port instance driving one UART
+ */
+typedef struct loader_esp32_port loader_esp32_port_t;
+
+/**
+  * @brief Installs UART driver and configures reset and boot pins.
+  *        Reads block on the driver event queue, no polling is involved.
+  *
+  * @note  Can be called once for each UART. The first one initialized serves
+  *        the default loader context, the others are used through contexts
+  *        created for loader_port_esp32_get().
+  *
+  * @param config[in]  Port configuration.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_INVALID_PARAM No such UART
+  *     - ESP_LOADER_ERROR_FAIL Driver installation failed
+  */
+esp_loader_error_t loader_port_esp32_init(const loader_esp32_config_t *config);
+
+/**
+  * @brief Returns port instance to be passed to esp_loader_create().
+  *
+  * @param uart_port[in]  UART initialized by loader_port_esp32_init.
+  *
+  * @return  Port instance, NULL if the UART has not been initialized.
+  */
+loader_esp32_port_t *loader_port_esp32_get(uint32_t uart_port);
+
+/**
+  * @brief Deletes UART drivers installed by loader_port_esp32_init.
+  */
+void loader_port_esp32_deinit(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -20,6 +20,7 @@
 #include "esp_targets.h"
 #include "md5_hash.h"
 #include <string.h>
+#include <stdlib.h>
 #include <assert.h>
 
 #ifndef MAX
@@ -33,38 +34,103 @@
 static const uint32_t DEFAULT_TIMEOUT = 1000;
 static const uint32_t DEFAULT_FLASH_TIMEOUT = 3000;       // timeout for most flash operations
 static const uint32_t ERASE_REGION_TIMEOUT_PER_MB = 10000; // timeout (per megabyte) for erasing a region
+static const uint32_t DEFLATE_WRITE_TIMEOUT_PER_MB = 10000; // timeout (per megabyte) for writing inflated data
+static const uint32_t ERASE_WRITE_TIMEOUT_PER_MB = 40000;  // timeout (per megabyte) for stub erasing and writing
+static const uint32_t STUB_RAM_BLOCK_SIZE = 0x1800;        // maximum block size of MEM_DATA
+static const uint32_t READ_FLASH_PACKET_SIZE = 0x1000;     // stub READ_FLASH data frame size
+static const uint32_t READ_FLASH_MAX_IN_FLIGHT = 4;        // stub READ_FLASH packets sent ahead of acks
+static const uint32_t ROM_READ_CHUNK_SIZE = 64;            // SPI data registers W0..W15
+static const uint32_t FLASH_SECTOR_SIZE = 0x1000;          // erase granularity
+static const uint32_t BAUD_SETTLE_TIME = 10;               // ms for target UART to switch rate
+static const uint32_t BAUD_CONFIRM_READS = 3;              // READ_REG echoes confirming a new rate
 static const uint8_t  PADDING_PATTERN = 0xFF;
 
 typedef enum {
+    SPI_FLASH_READ = 0x03,
     SPI_FLASH_READ_ID = 0x9F
 } spi_flash_cmd_t;
 
-static uint32_t s_flash_write_size = 0;
-static const target_registers_t *s_reg = NULL;
-static target_chip_t s_target = ESP_UNKNOWN_CHIP;
+struct esp_loader {
+    serial_comm_t serial;
+    void *port;
+    uint32_t flash_write_size;
+    const target_registers_t *reg;
+    target_chip_t target;
+    uint32_t deflate_image_size;
+    uint32_t baudrate;
+    esp_loader_session_t session;
+    esp_loader_connect_args_t connect_args;
+    bool spi_params_set;
+#if MD5_ENABLED
+    struct MD5Context md5_context;
+    uint32_t start_address;
+    uint32_t image_size;
+#endif
+};
+
+// Serves every task that has not bound a context of its own
+static esp_loader_t s_default_loader = { .target = ESP_UNKNOWN_CHIP };
+static __thread esp_loader_t *s_bound_loader = NULL;
+
+static inline esp_loader_t *current(void)
+{
+    return (s_bound_loader != NULL) ? s_bound_loader : &s_default_loader;
+}
+
+serial_comm_t *loader_serial_comm(void)
+{
+    return &current()->serial;
+}
+
+void *loader_port_instance(void)
+{
+    return current()->port;
+}
+
+esp_loader_t *esp_loader_create(void *port)
+{
+    esp_loader_t *loader = calloc(1, sizeof(esp_loader_t));
+
+    if (loader != NULL) {
+        loader->port = port;
+        loader->target = ESP_UNKNOWN_CHIP;
+    }
+
+    return loader;
+}
+
+void esp_loader_destroy(esp_loader_t *loader)
+{
+    if (s_bound_loader == loader) {
+        s_bound_loader = NULL;
+    }
+    free(loader);
+}
+
+void esp_loader_bind(esp_loader_t *loader)
+{
+    s_bound_loader = loader;
+}
 
 #if MD5_ENABLED
 
 static const uint32_t MD5_TIMEOUT_PER_MB = 800;
-static struct MD5Context s_md5_context;
-static uint32_t s_start_address;
-static uint32_t s_image_size;
 
 static inline void init_md5(uint32_t address, uint32_t size)
 {
-    s_start_address = address;
-    s_image_size = size;
-    MD5Init(&s_md5_context);
+    current()->start_address = address;
+    current()->image_size = size;
+    MD5Init(&current()->md5_context);
 }
 
 static inline void md5_update(const uint8_t *data, uint32_t size)
 {
-    MD5Update(&s_md5_context, data, size);
+    MD5Update(&current()->md5_context, data, size);
 }
 
 static inline void md5_final(uint8_t digets[16])
 {
-    MD5Final(digets, &s_md5_context);
+    MD5Final(digets, &current()->md5_context);
 }
 
 #else
@@ -82,12 +148,77 @@ static uint32_t timeout_per_mb(uint32_t size_bytes, uint32_t time_per_mb)
     return MAX(timeout, DEFAULT_FLASH_TIMEOUT);
 }
 
+static esp_loader_error_t mem_write_segment(uint32_t address, const uint8_t *data, uint32_t size)
+{
+    uint32_t blocks_to_write = (size + STUB_RAM_BLOCK_SIZE - 1) / STUB_RAM_BLOCK_SIZE;
+
+    loader_port_start_timer(DEFAULT_TIMEOUT);
+    RETURN_ON_ERROR( loader_mem_begin_cmd(address, size, STUB_RAM_BLOCK_SIZE, blocks_to_write, current()->target) );
+
+    while (size > 0) {
+        uint32_t block = MIN(size, STUB_RAM_BLOCK_SIZE);
+        loader_port_start_timer(DEFAULT_TIMEOUT);
+        RETURN_ON_ERROR( loader_mem_data_cmd(data, block) );
+        data += block;
+        size -= block;
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+static esp_loader_error_t run_stub(const esp_loader_stub_t *stub)
+{
+    RETURN_ON_ERROR( mem_write_segment(stub->text_start, stub->text, stub->text_size) );
+    if (stub->data_size > 0) {
+        RETURN_ON_ERROR( mem_write_segment(stub->data_start, stub->data, stub->data_size) );
+    }
+
+    loader_port_start_timer(DEFAULT_TIMEOUT);
+    RETURN_ON_ERROR( loader_mem_end_cmd(stub->entry) );
+
+    // Stub announces itself once it is up
+    loader_port_start_timer(DEFAULT_TIMEOUT);
+    RETURN_ON_ERROR( loader_stub_greeting() );
+
+    loader_set_stub_running(true);
+
+    return ESP_LOADER_SUCCESS;
+}
+
+static esp_loader_error_t detect_flash(uint32_t *flash_id, uint32_t *flash_size);
+
+// Reads everything later commands need from the target once per connection
+static esp_loader_error_t init_session(uint32_t spi_config)
+{
+    current()->session.target = current()->target;
+    current()->session.spi_config = spi_config;
+
+    if (detect_flash(&current()->session.flash_id, &current()->session.flash_size) != ESP_LOADER_SUCCESS) {
+        loader_port_debug_print("Flash size detection failed, falling back to default\n");
+    }
+
+    // Only informational, e.g. an unknown ESP8266 OUI must not fail the connection
+    loader_port_start_timer(DEFAULT_TIMEOUT);
+    if (loader_read_mac(current()->target, current()->session.mac) != ESP_LOADER_SUCCESS) {
+        loader_port_debug_print("MAC read failed\n");
+        memset(current()->session.mac, 0, sizeof(current()->session.mac));
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
 esp_loader_error_t esp_loader_connect(esp_loader_connect_args_t *connect_args)
 {
-    uint32_t spi_config;
+    uint32_t spi_config = 0;
     esp_loader_error_t err;
     int32_t trials = connect_args->trials;
 
+    loader_set_stub_running(false);
+    current()->connect_args = *connect_args;
+    current()->baudrate = connect_args->baudrate;
+    current()->spi_params_set = false;
+    memset(&current()->session, 0, sizeof(current()->session));
+
     loader_port_enter_bootloader();
 
     do {
@@ -103,31 +234,75 @@ esp_loader_error_t esp_loader_connect(esp_loader_connect_args_t *connect_args)
         }
     } while (err != ESP_LOADER_SUCCESS);
 
-    RETURN_ON_ERROR( loader_detect_chip(&s_target, &s_reg) );
+    RETURN_ON_ERROR( loader_detect_chip(&current()->target, &current()->reg) );
 
-    if (s_target == ESP8266_CHIP) {
-        err = loader_flash_begin_cmd(0, 0, 0, 0, s_target);
+    const esp_loader_stub_t *stub = loader_get_stub(current()->target);
+    if (connect_args->load_stub && stub != NULL) {
+        RETURN_ON_ERROR( run_stub(stub) );
+    }
+
+    if (current()->target == ESP8266_CHIP) {
+        // Stub attaches the flash itself
+        if (!loader_is_stub_running()) {
+            loader_port_start_timer(DEFAULT_TIMEOUT);
+            RETURN_ON_ERROR( loader_flash_begin_cmd(0, 0, 0, 0, current()->target) );
+        }
     } else {
-        RETURN_ON_ERROR( loader_read_spi_config(s_target, &spi_config) );
+        RETURN_ON_ERROR( loader_read_spi_config(current()->target, &spi_config) );
         loader_port_start_timer(DEFAULT_TIMEOUT);
-        err = loader_spi_attach_cmd(spi_config);
+        RETURN_ON_ERROR( loader_spi_attach_cmd(spi_config) );
     }
 
-    return err;
+    return init_session(spi_config);
+}
+
+esp_loader_error_t esp_loader_probe(uint32_t timeout_ms)
+{
+    loader_set_stub_running(false);
+    // ROM answers a sync several times, copies left by the last probe must not answer this one
+    loader_flush_input();
+    loader_port_enter_bootloader();
+    loader_port_start_timer(timeout_ms);
+    return loader_sync_cmd();
 }
 
 target_chip_t esp_loader_get_target(void)
 {
-    return s_target;
+    return current()->target;
+}
+
+void esp_loader_register_stub(target_chip_t target, const esp_loader_stub_t *stub)
+{
+    loader_set_stub(target, stub);
+}
+
+bool esp_loader_is_stub_running(void)
+{
+    return loader_is_stub_running();
+}
+
+const esp_loader_session_t *esp_loader_get_session(void)
+{
+    return &current()->session;
+}
+
+uint32_t esp_loader_get_round_trips(void)
+{
+    return loader_get_round_trips();
+}
+
+void esp_loader_reset_round_trips(void)
+{
+    loader_reset_round_trips();
 }
 
 static esp_loader_error_t spi_set_data_lengths(size_t mosi_bits, size_t miso_bits)
 {
     if (mosi_bits > 0) {
-        RETURN_ON_ERROR( esp_loader_write_register(s_reg->mosi_dlen, mosi_bits - 1) );
+        RETURN_ON_ERROR( esp_loader_write_register(current()->reg->mosi_dlen, mosi_bits - 1) );
     }
     if (miso_bits > 0) {
-        RETURN_ON_ERROR( esp_loader_write_register(s_reg->miso_dlen, miso_bits - 1) );
+        RETURN_ON_ERROR( esp_loader_write_register(current()->reg->miso_dlen, miso_bits - 1) );
     }
 
     return ESP_LOADER_SUCCESS;
@@ -137,7 +312,21 @@ static esp_loader_error_t spi_set_data_lengths_8266(size_t mosi_bits, size_t mis
 {
     uint32_t mosi_mask = (mosi_bits == 0) ? 0 : mosi_bits - 1;
     uint32_t miso_mask = (miso_bits == 0) ? 0 : miso_bits - 1;
-    return esp_loader_write_register(s_reg->usr1, (miso_mask << 8) | (mosi_mask << 17));
+    return esp_loader_write_register(current()->reg->usr1, (miso_mask << 8) | (mosi_mask << 17));
+}
+
+// Polls the SPI command register until the user command bit clears
+static esp_loader_error_t spi_wait_done(uint32_t cmd_usr)
+{
+    for (uint32_t trials = 0; trials < 10; trials++) {
+        uint32_t cmd_reg;
+        RETURN_ON_ERROR( esp_loader_read_register(current()->reg->cmd, &cmd_reg) );
+        if ((cmd_reg & cmd_usr) == 0) {
+            return ESP_LOADER_SUCCESS;
+        }
+    }
+
+    return ESP_LOADER_ERROR_TIMEOUT;
 }
 
 static esp_loader_error_t spi_flash_command(spi_flash_cmd_t cmd, void *data_tx, size_t tx_size, void *data_rx, size_t rx_size)
@@ -154,10 +343,10 @@ static esp_loader_error_t spi_flash_command(spi_flash_cmd_t cmd, void *data_tx,
     // Save SPI configuration
     uint32_t old_spi_usr;
     uint32_t old_spi_usr2;
-    RETURN_ON_ERROR( esp_loader_read_register(s_reg->usr, &old_spi_usr) );
-    RETURN_ON_ERROR( esp_loader_read_register(s_reg->usr2, &old_spi_usr2) );
+    RETURN_ON_ERROR( esp_loader_read_register(current()->reg->usr, &old_spi_usr) );
+    RETURN_ON_ERROR( esp_loader_read_register(current()->reg->usr2, &old_spi_usr2) );
 
-    if (s_target == ESP8266_CHIP) {
+    if (current()->target == ESP8266_CHIP) {
         RETURN_ON_ERROR( spi_set_data_lengths_8266(tx_size, rx_size) );
     } else {
         RETURN_ON_ERROR( spi_set_data_lengths(tx_size, rx_size) );
@@ -172,16 +361,16 @@ static esp_loader_error_t spi_flash_command(spi_flash_cmd_t cmd, void *data_tx,
         usr_reg |= SPI_USR_MOSI;
     }
 
-    RETURN_ON_ERROR( esp_loader_write_register(s_reg->usr, usr_reg) );
-    RETURN_ON_ERROR( esp_loader_write_register(s_reg->usr2, usr_reg_2 ) );
+    RETURN_ON_ERROR( esp_loader_write_register(current()->reg->usr, usr_reg) );
+    RETURN_ON_ERROR( esp_loader_write_register(current()->reg->usr2, usr_reg_2 ) );
 
     if (tx_size == 0) {
         // clear data register before we read it
-        RETURN_ON_ERROR( esp_loader_write_register(s_reg->w0, 0) );
+        RETURN_ON_ERROR( esp_loader_write_register(current()->reg->w0, 0) );
     } else {
         uint32_t *data = (uint32_t *)data_tx;
         uint32_t words_to_write = (tx_size + 31) / (8 * 4);
-        uint32_t data_reg_addr = s_reg->w0;
+        uint32_t data_reg_addr = current()->reg->w0;
 
         while (words_to_write--) {
             uint32_t word = *data++;
@@ -190,73 +379,175 @@ static esp_loader_error_t spi_flash_command(spi_flash_cmd_t cmd, void *data_tx,
         }
     }
 
-    RETURN_ON_ERROR( esp_loader_write_register(s_reg->cmd, SPI_CMD_USR) );
+    RETURN_ON_ERROR( esp_loader_write_register(current()->reg->cmd, SPI_CMD_USR) );
 
-    uint32_t trials = 10;
-    while (trials--) {
-        uint32_t cmd_reg;
-        RETURN_ON_ERROR( esp_loader_read_register(s_reg->cmd, &cmd_reg) );
-        if ((cmd_reg & SPI_CMD_USR) == 0) {
-            break;
-        }
-    }
+    RETURN_ON_ERROR( spi_wait_done(SPI_CMD_USR) );
 
-    if (trials == 0) {
-        return ESP_LOADER_ERROR_TIMEOUT;
-    }
-
-    RETURN_ON_ERROR( esp_loader_read_register(s_reg->w0, data_rx) );
+    RETURN_ON_ERROR( esp_loader_read_register(current()->reg->w0, data_rx) );
 
     // Restore SPI configuration
-    RETURN_ON_ERROR( esp_loader_write_register(s_reg->usr, old_spi_usr) );
-    RETURN_ON_ERROR( esp_loader_write_register(s_reg->usr2, old_spi_usr2) );
+    RETURN_ON_ERROR( esp_loader_write_register(current()->reg->usr, old_spi_usr) );
+    RETURN_ON_ERROR( esp_loader_write_register(current()->reg->usr2, old_spi_usr2) );
 
     return ESP_LOADER_SUCCESS;
 }
 
-static esp_loader_error_t detect_flash_size(size_t *flash_size)
+// ROM loader has no read command, so flash is read through the SPI peripheral:
+// command and 24 bit address go out as MOSI data, up to 64 bytes come back in W0..W15.
+static esp_loader_error_t flash_read_rom(uint8_t *buffer, uint32_t address, uint32_t length)
+{
+    uint32_t SPI_USR_CMD  = (1 << 31);
+    uint32_t SPI_USR_MISO = (1 << 28);
+    uint32_t SPI_USR_MOSI = (1 << 27);
+    uint32_t SPI_CMD_USR  = (1 << 18);
+    uint32_t CMD_LEN_SHIFT = 28;
+
+    uint32_t old_spi_usr;
+    uint32_t old_spi_usr2;
+    RETURN_ON_ERROR( esp_loader_read_register(current()->reg->usr, &old_spi_usr) );
+    RETURN_ON_ERROR( esp_loader_read_register(current()->reg->usr2, &old_spi_usr2) );
+
+    // From here on every way out restores the SPI configuration
+    esp_loader_error_t err = esp_loader_write_register(current()->reg->usr, SPI_USR_CMD | SPI_USR_MOSI | SPI_USR_MISO);
+    if (err == ESP_LOADER_SUCCESS) {
+        err = esp_loader_write_register(current()->reg->usr2, (7 << CMD_LEN_SHIFT) | SPI_FLASH_READ);
+    }
+
+    uint32_t chunk_size = 0;
+
+    while (length > 0 && err == ESP_LOADER_SUCCESS) {
+        uint32_t chunk = MIN(length, ROM_READ_CHUNK_SIZE);
+
+        // Lengths only change for the last chunk
+        if (chunk != chunk_size) {
+            if (current()->target == ESP8266_CHIP) {
+                err = spi_set_data_lengths_8266(24, chunk * 8);
+            } else {
+                err = spi_set_data_lengths(24, chunk * 8);
+            }
+            if (err != ESP_LOADER_SUCCESS) {
+                break;
+            }
+            chunk_size = chunk;
+        }
+
+        // Address is sent most significant byte first
+        uint32_t address_word = ((address >> 16) & 0xFF) | (address & 0xFF00) | ((address & 0xFF) << 16);
+        err = esp_loader_write_register(current()->reg->w0, address_word);
+        if (err == ESP_LOADER_SUCCESS) {
+            err = esp_loader_write_register(current()->reg->cmd, SPI_CMD_USR);
+        }
+        if (err == ESP_LOADER_SUCCESS) {
+            err = spi_wait_done(SPI_CMD_USR);
+        }
+
+        for (uint32_t i = 0; i < chunk && err == ESP_LOADER_SUCCESS; i += 4) {
+            uint32_t word;
+            err = esp_loader_read_register(current()->reg->w0 + i, &word);
+            if (err == ESP_LOADER_SUCCESS) {
+                memcpy(&buffer[i], &word, MIN(4, chunk - i));
+            }
+        }
+
+        buffer += chunk;
+        address += chunk;
+        length -= chunk;
+    }
+
+    // Restored after a failure as well, later SPI commands expect the old setup
+    esp_loader_error_t restore = esp_loader_write_register(current()->reg->usr, old_spi_usr);
+    if (restore == ESP_LOADER_SUCCESS) {
+        restore = esp_loader_write_register(current()->reg->usr2, old_spi_usr2);
+    }
+
+    return (err != ESP_LOADER_SUCCESS) ? err : restore;
+}
+
+static esp_loader_error_t detect_flash(uint32_t *flash_id, uint32_t *flash_size)
 {
-    uint32_t flash_id = 0;
+    uint32_t id = 0;
 
-    RETURN_ON_ERROR( spi_flash_command(SPI_FLASH_READ_ID, NULL, 0, &flash_id, 24) );
-    uint32_t size_id = flash_id >> 16;
+    loader_port_start_timer(DEFAULT_TIMEOUT);
+    RETURN_ON_ERROR( spi_flash_command(SPI_FLASH_READ_ID, NULL, 0, &id, 24) );
+    uint32_t size_id = id >> 16;
 
     if (size_id < 0x12 || size_id > 0x18) {
         return ESP_LOADER_ERROR_UNSUPPORTED_CHIP;
     }
 
+    *flash_id = id;
     *flash_size = 1 << size_id;
 
     return ESP_LOADER_SUCCESS;
 }
 
-esp_loader_error_t esp_loader_flash_start(uint32_t offset, uint32_t image_size, uint32_t block_size)
+// Flash size comes from the session, SPI parameters are only sent once per session
+static esp_loader_error_t set_flash_parameters(uint32_t image_size)
 {
-    uint32_t blocks_to_write = (image_size + block_size - 1) / block_size;
-    uint32_t erase_size = block_size * blocks_to_write;
-    s_flash_write_size = block_size;
+    uint32_t flash_size = current()->session.flash_size;
 
-    size_t flash_size = 0;
-    if (detect_flash_size(&flash_size) == ESP_LOADER_SUCCESS) {
-        if (image_size > flash_size) {
-            return ESP_LOADER_ERROR_IMAGE_SIZE;
-        }
+    if (flash_size == 0) {
+        return ESP_LOADER_SUCCESS;
+    }
+    if (image_size > flash_size) {
+        return ESP_LOADER_ERROR_IMAGE_SIZE;
+    }
+    if (!current()->spi_params_set) {
         loader_port_start_timer(DEFAULT_TIMEOUT);
         RETURN_ON_ERROR( loader_spi_parameters(flash_size) );
-    } else {
-        loader_port_debug_print("Flash size detection failed, falling back to default");
+        current()->spi_params_set = true;
     }
 
+    return ESP_LOADER_SUCCESS;
+}
+
+esp_loader_error_t esp_loader_flash_start(uint32_t offset, uint32_t image_size, uint32_t block_size)
+{
+    uint32_t blocks_to_write = (image_size + block_size - 1) / block_size;
+    uint32_t erase_size = block_size * blocks_to_write;
+    current()->flash_write_size = block_size;
+
+    RETURN_ON_ERROR( set_flash_parameters(image_size) );
+
     init_md5(offset, image_size);
 
+    // Stub erases as it writes, so there is no upfront erase to wait for
+    if (loader_is_stub_running()) {
+        loader_port_start_timer(DEFAULT_TIMEOUT);
+        return loader_flash_begin_cmd(offset, image_size, block_size, blocks_to_write, current()->target);
+    }
+
     loader_port_start_timer(timeout_per_mb(erase_size, ERASE_REGION_TIMEOUT_PER_MB));
-    return loader_flash_begin_cmd(offset, erase_size, block_size, blocks_to_write, s_target);
+    return loader_flash_begin_cmd(offset, erase_size, block_size, blocks_to_write, current()->target);
 }
 
 
-esp_loader_error_t esp_loader_flash_write(void *payload, uint32_t size)
+esp_loader_error_t esp_loader_flash_erase_region(uint32_t offset, uint32_t size)
+{
+    if (size == 0) {
+        return ESP_LOADER_SUCCESS;
+    }
+
+    // Stub rejects partial sectors
+    size = (size + FLASH_SECTOR_SIZE - 1) & ~(FLASH_SECTOR_SIZE - 1);
+
+    RETURN_ON_ERROR( set_flash_parameters(offset + size) );
+
+    loader_port_start_timer(timeout_per_mb(size, ERASE_REGION_TIMEOUT_PER_MB));
+
+    if (loader_is_stub_running()) {
+        return loader_erase_region_cmd(offset, size);
+    }
+
+    // ROM erases the whole region on FLASH_BEGIN, no data has to follow
+    return loader_flash_begin_cmd(offset, size, FLASH_SECTOR_SIZE, 0, current()->target);
+}
+
+
+// Pads the block, hashes it and starts the timer of its FLASH_DATA command
+static void flash_write_prepare(void *payload, uint32_t size)
 {
-    uint32_t padding_bytes = s_flash_write_size - size;
+    uint32_t padding_bytes = current()->flash_write_size - size;
     uint8_t *data = (uint8_t *)payload;
     uint32_t padding_index = size;
 
@@ -266,9 +557,19 @@ esp_loader_error_t esp_loader_flash_write(void *payload, uint32_t size)
 
     md5_update(payload, (size + 3) & ~3);
 
-    loader_port_start_timer(DEFAULT_TIMEOUT);
+    if (loader_is_stub_running()) {
+        loader_port_start_timer(timeout_per_mb(current()->flash_write_size, ERASE_WRITE_TIMEOUT_PER_MB));
+    } else {
+        loader_port_start_timer(DEFAULT_TIMEOUT);
+    }
+}
+
+
+esp_loader_error_t esp_loader_flash_write(void *payload, uint32_t size)
+{
+    flash_write_prepare(payload, size);
 
-    return loader_flash_data_cmd(data, s_flash_write_size);
+    return loader_flash_data_cmd(payload, current()->flash_write_size);
 }
 
 
@@ -280,6 +581,115 @@ esp_loader_error_t esp_loader_flash_finish(bool reboot)
 }
 
 
+esp_loader_error_t esp_loader_flash_deflate_start(uint32_t offset, uint32_t image_size,
+                                                  uint32_t compressed_size, uint32_t block_size)
+{
+    // ESP8266 ROM has no inflater
+    if (current()->target == ESP8266_CHIP && !loader_is_stub_running()) {
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    }
+
+    uint32_t blocks_to_write = (compressed_size + block_size - 1) / block_size;
+    // ROM erases the whole region upfront, rounded up to the block size
+    uint32_t erase_size = block_size * ((image_size + block_size - 1) / block_size);
+    current()->flash_write_size = block_size;
+    current()->deflate_image_size = image_size;
+
+    RETURN_ON_ERROR( set_flash_parameters(image_size) );
+
+    // Stub expects the exact image size and erases as it goes
+    if (loader_is_stub_running()) {
+        loader_port_start_timer(DEFAULT_TIMEOUT);
+        return loader_flash_defl_begin_cmd(offset, image_size, block_size, blocks_to_write, current()->target);
+    }
+
+    loader_port_start_timer(timeout_per_mb(erase_size, ERASE_REGION_TIMEOUT_PER_MB));
+    return loader_flash_defl_begin_cmd(offset, erase_size, block_size, blocks_to_write, current()->target);
+}
+
+
+static esp_loader_error_t flash_deflate_prepare(uint32_t size)
+{
+    if (size > current()->flash_write_size) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    // A single block may inflate to anything up to the whole image
+    if (loader_is_stub_running()) {
+        loader_port_start_timer(timeout_per_mb(current()->deflate_image_size, ERASE_WRITE_TIMEOUT_PER_MB));
+    } else {
+        loader_port_start_timer(timeout_per_mb(current()->deflate_image_size, DEFLATE_WRITE_TIMEOUT_PER_MB));
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+
+esp_loader_error_t esp_loader_flash_deflate_write(const void *payload, uint32_t size)
+{
+    RETURN_ON_ERROR( flash_deflate_prepare(size) );
+
+    return loader_flash_defl_data_cmd(payload, size);
+}
+
+
+esp_loader_error_t esp_loader_flash_deflate_finish(bool reboot)
+{
+    loader_port_start_timer(DEFAULT_TIMEOUT);
+
+    return loader_flash_defl_end_cmd(!reboot);
+}
+
+
+// Stub streams the region in packets, each acknowledged with the running byte count,
+// and closes the stream with the MD5 of all data sent.
+static esp_loader_error_t flash_read_stub(uint8_t *buffer, uint32_t address, uint32_t length)
+{
+    uint8_t digest[16];
+    uint32_t received = 0;
+
+    loader_port_start_timer(DEFAULT_TIMEOUT);
+    RETURN_ON_ERROR( loader_read_flash_cmd(address, length, READ_FLASH_PACKET_SIZE, READ_FLASH_MAX_IN_FLIGHT) );
+
+    while (received < length) {
+        uint32_t packet_size;
+        loader_port_start_timer(DEFAULT_TIMEOUT);
+        RETURN_ON_ERROR( loader_read_flash_data(&buffer[received], length - received, &packet_size) );
+        received += packet_size;
+        RETURN_ON_ERROR( loader_read_flash_ack(received) );
+    }
+
+    loader_port_start_timer(DEFAULT_TIMEOUT);
+    RETURN_ON_ERROR( loader_read_flash_digest(digest) );
+
+#if MD5_ENABLED
+    uint8_t read_digest[16];
+    struct MD5Context md5_context;
+    MD5Init(&md5_context);
+    MD5Update(&md5_context, buffer, length);
+    MD5Final(read_digest, &md5_context);
+
+    if (memcmp(digest, read_digest, sizeof(digest)) != 0) {
+        loader_port_debug_print("Error: Read flash MD5 does not match\n");
+        return ESP_LOADER_ERROR_INVALID_MD5;
+    }
+#endif
+
+    return ESP_LOADER_SUCCESS;
+}
+
+
+esp_loader_error_t esp_loader_flash_read(uint8_t *buffer, uint32_t address, uint32_t length)
+{
+    if (loader_is_stub_running()) {
+        return flash_read_stub(buffer, address, length);
+    }
+
+    loader_port_start_timer(DEFAULT_TIMEOUT);
+    return flash_read_rom(buffer, address, length);
+}
+
+
 esp_loader_error_t esp_loader_read_register(uint32_t address, uint32_t *reg_value)
 {
     loader_port_start_timer(DEFAULT_TIMEOUT);
@@ -297,13 +707,94 @@ esp_loader_error_t esp_loader_write_register(uint32_t address, uint32_t reg_valu
 
 esp_loader_error_t esp_loader_change_baudrate(uint32_t baudrate)
 {
-    if (s_target == ESP8266_CHIP) {
+    bool stub = loader_is_stub_running();
+
+    if (current()->target == ESP8266_CHIP && !stub) {
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    }
+
+    loader_port_start_timer(DEFAULT_TIMEOUT);
+
+    RETURN_ON_ERROR( loader_change_baudrate_cmd(baudrate, stub ? current()->baudrate : 0) );
+
+    current()->baudrate = baudrate;
+
+    return ESP_LOADER_SUCCESS;
+}
+
+// Reads a ROM register a few times, any error or wrong value fails the rate
+static esp_loader_error_t confirm_baudrate(uint32_t expected)
+{
+    for (uint32_t i = 0; i < BAUD_CONFIRM_READS; i++) {
+        uint32_t value;
+        loader_port_start_timer(DEFAULT_TIMEOUT);
+        RETURN_ON_ERROR( loader_read_reg_cmd(CHIP_DETECT_MAGIC_REG_ADDR, &value) );
+        if (value != expected) {
+            return ESP_LOADER_ERROR_INVALID_RESPONSE;
+        }
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+
+static esp_loader_error_t try_baudrate(uint32_t baudrate, uint32_t expected)
+{
+    RETURN_ON_ERROR( esp_loader_change_baudrate(baudrate) );
+    RETURN_ON_ERROR( loader_port_change_baudrate(baudrate) );
+    loader_port_delay_ms(BAUD_SETTLE_TIME);
+
+    return confirm_baudrate(expected);
+}
+
+
+// Gets both sides back to the connect rate after a failed step
+static esp_loader_error_t restore_baudrate(uint32_t baudrate, uint32_t expected)
+{
+    // Target may have switched, in which case this has a chance to reach it
+    if (current()->baudrate != baudrate) {
+        esp_loader_change_baudrate(baudrate);
+    }
+    loader_port_change_baudrate(baudrate);
+    loader_port_delay_ms(BAUD_SETTLE_TIME);
+    current()->baudrate = baudrate;
+
+    if (confirm_baudrate(expected) == ESP_LOADER_SUCCESS) {
+        return ESP_LOADER_SUCCESS;
+    }
+
+    loader_port_debug_print("Link lost while changing baud rate, reconnecting\n");
+    esp_loader_connect_args_t connect_args = current()->connect_args;
+    return esp_loader_connect(&connect_args);
+}
+
+
+esp_loader_error_t esp_loader_negotiate_baudrate(const uint32_t *rates, uint32_t count, uint32_t *selected)
+{
+    uint32_t base = current()->baudrate;
+    uint32_t expected;
+
+    *selected = base;
+
+    if (current()->target == ESP8266_CHIP && !loader_is_stub_running()) {
         return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
     }
 
     loader_port_start_timer(DEFAULT_TIMEOUT);
+    RETURN_ON_ERROR( loader_read_reg_cmd(CHIP_DETECT_MAGIC_REG_ADDR, &expected) );
 
-    return loader_change_baudrate_cmd(baudrate);
+    for (uint32_t i = 0; i < count; i++) {
+        if (rates[i] <= base) {
+            break;
+        }
+        if (try_baudrate(rates[i], expected) == ESP_LOADER_SUCCESS) {
+            *selected = rates[i];
+            return ESP_LOADER_SUCCESS;
+        }
+        RETURN_ON_ERROR( restore_baudrate(base, expected) );
+    }
+
+    return ESP_LOADER_SUCCESS;
 }
 
 #if MD5_ENABLED
@@ -321,28 +812,35 @@ static void hexify(const uint8_t raw_md5[16], uint8_t hex_md5_out[32])
 }
 
 
-esp_loader_error_t esp_loader_flash_verify(void)
+esp_loader_error_t esp_loader_flash_read_md5(uint32_t address, uint32_t size, uint8_t md5[16])
 {
-    if (s_target == ESP8266_CHIP) {
+    if (current()->target == ESP8266_CHIP && !loader_is_stub_running()) {
         return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
     }
 
-    uint8_t raw_md5[16];
-    uint8_t hex_md5[MD5_SIZE + 1];
-    uint8_t received_md5[MD5_SIZE + 1];
+    loader_port_start_timer(timeout_per_mb(size, MD5_TIMEOUT_PER_MB));
 
-    md5_final(raw_md5);
-    hexify(raw_md5, hex_md5);
+    return loader_md5_cmd(address, size, md5);
+}
 
-    loader_port_start_timer(timeout_per_mb(s_image_size, MD5_TIMEOUT_PER_MB));
 
-    RETURN_ON_ERROR( loader_md5_cmd(s_start_address, s_image_size, received_md5) );
+static esp_loader_error_t verify_md5(uint32_t address, uint32_t size, const uint8_t raw_md5[16])
+{
+    uint8_t raw_received_md5[16];
+    uint8_t hex_md5[MD5_SIZE + 2];
+    uint8_t received_md5[MD5_SIZE + 2];
 
-    bool md5_match = memcmp(hex_md5, received_md5, MD5_SIZE) == 0;
+    RETURN_ON_ERROR( esp_loader_flash_read_md5(address, size, raw_received_md5) );
+
+    bool md5_match = memcmp(raw_md5, raw_received_md5, sizeof(raw_received_md5)) == 0;
 
     if (!md5_match) {
+        hexify(raw_md5, hex_md5);
+        hexify(raw_received_md5, received_md5);
         hex_md5[MD5_SIZE] = '\n';
         received_md5[MD5_SIZE] = '\n';
+        hex_md5[MD5_SIZE + 1] = '\0';
+        received_md5[MD5_SIZE + 1] = '\0';
 
         loader_port_debug_print("Error: MD5 checksum does not match:\n");
         loader_port_debug_print("Expected:\n");
@@ -356,9 +854,118 @@ esp_loader_error_t esp_loader_flash_verify(void)
     return ESP_LOADER_SUCCESS;
 }
 
+
+esp_loader_error_t esp_loader_flash_verify(void)
+{
+    uint8_t raw_md5[16];
+
+    md5_final(raw_md5);
+
+    return verify_md5(current()->start_address, current()->image_size, raw_md5);
+}
+
+
+esp_loader_error_t esp_loader_flash_verify_known_md5(uint32_t address, uint32_t size,
+                                                     const uint8_t expected_md5[16])
+{
+    return verify_md5(address, size, expected_md5);
+}
+
 #endif
 
 void esp_loader_reset_target(void)
 {
     loader_port_reset_target();
 }
+
+
+// Async calls run on the given context, whichever one the calling task is bound to
+static inline esp_loader_t *enter(esp_loader_t *loader)
+{
+    esp_loader_t *previous = s_bound_loader;
+    s_bound_loader = loader;
+    return previous;
+}
+
+static inline esp_loader_error_t leave(esp_loader_t *previous, esp_loader_error_t err)
+{
+    s_bound_loader = previous;
+    return err;
+}
+
+static inline bool command_in_flight(void)
+{
+    esp_loader_async_state_t state = loader_engine_state();
+    return state == ESP_LOADER_ASYNC_SEND || state == ESP_LOADER_ASYNC_AWAIT_RESPONSE;
+}
+
+
+esp_loader_error_t esp_loader_async_flash_write(esp_loader_t *loader, void *payload, uint32_t size)
+{
+    esp_loader_t *previous = enter(loader);
+
+    // Checked before the block is hashed, a rejected block must not end up in the MD5
+    if (command_in_flight()) {
+        return leave(previous, ESP_LOADER_ERROR_FAIL);
+    }
+
+    flash_write_prepare(payload, size);
+
+    return leave(previous, loader_flash_data_submit(payload, current()->flash_write_size));
+}
+
+
+esp_loader_error_t esp_loader_async_flash_deflate_write(esp_loader_t *loader, const void *payload, uint32_t size)
+{
+    esp_loader_t *previous = enter(loader);
+
+    // Checked before the timer restarts, it times the command in flight
+    if (command_in_flight()) {
+        return leave(previous, ESP_LOADER_ERROR_FAIL);
+    }
+
+    esp_loader_error_t err = flash_deflate_prepare(size);
+    if (err == ESP_LOADER_SUCCESS) {
+        err = loader_flash_defl_data_submit(payload, size);
+    }
+
+    return leave(previous, err);
+}
+
+
+esp_loader_error_t esp_loader_async_read_register(esp_loader_t *loader, uint32_t address)
+{
+    esp_loader_t *previous = enter(loader);
+
+    if (command_in_flight()) {
+        return leave(previous, ESP_LOADER_ERROR_FAIL);
+    }
+
+    loader_port_start_timer(DEFAULT_TIMEOUT);
+
+    return leave(previous, loader_read_reg_submit(address));
+}
+
+
+esp_loader_async_state_t esp_loader_async_step(esp_loader_t *loader)
+{
+    esp_loader_t *previous = enter(loader);
+    esp_loader_async_state_t state = loader_engine_step();
+
+    s_bound_loader = previous;
+    return state;
+}
+
+
+esp_loader_async_state_t esp_loader_async_state(const esp_loader_t *loader)
+{
+    return loader->serial.state;
+}
+
+
+esp_loader_error_t esp_loader_async_result(esp_loader_t *loader, uint32_t *value)
+{
+    esp_loader_t *previous = enter(loader);
+
+    return leave(previous, loader_engine_result(value));
+}
@@ -31,6 +31,14 @@ extern "C" {
 #define MIN(a, b) ((a) < (b)) ? (a) : (b)
 #endif
 
+/**
+ * MD5 verification of written images. The Arduino build has no way to pass
+ * compile options to the library, so it is enabled unless set otherwise.
+ */
+#ifndef MD5_ENABLED
+#define MD5_ENABLED 1
+#endif
+
 /**
  * Macro which can be used to check the error code,
  * and return in case the code is not ESP_LOADER_SUCCESS.
@@ -86,6 +94,19 @@ typedef union {
     uint32_t val;
 } esp_loader_spi_config_t;
 
+/**
+ * @brief Flasher stub image, laid out the way esptool publishes it (stub_flasher_*.json)
+ */
+typedef struct {
+    uint32_t entry;         /*!< Address execution starts from. */
+    uint32_t text_start;    /*!< Load address of the text segment. */
+    const uint8_t *text;    /*!< Text segment. */
+    uint32_t text_size;     /*!< Size of the text segment in bytes. */
+    uint32_t data_start;    /*!< Load address of the data segment. */
+    const uint8_t *data;    /*!< Data segment, can be NULL if data_size is 0. */
+    uint32_t data_size;     /*!< Size of the data segment in bytes. */
+} esp_loader_stub_t;
+
 /**
  * @brief Connection arguments
  */
@@ -93,18 +114,84 @@ typedef struct {
     uint32_t sync_timeout;  /*!< Maximum time to wait for response from serial interface. */
     int32_t trials;         /*!< Number of trials to connect to target. If greater than 1,
                                100 millisecond delay is inserted after each try. */
+    bool load_stub;         /*!< Upload the stub registered for the detected chip into its RAM and
+                               use it for the rest of the session. Stays with the ROM loader
+                               when no stub is registered for the chip. */
+    uint32_t baudrate;      /*!< Baud rate used while connecting. The stub has to be told
+                               the current rate when the rate is changed. */
 } esp_loader_connect_args_t;
 
+/**
+ * @brief Target properties read once by esp_loader_connect() and reused for the rest of the session
+ */
+typedef struct {
+    target_chip_t target;   /*!< Detected chip. */
+    uint32_t spi_config;    /*!< SPI pin configuration from efuse the flash was attached with, 0 for default pins. */
+    uint32_t flash_id;      /*!< JEDEC ID of the flash chip, 0 if detection failed. */
+    uint32_t flash_size;    /*!< Flash size in bytes, 0 if detection failed. */
+    uint8_t mac[6];         /*!< Factory MAC address. */
+} esp_loader_session_t;
+
+/**
+ * @brief Loader context. Holds the whole state of one target session.
+ */
+typedef struct esp_loader esp_loader_t;
+
+/**
+ * @brief State of the command in flight, see esp_loader_async_step()
+ */
+typedef enum {
+    ESP_LOADER_ASYNC_IDLE,              /*!< No command submitted */
+    ESP_LOADER_ASYNC_SEND,              /*!< Command encoded, waits to be written to the port */
+    ESP_LOADER_ASYNC_AWAIT_RESPONSE,    /*!< Command written, waits for the response */
+    ESP_LOADER_ASYNC_DONE,              /*!< Response received, command failed or timed out */
+} esp_loader_async_state_t;
+
 #define ESP_LOADER_CONNECT_DEFAULT() { \
   .sync_timeout = 100, \
   .trials = 10, \
+  .load_stub = false, \
+  .baudrate = 115200, \
 }
 
+/**
+  * @brief Creates loader context for one more target.
+  *
+  * @param port[in]  Port instance the context talks through, handed back to
+  *                  the port by loader_port_instance(). Can be NULL.
+  *
+  * @note  Tasks that never call esp_loader_bind() share a default context,
+  *        so single target applications do not need contexts at all.
+  *
+  * @return  New context, NULL when out of memory.
+  */
+esp_loader_t *esp_loader_create(void *port);
+
+/**
+  * @brief Frees context created by esp_loader_create().
+  *
+  * @param loader[in]  Context, must not be bound to any other task.
+  */
+void esp_loader_destroy(esp_loader_t *loader);
+
+/**
+  * @brief Binds context to the calling task. Every other esp_loader_* call made
+  *        by the task then works on this context, so each target can be served
+  *        by its own task at the same time.
+  *
+  * @param loader[in]  Context, NULL returns the task to the default context.
+  */
+void esp_loader_bind(esp_loader_t *loader);
+
 /**
   * @brief Connects to the target
   *
   * @param connect_args[in] Timing parameters to be used for connecting to target.
   *
+  * @note  With load_stub set, the stub replaces the ROM loader for the rest of the
+  *        session: flash is erased as it is written, 16KB blocks are accepted,
+  *        and ESP8266 gains baud rate changes, compressed writes and MD5 checks.
+  *
   * @return
   *     - ESP_LOADER_SUCCESS Success
   *     - ESP_LOADER_ERROR_TIMEOUT Timeout
@@ -112,6 +199,39 @@ typedef struct {
   */
 esp_loader_error_t esp_loader_connect(esp_loader_connect_args_t *connect_args);
 
+/**
+  * @brief Checks whether a target answers: drops any data received so far,
+  *        resets the target into the ROM loader and sends a single sync
+  *        command. Much cheaper than esp_loader_connect(),
+  *        meant to be polled while waiting for a target to be attached.
+  *
+  * @param timeout_ms[in] Time to wait for the sync response.
+  *
+  * @note  The target is left in the ROM loader; connect before using it.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Target answered
+  *     - ESP_LOADER_ERROR_TIMEOUT No target
+  */
+esp_loader_error_t esp_loader_probe(uint32_t timeout_ms);
+
+/**
+  * @brief Registers flasher stub to be loaded by esp_loader_connect() for given chip.
+  *
+  * @param target[in]   Chip the stub is built for.
+  * @param stub[in]     Stub image, NULL to unregister. It is not copied, so it has
+  *                     to stay valid as long as the loader can connect to the chip.
+  */
+void esp_loader_register_stub(target_chip_t target, const esp_loader_stub_t *stub);
+
+/**
+  * @brief   Returns true if the session talks to the flasher stub rather than the ROM loader.
+  *
+  * @warning This function can only be called after connection with target
+  *          has been successfully established by calling esp_loader_connect().
+  */
+bool esp_loader_is_stub_running(void);
+
 /**
   * @brief   Returns attached target chip.
   *
@@ -122,6 +242,26 @@ esp_loader_error_t esp_loader_connect(esp_loader_connect_args_t *connect_args);
   */
 target_chip_t esp_loader_get_target(void);
 
+/**
+  * @brief   Returns target properties cached by esp_loader_connect().
+  *
+  * @warning This function can only be called after connection with target
+  *          has been successfully established by calling esp_loader_connect().
+  */
+const esp_loader_session_t *esp_loader_get_session(void);
+
+/**
+  * @brief   Returns number of command round trips (command sent, response awaited)
+  *          since last call of esp_loader_reset_round_trips(). Used to profile
+  *          how much each phase of a job talks to the target.
+  */
+uint32_t esp_loader_get_round_trips(void);
+
+/**
+  * @brief   Resets the round trip counter.
+  */
+void esp_loader_reset_round_trips(void);
+
 /**
   * @brief Initiates flash operation
   *
@@ -131,6 +271,7 @@ target_chip_t esp_loader_get_target(void);
   *
   * @note  image_size is size of the whole image, whereas, block_size is chunk of data sent
   *        to the target, each time esp_loader_flash_write function is called.
+  *        ROM loaders take blocks of up to 4KB, the stub up to 16KB.
   *
   * @return
   *     - ESP_LOADER_SUCCESS Success
@@ -139,6 +280,24 @@ target_chip_t esp_loader_get_target(void);
   */
 esp_loader_error_t esp_loader_flash_start(uint32_t offset, uint32_t image_size, uint32_t block_size);
 
+/**
+  * @brief Erases a region of target's flash without writing to it, e.g. to clear
+  *        the all-0xFF gaps of an image instead of transmitting them.
+  *
+  * @param offset[in]   Start address, must be 4KB sector aligned.
+  * @param size[in]     Size of the region, rounded up to whole sectors.
+  *
+  * @note  The stub uses its ERASE_REGION command, the ROM loader erases
+  *        the region on a FLASH_BEGIN no data is sent for.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_IMAGE_SIZE Region reaches past the end of flash
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
+  */
+esp_loader_error_t esp_loader_flash_erase_region(uint32_t offset, uint32_t size);
+
 /**
   * @brief Writes supplied data to target's flash memory.
   *
@@ -169,6 +328,80 @@ esp_loader_error_t esp_loader_flash_write(void *payload, uint32_t size);
   */
 esp_loader_error_t esp_loader_flash_finish(bool reboot);
 
+/**
+  * @brief Initiates compressed flash operation
+  *
+  * @param offset[in]           Address from which flash operation will be performed.
+  * @param image_size[in]       Size of the whole uncompressed binary to be written into flash.
+  * @param compressed_size[in]  Size of the zlib stream. When the image is compressed on the fly,
+  *                             an upper bound of the final size can be passed instead, as the
+  *                             target stops inflating at the end of the zlib stream.
+  * @param block_size[in]       Size of buffer used in subsequent calls to esp_loader_flash_deflate_write.
+  *
+  * @note  Progress and verification are based on the uncompressed image. As the loader
+  *        never sees the uncompressed data, esp_loader_flash_verify() can not be used
+  *        after a compressed write; use esp_loader_flash_verify_known_md5() instead.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
+  *     - ESP_LOADER_ERROR_UNSUPPORTED_FUNC Unsupported on the target
+  */
+esp_loader_error_t esp_loader_flash_deflate_start(uint32_t offset, uint32_t image_size,
+                                                  uint32_t compressed_size, uint32_t block_size);
+
+/**
+  * @brief Writes supplied block of the zlib stream to the target, which inflates it into flash.
+  *
+  * @param payload[in]      Compressed data.
+  * @param size[in]         Size of payload in bytes.
+  *
+  * @note  size must not be greater that block_size supplied to previously called
+  *        esp_loader_flash_deflate_start function. Unlike esp_loader_flash_write,
+  *        short blocks are not padded, so only the last block of the stream may be short.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_PARAM Block is larger than block_size
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
+  */
+esp_loader_error_t esp_loader_flash_deflate_write(const void *payload, uint32_t size);
+
+/**
+  * @brief Ends compressed flash operation.
+  *
+  * @param reboot[in]       reboot the target if true.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
+  */
+esp_loader_error_t esp_loader_flash_deflate_finish(bool reboot);
+
+/**
+  * @brief Reads a region of target's flash. Reading a large region in several calls
+  *        lets the caller store each chunk before the next one is requested.
+  *
+  * @param buffer[out]  Buffer for the read data, at least length bytes.
+  * @param address[in]  Flash address to read from.
+  * @param length[in]   Number of bytes to read.
+  *
+  * @note  With the stub, data is streamed in packets with windowed acknowledgements
+  *        and checked against the stub's MD5 when MD5_ENABLED is set. The ROM loader
+  *        has no read command, there the SPI peripheral is driven through register
+  *        access 64 bytes at a time, which is much slower.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_MD5 Data does not match the stub's MD5
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
+  */
+esp_loader_error_t esp_loader_flash_read(uint8_t *buffer, uint32_t address, uint32_t length);
+
 /**
   * @brief Writes register.
   *
@@ -207,10 +440,31 @@ esp_loader_error_t esp_loader_read_register(uint32_t address, uint32_t *reg_valu
   *     - ESP_LOADER_SUCCESS Success
   *     - ESP_LOADER_ERROR_TIMEOUT Timeout
   *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
-  *     - ESP_LOADER_ERROR_UNSUPPORTED_FUNC Unsupported on the target
+  *     - ESP_LOADER_ERROR_UNSUPPORTED_FUNC Unsupported on the target (ESP8266 ROM loader)
   */
 esp_loader_error_t esp_loader_change_baudrate(uint32_t baudrate);
 
+/**
+  * @brief Finds the highest working baud rate from a ladder of candidates.
+  *        Each rate is set on both sides and confirmed by reading a ROM register
+  *        a few times. On any error both sides go back to the connect baud rate,
+  *        if the link is lost the target is reconnected (stub reloaded) and the
+  *        next lower rate is tried.
+  *
+  * @param rates[in]      Candidate rates, highest first.
+  * @param count[in]      Number of candidates.
+  * @param selected[out]  Rate the session ends up at, the connect rate if none worked.
+  *
+  * @note  Host baud rate is adjusted through loader_port_change_baudrate(),
+  *        so unlike esp_loader_change_baudrate() nothing is left to the caller.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success, also when no candidate rate worked
+  *     - ESP_LOADER_ERROR_TIMEOUT Connection lost and reconnect failed
+  *     - ESP_LOADER_ERROR_UNSUPPORTED_FUNC Unsupported on the target (ESP8266 ROM loader)
+  */
+esp_loader_error_t esp_loader_negotiate_baudrate(const uint32_t *rates, uint32_t count, uint32_t *selected);
+
 /**
   * @brief Verify target's flash integrity by checking MD5.
   *        MD5 checksum is computed from data pushed to target's memory by calling
@@ -229,12 +483,120 @@ esp_loader_error_t esp_loader_change_baudrate(uint32_t baudrate);
   */
 #if MD5_ENABLED
 esp_loader_error_t esp_loader_flash_verify(void);
+
+/**
+  * @brief Verify target's flash region against MD5 checksum computed by the caller.
+  *        Used after compressed writes, where only the caller sees the uncompressed data.
+  *
+  * @param address[in]      Start address of the region.
+  * @param size[in]         Size of the region in bytes.
+  * @param expected_md5[in] Raw (16 byte) MD5 digest the region is expected to have.
+  *
+  * @note  This function is only available if MD5_ENABLED is set.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_INVALID_MD5 MD5 does not match
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
+  *     - ESP_LOADER_ERROR_UNSUPPORTED_FUNC Unsupported on the target
+  */
+esp_loader_error_t esp_loader_flash_verify_known_md5(uint32_t address, uint32_t size,
+                                                     const uint8_t expected_md5[16]);
+
+/**
+  * @brief Reads MD5 of target's flash region, e.g. to find regions that need rewriting.
+  *
+  * @param address[in]  Start address of the region.
+  * @param size[in]     Size of the region in bytes.
+  * @param md5[out]     Raw (16 byte) MD5 digest of the region.
+  *
+  * @note  This function is only available if MD5_ENABLED is set.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
+  *     - ESP_LOADER_ERROR_UNSUPPORTED_FUNC Unsupported on the target
+  */
+esp_loader_error_t esp_loader_flash_read_md5(uint32_t address, uint32_t size, uint8_t md5[16]);
 #endif
 /**
   * @brief Toggles reset pin.
   */
 void esp_loader_reset_target(void);
 
+/**
+  * Non-blocking commands. The blocking functions above run on the same engine:
+  * they submit a command, write it and feed the response in from the port
+  * until it is done. Here the caller does the driving with
+  * esp_loader_async_step(), which never waits on the port, so one task can
+  * serve many contexts at a time. A command goes through SEND,
+  * AWAIT_RESPONSE and DONE; only one command per context can be in flight.
+  */
+
+/**
+  * @brief Submits FLASH_DATA (or the stub's equivalent) for the next block,
+  *        the non-blocking variant of esp_loader_flash_write().
+  *
+  * @param loader[in]   Context in flash mode, see esp_loader_flash_start().
+  * @param payload[in]  Block, padded in place like with esp_loader_flash_write().
+  *                     It is copied when submitted, so it can be reused right away.
+  * @param size[in]     Size of the block.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Command submitted
+  *     - ESP_LOADER_ERROR_FAIL Another command is in flight
+  *     - ESP_LOADER_ERROR_INVALID_PARAM Block does not fit a frame
+  */
+esp_loader_error_t esp_loader_async_flash_write(esp_loader_t *loader, void *payload, uint32_t size);
+
+/**
+  * @brief Submits the next block of compressed data, the non-blocking variant
+  *        of esp_loader_flash_deflate_write().
+  *
+  * @return  Same as esp_loader_async_flash_write().
+  */
+esp_loader_error_t esp_loader_async_flash_deflate_write(esp_loader_t *loader, const void *payload, uint32_t size);
+
+/**
+  * @brief Submits READ_REG, the value is returned by esp_loader_async_result().
+  *
+  * @return  Same as esp_loader_async_flash_write().
+  */
+esp_loader_error_t esp_loader_async_read_register(esp_loader_t *loader, uint32_t address);
+
+/**
+  * @brief Advances the command without waiting: hands the context's port as
+  *        much of the frame as it takes, decodes what the port received so
+  *        far, and ends the command with ESP_LOADER_ERROR_TIMEOUT once the
+  *        port timer of the context expires. To be called until the command
+  *        is DONE.
+  *
+  * @return  State after the step.
+  */
+esp_loader_async_state_t esp_loader_async_step(esp_loader_t *loader);
+
+/**
+  * @brief Returns state of the command in flight. Only reads the context,
+  *        so it can be polled from any task.
+  */
+esp_loader_async_state_t esp_loader_async_state(const esp_loader_t *loader);
+
+/**
+  * @brief Collects the result of a command in DONE state, the context is
+  *        then ready for the next one.
+  *
+  * @param value[out]  Value field of the response (register value for READ_REG). Can be NULL.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Target reported an error
+  *     - ESP_LOADER_ERROR_FAIL No command is done yet
+  */
+esp_loader_error_t esp_loader_async_result(esp_loader_t *loader, uint32_t *value);
+
 
 
 #ifdef __cplusplus
@@ -17,17 +17,16 @@
 #include <stddef.h>
 
 typedef esp_loader_error_t (*read_spi_config_t)(uint32_t efuse_base, uint32_t *spi_config);
+typedef esp_loader_error_t (*read_mac_t)(uint32_t efuse_base, uint8_t mac[6]);
 
 typedef struct {
     target_registers_t regs;
     uint32_t efuse_base;
     uint32_t chip_magic_value;
     read_spi_config_t read_spi_config;
+    read_mac_t read_mac;
 } esp_target_t;
 
-// This ROM address has a different value on each chip model
-#define CHIP_DETECT_MAGIC_REG_ADDR 0x40001000
-
 #define ESP8266_SPI_REG_BASE 0x60000200
 #define ESP32S2_SPI_REG_BASE 0x3f402000
 #define ESP32C3_SPI_REG_BASE 0x60002000
@@ -36,6 +35,9 @@ typedef struct {
 
 static esp_loader_error_t spi_config_esp32(uint32_t efuse_base, uint32_t *spi_config);
 static esp_loader_error_t spi_config_esp32xx(uint32_t efuse_base, uint32_t *spi_config);
+static esp_loader_error_t mac_esp8266(uint32_t efuse_base, uint8_t mac[6]);
+static esp_loader_error_t mac_esp32(uint32_t efuse_base, uint8_t mac[6]);
+static esp_loader_error_t mac_esp32xx(uint32_t efuse_base, uint8_t mac[6]);
 
 static const esp_target_t esp_target[ESP_MAX_CHIP] = {
 
@@ -53,6 +55,7 @@ static const esp_target_t esp_target[ESP_MAX_CHIP] = {
         .efuse_base = 0,            // Not used
         .chip_magic_value  = 0xfff0c101,
         .read_spi_config = NULL,    // Not used
+        .read_mac = mac_esp8266,
     },
 
     // ESP32
@@ -69,6 +72,7 @@ static const esp_target_t esp_target[ESP_MAX_CHIP] = {
         .efuse_base = 0x3ff5A000,
         .chip_magic_value  = 0x00f01d83,
         .read_spi_config = spi_config_esp32,
+        .read_mac = mac_esp32,
     },
 
     // ESP32S2
@@ -85,6 +89,7 @@ static const esp_target_t esp_target[ESP_MAX_CHIP] = {
         .efuse_base = 0x3f41A000,
         .chip_magic_value  = 0x000007c6,
         .read_spi_config = spi_config_esp32xx,
+        .read_mac = mac_esp32xx,
     },
 
     // ESP32C3
@@ -101,6 +106,7 @@ static const esp_target_t esp_target[ESP_MAX_CHIP] = {
         .efuse_base = 0x60008800,
         .chip_magic_value = 0x6921506f,
         .read_spi_config = spi_config_esp32xx,
+        .read_mac = mac_esp32xx,
     },
 
     // ESP32S3
@@ -117,9 +123,13 @@ static const esp_target_t esp_target[ESP_MAX_CHIP] = {
         .efuse_base = 0x60007000,
         .chip_magic_value = 0x00000009,
         .read_spi_config = spi_config_esp32xx, // !
+        .read_mac = mac_esp32xx,
     },
 };
 
+// Flasher stubs are not part of the library, the application registers them
+static const esp_loader_stub_t *s_stubs[ESP_MAX_CHIP];
+
 const target_registers_t *get_esp_target_data(target_chip_t chip)
 {
     return (target_registers_t *)&esp_target[chip];
@@ -147,6 +157,24 @@ esp_loader_error_t loader_read_spi_config(target_chip_t target_chip, uint32_t *s
     return target->read_spi_config(target->efuse_base, spi_config);
 }
 
+esp_loader_error_t loader_read_mac(target_chip_t target_chip, uint8_t mac[6])
+{
+    const esp_target_t *target = &esp_target[target_chip];
+    return target->read_mac(target->efuse_base, mac);
+}
+
+const esp_loader_stub_t *loader_get_stub(target_chip_t target_chip)
+{
+    return (target_chip < ESP_MAX_CHIP) ? s_stubs[target_chip] : NULL;
+}
+
+void loader_set_stub(target_chip_t target_chip, const esp_loader_stub_t *stub)
+{
+    if (target_chip < ESP_MAX_CHIP) {
+        s_stubs[target_chip] = stub;
+    }
+}
+
 static inline uint32_t efuse_word_addr(uint32_t efuse_base, uint32_t n)
 {
     return efuse_base + (n * 4);
@@ -206,3 +234,63 @@ static esp_loader_error_t spi_config_esp32xx(uint32_t efuse_base, uint32_t *spi_
     *spi_config = pins;
     return ESP_LOADER_SUCCESS;
 }
+
+
+// ESP8266 keeps only part of the MAC in efuse, the OUI is implied by a flag (as in esptool)
+static esp_loader_error_t mac_esp8266(uint32_t efuse_base, uint8_t mac[6])
+{
+    uint32_t mac0, mac1, mac3;
+    RETURN_ON_ERROR( esp_loader_read_register(0x3ff00050, &mac0) );
+    RETURN_ON_ERROR( esp_loader_read_register(0x3ff00054, &mac1) );
+    RETURN_ON_ERROR( esp_loader_read_register(0x3ff0005c, &mac3) );
+
+    if (mac3 != 0) {
+        mac[0] = (mac3 >> 16) & 0xff;
+        mac[1] = (mac3 >> 8) & 0xff;
+        mac[2] = mac3 & 0xff;
+    } else if (((mac1 >> 16) & 0xff) == 0) {
+        mac[0] = 0x18;
+        mac[1] = 0xfe;
+        mac[2] = 0x34;
+    } else if (((mac1 >> 16) & 0xff) == 1) {
+        mac[0] = 0xac;
+        mac[1] = 0xd0;
+        mac[2] = 0x74;
+    } else {
+        return ESP_LOADER_ERROR_INVALID_RESPONSE;
+    }
+
+    mac[3] = (mac1 >> 8) & 0xff;
+    mac[4] = mac1 & 0xff;
+    mac[5] = (mac0 >> 24) & 0xff;
+
+    return ESP_LOADER_SUCCESS;
+}
+
+// Low four bytes of the MAC in the first word, high two bytes in the second
+static esp_loader_error_t mac_from_efuse(uint32_t mac_addr, uint8_t mac[6])
+{
+    uint32_t mac0, mac1;
+    RETURN_ON_ERROR( esp_loader_read_register(mac_addr, &mac0) );
+    RETURN_ON_ERROR( esp_loader_read_register(mac_addr + 4, &mac1) );
+
+    mac[0] = (mac1 >> 8) & 0xff;
+    mac[1] = mac1 & 0xff;
+    mac[2] = (mac0 >> 24) & 0xff;
+    mac[3] = (mac0 >> 16) & 0xff;
+    mac[4] = (mac0 >> 8) & 0xff;
+    mac[5] = mac0 & 0xff;
+
+    return ESP_LOADER_SUCCESS;
+}
+
+static esp_loader_error_t mac_esp32(uint32_t efuse_base, uint8_t mac[6])
+{
+    return mac_from_efuse(efuse_word_addr(efuse_base, 1), mac);
+}
+
+// Applies for esp32s2, esp32c3 and esp32s3
+static esp_loader_error_t mac_esp32xx(uint32_t efuse_base, uint8_t mac[6])
+{
+    return mac_from_efuse(efuse_base + 0x44, mac);
+}
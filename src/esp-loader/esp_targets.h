@@ -18,6 +18,9 @@
 #include <stdint.h>
 #include "esp_loader.h"
 
+// This ROM address has a different value on each chip model
+#define CHIP_DETECT_MAGIC_REG_ADDR 0x40001000
+
 typedef struct {
     uint32_t cmd;
     uint32_t usr;
@@ -30,3 +33,6 @@ typedef struct {
 
 esp_loader_error_t loader_detect_chip(target_chip_t *target, const target_registers_t **regs);
 esp_loader_error_t loader_read_spi_config(target_chip_t target_chip, uint32_t *spi_config);
+esp_loader_error_t loader_read_mac(target_chip_t target_chip, uint8_t mac[6]);
+const esp_loader_stub_t *loader_get_stub(target_chip_t target_chip);
+void loader_set_stub(target_chip_t target_chip, const esp_loader_stub_t *stub);
@@ -21,19 +21,12 @@
 
 #define CMD_SIZE(cmd) ( sizeof(cmd) - sizeof(command_common_t) )
 
-static uint32_t s_sequence_number = 0;
-
 static const uint8_t DELIMITER = 0xC0;
 static const uint8_t C0_REPLACEMENT[2] = {0xDB, 0xDC};
 static const uint8_t DB_REPLACEMENT[2] = {0xDB, 0xDD};
 
-static esp_loader_error_t check_response(command_t cmd, uint32_t *reg_value, void* resp, uint32_t resp_size);
-
+static void log_loader_internal_error(error_code_t error);
 
-static inline esp_loader_error_t serial_read(uint8_t *buff, size_t size)
-{
-    return loader_port_serial_read(buff, size, loader_port_remaining_time());
-}
 
 static inline esp_loader_error_t serial_write(const uint8_t *buff, size_t size)
 {
@@ -51,141 +44,495 @@ static uint8_t compute_checksum(const uint8_t *data, uint32_t size)
     return checksum;
 }
 
-static esp_loader_error_t SLIP_receive_data(uint8_t *buff, uint32_t size)
+static esp_loader_error_t SLIP_fill(serial_comm_t *comm)
+{
+    uint16_t received = 0;
+
+    RETURN_ON_ERROR( loader_port_serial_read_some(comm->rx_buffer, RX_BUFFER_SIZE, &received,
+                                                  loader_port_remaining_time()) );
+
+    comm->rx_head = 0;
+    comm->rx_tail = received;
+
+    return (received > 0) ? ESP_LOADER_SUCCESS : ESP_LOADER_ERROR_TIMEOUT;
+}
+
+
+// Takes whatever the port received already, without waiting
+static esp_loader_error_t SLIP_poll(serial_comm_t *comm)
 {
-    uint8_t ch;
+    uint16_t received = 0;
+    esp_loader_error_t err = loader_port_serial_read_some(comm->rx_buffer, RX_BUFFER_SIZE, &received, 0);
 
-    for (uint32_t i = 0; i < size; i++) {
-        RETURN_ON_ERROR( serial_read(&ch, 1) );
+    comm->rx_head = 0;
+    comm->rx_tail = received;
 
-        if (ch == 0xDB) {
-            RETURN_ON_ERROR( serial_read(&ch, 1) );
+    return (err == ESP_LOADER_ERROR_TIMEOUT) ? ESP_LOADER_SUCCESS : err;
+}
+
+
+typedef enum {
+    SLIP_PARTIAL,   // All bytes consumed, frame not complete yet
+    SLIP_COMPLETE,  // Non-empty frame ended, comm->decoded holds its full length
+    SLIP_INVALID    // Bad escape sequence
+} slip_status_t;
+
+
+static inline void SLIP_reset(serial_comm_t *comm)
+{
+    comm->in_frame = false;
+    comm->escaped = false;
+    comm->decoded = 0;
+}
+
+
+// Decodes received bytes into buff until a non-empty frame ends. Decoder state
+// is kept in comm, so a frame can be fed in any number of pieces. Bytes past
+// size are dropped. Empty frames and bytes outside a frame are skipped, the
+// bootloader sends two dummy (0xC0) bytes after response when baud rate is changed.
+static slip_status_t SLIP_decode(serial_comm_t *comm, const uint8_t *data, uint32_t length,
+                                 uint32_t *consumed, uint8_t *buff, uint32_t size)
+{
+    bool in_frame = comm->in_frame;
+    bool escaped = comm->escaped;
+    uint32_t decoded = comm->decoded;
+    slip_status_t status = SLIP_PARTIAL;
+    uint32_t i = 0;
+
+    while (i < length) {
+        uint8_t ch = data[i++];
+
+        if (ch == DELIMITER) {
+            if (in_frame && decoded > 0) {
+                in_frame = false;
+                status = SLIP_COMPLETE;
+                break;
+            }
+            in_frame = true;
+            escaped = false;
+            continue;
+        }
+
+        if (!in_frame) {
+            continue;
+        }
+
+        if (escaped) {
+            escaped = false;
             if (ch == 0xDC) {
-                buff[i] = 0xC0;
+                ch = 0xC0;
             } else if (ch == 0xDD) {
-                buff[i] = 0xDB;
+                ch = 0xDB;
             } else {
-                return ESP_LOADER_ERROR_INVALID_RESPONSE;
+                status = SLIP_INVALID;
+                break;
             }
-        } else {
-            buff[i] = ch;
+        } else if (ch == 0xDB) {
+            escaped = true;
+            continue;
+        }
+
+        if (decoded < size) {
+            buff[decoded] = ch;
         }
+        decoded++;
     }
 
-    return ESP_LOADER_SUCCESS;
+    comm->in_frame = in_frame;
+    comm->escaped = escaped;
+    comm->decoded = decoded;
+    *consumed = i;
+    return status;
+}
+
+
+// Blocks until next non-empty frame is decoded straight into buff.
+// length is set to the full decoded length of the frame.
+static esp_loader_error_t SLIP_receive_frame(uint8_t *buff, uint32_t size, uint32_t *length)
+{
+    serial_comm_t *comm = loader_serial_comm();
+
+    SLIP_reset(comm);
+
+    while (true) {
+        if (comm->rx_head == comm->rx_tail) {
+            RETURN_ON_ERROR( SLIP_fill(comm) );
+        }
+
+        uint32_t consumed;
+        slip_status_t status = SLIP_decode(comm, &comm->rx_buffer[comm->rx_head],
+                                           comm->rx_tail - comm->rx_head, &consumed, buff, size);
+        comm->rx_head += consumed;
+
+        if (status == SLIP_INVALID) {
+            return ESP_LOADER_ERROR_INVALID_RESPONSE;
+        } else if (status == SLIP_COMPLETE) {
+            *length = comm->decoded;
+            return ESP_LOADER_SUCCESS;
+        }
+    }
 }
 
 
+// Receives next frame that fills whole buff, shorter frames are ignored.
 static esp_loader_error_t SLIP_receive_packet(uint8_t *buff, uint32_t size)
 {
-    uint8_t ch;
+    uint32_t length;
 
-    // Wait for delimiter
     do {
-        RETURN_ON_ERROR( serial_read(&ch, 1) );
-    } while (ch != DELIMITER);
+        RETURN_ON_ERROR( SLIP_receive_frame(buff, size, &length) );
+    } while (length < size);
 
-    // Workaround: bootloader sends two dummy(0xC0) bytes after response when baud rate is changed.
-    do {
-        RETURN_ON_ERROR( serial_read(&ch, 1) );
-    } while (ch == DELIMITER);
+    return ESP_LOADER_SUCCESS;
+}
 
-    buff[0] = ch;
 
-    RETURN_ON_ERROR( SLIP_receive_data(&buff[1], size - 1) );
+static inline uint8_t *SLIP_escape_byte(uint8_t *out, uint8_t byte)
+{
+    if (byte == 0xC0) {
+        memcpy(out, C0_REPLACEMENT, 2);
+        return out + 2;
+    } else if (byte == 0xDB) {
+        memcpy(out, DB_REPLACEMENT, 2);
+        return out + 2;
+    }
+
+    *out = byte;
+    return out + 1;
+}
 
-    // Wait for delimiter
-    do {
-        RETURN_ON_ERROR( serial_read(&ch, 1) );
-    } while (ch != DELIMITER);
 
+// True if any byte of the word is 0xC0 or 0xDB, using the
+// "word has a zero byte" trick on the word xor-ed with each of them
+static inline bool SLIP_word_needs_escape(uint32_t word)
+{
+    uint32_t c0 = word ^ 0xC0C0C0C0;
+    uint32_t db = word ^ 0xDBDBDBDB;
+
+    return (((c0 - 0x01010101) & ~c0) | ((db - 0x01010101) & ~db)) & 0x80808080;
+}
+
+
+// Escapes data into out, which must have room for 2 * size bytes.
+// Returns number of bytes written.
+static uint32_t SLIP_escape(uint8_t *out, const uint8_t *data, uint32_t size)
+{
+    uint8_t *start = out;
+    const uint8_t *end = data + size;
+
+    while (data < end && ((uintptr_t)data & 3)) {
+        out = SLIP_escape_byte(out, *data++);
+    }
+
+    // Firmware data rarely contains the special bytes, so whole words are copied.
+    // Aligned by now, so memcpy compiles to a single load.
+    for (; data + 4 <= end; data += 4) {
+        uint32_t word;
+        memcpy(&word, __builtin_assume_aligned(data, 4), 4);
+        if (SLIP_word_needs_escape(word)) {
+            out = SLIP_escape_byte(out, data[0]);
+            out = SLIP_escape_byte(out, data[1]);
+            out = SLIP_escape_byte(out, data[2]);
+            out = SLIP_escape_byte(out, data[3]);
+        } else {
+            memcpy(out, &word, 4);
+            out += 4;
+        }
+    }
+
+    while (data < end) {
+        out = SLIP_escape_byte(out, *data++);
+    }
+
+    return out - start;
+}
+
+
+static esp_loader_error_t SLIP_flush(serial_comm_t *comm)
+{
+    esp_loader_error_t err = ESP_LOADER_SUCCESS;
+
+    if (comm->wire_length > comm->wire_sent) {
+        err = serial_write(&comm->wire_buffer[comm->wire_sent], comm->wire_length - comm->wire_sent);
+    }
+
+    comm->wire_length = 0;
+    comm->wire_sent = 0;
+    return err;
+}
+
+
+// Hands the port as much of the wire buffer as it takes without waiting.
+// done is set once the whole frame is out.
+static esp_loader_error_t SLIP_flush_some(serial_comm_t *comm, bool *done)
+{
+    uint16_t written = 0;
+
+    *done = false;
+    if (comm->wire_sent < comm->wire_length) {
+        uint32_t pending = comm->wire_length - comm->wire_sent;
+        RETURN_ON_ERROR( loader_port_serial_write_some(&comm->wire_buffer[comm->wire_sent],
+                                                       MIN(pending, UINT16_MAX), &written) );
+        comm->wire_sent += written;
+    }
+
+    if (comm->wire_sent == comm->wire_length) {
+        comm->wire_length = 0;
+        comm->wire_sent = 0;
+        *done = true;
+    }
     return ESP_LOADER_SUCCESS;
 }
 
 
-static esp_loader_error_t SLIP_send(const uint8_t *data, uint32_t size)
+static esp_loader_error_t SLIP_encode(serial_comm_t *comm, const uint8_t *data, uint32_t size)
 {
-    uint32_t to_write = 0;  // Bytes ready to write as they are
-    uint32_t written = 0;   // Bytes already written
+    while (size > 0) {
+        // One byte stays reserved for the closing delimiter
+        uint32_t room = (WIRE_BUFFER_SIZE - 1 - comm->wire_length) / 2;
 
-    for (uint32_t i = 0; i < size; i++) {
-        if (data[i] != 0xC0 && data[i] != 0xDB) {
-            to_write++; // Queue this byte for writing
+        // Only payloads larger than MAX_PAYLOAD_SIZE take more than one write
+        if (room == 0) {
+            RETURN_ON_ERROR( SLIP_flush(comm) );
             continue;
         }
 
-        // We have a byte that needs encoding, write the queue first
-        if (to_write > 0) {
-            RETURN_ON_ERROR( serial_write(&data[written], to_write) );
+        uint32_t chunk = MIN(size, room);
+        comm->wire_length += SLIP_escape(&comm->wire_buffer[comm->wire_length], data, chunk);
+        data += chunk;
+        size -= chunk;
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+
+// Encodes whole frame (delimiters, command and its data) into the wire buffer
+// and hands it to the port with a single write.
+static esp_loader_error_t SLIP_send_frame(const void *cmd_data, uint32_t cmd_size,
+                                          const void *data, uint32_t data_size)
+{
+    serial_comm_t *comm = loader_serial_comm();
+
+    comm->wire_length = 0;
+    comm->wire_sent = 0;
+    comm->wire_buffer[comm->wire_length++] = DELIMITER;
+
+    RETURN_ON_ERROR( SLIP_encode(comm, (const uint8_t *)cmd_data, cmd_size) );
+    RETURN_ON_ERROR( SLIP_encode(comm, (const uint8_t *)data, data_size) );
+
+    comm->wire_buffer[comm->wire_length++] = DELIMITER;
+
+    return SLIP_flush(comm);
+}
+
+
+// --- Command engine ---
+// A command goes SEND -> AWAIT_RESPONSE -> DONE. Nothing here blocks:
+// loader_engine_step() hands the port as much of the frame as it takes and
+// decodes whatever was received so far, and the port timer decides when the
+// command timed out.
+
+static void engine_complete(serial_comm_t *comm, esp_loader_error_t result)
+{
+    comm->result = result;
+    comm->state = ESP_LOADER_ASYNC_DONE;
+}
+
+
+esp_loader_error_t loader_engine_submit(const void *cmd_data, uint32_t cmd_size,
+                                        const void *data, uint32_t data_size,
+                                        uint32_t response_size)
+{
+    serial_comm_t *comm = loader_serial_comm();
+
+    if (comm->state == ESP_LOADER_ASYNC_SEND || comm->state == ESP_LOADER_ASYNC_AWAIT_RESPONSE) {
+        return ESP_LOADER_ERROR_FAIL;
+    }
+    // Whole frame is encoded upfront, so the caller's buffers are free once submitted
+    if (2 + 2 * (cmd_size + data_size) > WIRE_BUFFER_SIZE || response_size > RESPONSE_BUFFER_SIZE) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    comm->wire_length = 0;
+    comm->wire_sent = 0;
+    comm->wire_buffer[comm->wire_length++] = DELIMITER;
+    RETURN_ON_ERROR( SLIP_encode(comm, (const uint8_t *)cmd_data, cmd_size) );
+    RETURN_ON_ERROR( SLIP_encode(comm, (const uint8_t *)data, data_size) );
+    comm->wire_buffer[comm->wire_length++] = DELIMITER;
+
+    comm->command = ((const command_common_t *)cmd_data)->command;
+    comm->response_size = response_size;
+    comm->reg_value = 0;
+    comm->state = ESP_LOADER_ASYNC_SEND;
+    comm->round_trips++;
+    SLIP_reset(comm);
+
+    return ESP_LOADER_SUCCESS;
+}
+
+
+esp_loader_async_state_t loader_engine_step(void)
+{
+    serial_comm_t *comm = loader_serial_comm();
+    esp_loader_error_t err = ESP_LOADER_SUCCESS;
+
+    if (comm->state == ESP_LOADER_ASYNC_SEND) {
+        bool sent;
+        err = SLIP_flush_some(comm, &sent);
+        if (err == ESP_LOADER_SUCCESS && sent) {
+            comm->state = ESP_LOADER_ASYNC_AWAIT_RESPONSE;
         }
+    }
 
-        // Write the encoded byte
-        if (data[i] == 0xC0) {
-            RETURN_ON_ERROR( serial_write(C0_REPLACEMENT, 2) );
-        } else {
-            RETURN_ON_ERROR( serial_write(DB_REPLACEMENT, 2) );
+    if (err == ESP_LOADER_SUCCESS && comm->state == ESP_LOADER_ASYNC_AWAIT_RESPONSE) {
+        if (comm->rx_head == comm->rx_tail) {
+            err = SLIP_poll(comm);
         }
+        comm->rx_head += loader_engine_feed(&comm->rx_buffer[comm->rx_head], comm->rx_tail - comm->rx_head);
+    }
 
-        // Update to start again after the encoded byte
-        written = i + 1;
-        to_write = 0;
+    if (err != ESP_LOADER_SUCCESS) {
+        engine_complete(comm, err);
+    } else if (comm->state != ESP_LOADER_ASYNC_DONE && loader_port_remaining_time() == 0) {
+        engine_complete(comm, ESP_LOADER_ERROR_TIMEOUT);
     }
 
-    // Write the rest of the bytes that didn't need encoding
-    if (to_write > 0) {
-        RETURN_ON_ERROR( serial_write(&data[written], to_write) );
+    return comm->state;
+}
+
+
+// Frames shorter than the expected response and responses to other commands are skipped
+static void engine_check_response(serial_comm_t *comm)
+{
+    common_response_t *response = (common_response_t *)comm->response;
+
+    if (comm->decoded < comm->response_size ||
+        response->direction != READ_DIRECTION || response->command != comm->command) {
+        SLIP_reset(comm);
+        return;
     }
 
-    return ESP_LOADER_SUCCESS;
+    response_status_t *status = (response_status_t *)(comm->response + comm->response_size - sizeof(response_status_t));
+
+    if (status->failed) {
+        log_loader_internal_error(status->error);
+        engine_complete(comm, ESP_LOADER_ERROR_INVALID_RESPONSE);
+        return;
+    }
+
+    comm->reg_value = response->value;
+    engine_complete(comm, ESP_LOADER_SUCCESS);
 }
 
 
-static esp_loader_error_t SLIP_send_delimiter(void)
+uint32_t loader_engine_feed(const uint8_t *data, uint32_t size)
 {
-    return serial_write(&DELIMITER, 1);
+    serial_comm_t *comm = loader_serial_comm();
+    uint32_t total = 0;
+
+    while (comm->state == ESP_LOADER_ASYNC_AWAIT_RESPONSE && total < size) {
+        uint32_t consumed;
+        slip_status_t status = SLIP_decode(comm, data + total, size - total, &consumed,
+                                           comm->response, comm->response_size);
+        total += consumed;
+
+        if (status == SLIP_INVALID) {
+            engine_complete(comm, ESP_LOADER_ERROR_INVALID_RESPONSE);
+        } else if (status == SLIP_COMPLETE) {
+            engine_check_response(comm);
+        }
+    }
+
+    return total;
 }
 
 
-static esp_loader_error_t send_cmd(const void *cmd_data, uint32_t size, uint32_t *reg_value)
+esp_loader_async_state_t loader_engine_state(void)
 {
-    response_t response;
-    command_t command = ((command_common_t *)cmd_data)->command;
+    return loader_serial_comm()->state;
+}
 
-    RETURN_ON_ERROR( SLIP_send_delimiter() );
-    RETURN_ON_ERROR( SLIP_send((const uint8_t *)cmd_data, size) );
-    RETURN_ON_ERROR( SLIP_send_delimiter() );
 
-    return check_response(command, reg_value, &response, sizeof(response));
+esp_loader_error_t loader_engine_result(uint32_t *reg_value)
+{
+    serial_comm_t *comm = loader_serial_comm();
+
+    if (comm->state != ESP_LOADER_ASYNC_DONE) {
+        return ESP_LOADER_ERROR_FAIL;
+    }
+
+    comm->state = ESP_LOADER_ASYNC_IDLE;
+    if (reg_value != NULL && comm->result == ESP_LOADER_SUCCESS) {
+        *reg_value = comm->reg_value;
+    }
+
+    return comm->result;
 }
 
 
-static esp_loader_error_t send_cmd_with_data(const void *cmd_data, size_t cmd_size,
-                                             const void *data, size_t data_size)
+// Blocking API: writes the frame and feeds the engine from the port until
+// the command is done. Port timeouts stand in for the timer check of
+// loader_engine_step().
+static esp_loader_error_t engine_wait(uint32_t *reg_value)
 {
-    response_t response;
-    command_t command = ((command_common_t *)cmd_data)->command;
+    serial_comm_t *comm = loader_serial_comm();
 
-    RETURN_ON_ERROR( SLIP_send_delimiter() );
-    RETURN_ON_ERROR( SLIP_send((const uint8_t *)cmd_data, cmd_size) );
-    RETURN_ON_ERROR( SLIP_send(data, data_size) );
-    RETURN_ON_ERROR( SLIP_send_delimiter() );
+    if (comm->state == ESP_LOADER_ASYNC_SEND) {
+        esp_loader_error_t err = SLIP_flush(comm);
+        if (err != ESP_LOADER_SUCCESS) {
+            engine_complete(comm, err);
+        } else {
+            comm->state = ESP_LOADER_ASYNC_AWAIT_RESPONSE;
+        }
+    }
 
-    return check_response(command, NULL, &response, sizeof(response));
+    while (comm->state == ESP_LOADER_ASYNC_AWAIT_RESPONSE) {
+        if (comm->rx_head == comm->rx_tail) {
+            esp_loader_error_t err = SLIP_fill(comm);
+            if (err != ESP_LOADER_SUCCESS) {
+                engine_complete(comm, err);
+                break;
+            }
+        }
+        comm->rx_head += loader_engine_feed(&comm->rx_buffer[comm->rx_head], comm->rx_tail - comm->rx_head);
+    }
+
+    return loader_engine_result(reg_value);
 }
 
 
-static esp_loader_error_t send_cmd_md5(const void *cmd_data, size_t cmd_size, uint8_t md5_out[MD5_SIZE])
+static esp_loader_error_t send_cmd(const void *cmd_data, uint32_t size, uint32_t *reg_value)
 {
-    rom_md5_response_t response;
-    command_t command = ((command_common_t *)cmd_data)->command;
+    RETURN_ON_ERROR( loader_engine_submit(cmd_data, size, NULL, 0, sizeof(response_t)) );
+
+    return engine_wait(reg_value);
+}
+
 
-    RETURN_ON_ERROR( SLIP_send_delimiter() );
-    RETURN_ON_ERROR( SLIP_send((const uint8_t *)cmd_data, cmd_size) );
-    RETURN_ON_ERROR( SLIP_send_delimiter() );
+static uint8_t hex_to_nibble(uint8_t ch)
+{
+    return (ch <= '9') ? ch - '0' : (ch | 0x20) - 'a' + 10;
+}
 
-    RETURN_ON_ERROR( check_response(command, NULL, &response, sizeof(response)) );
 
-    memcpy(md5_out, response.md5, MD5_SIZE);
+static esp_loader_error_t send_cmd_md5(const void *cmd_data, size_t cmd_size, uint8_t md5_out[16])
+{
+    serial_comm_t *comm = loader_serial_comm();
+
+    // Stub sends raw digest, ROM sends it hex encoded
+    if (comm->stub_running) {
+        RETURN_ON_ERROR( loader_engine_submit(cmd_data, cmd_size, NULL, 0, sizeof(stub_md5_response_t)) );
+        RETURN_ON_ERROR( engine_wait(NULL) );
+        memcpy(md5_out, ((stub_md5_response_t *)comm->response)->md5, 16);
+    } else {
+        RETURN_ON_ERROR( loader_engine_submit(cmd_data, cmd_size, NULL, 0, sizeof(rom_md5_response_t)) );
+        RETURN_ON_ERROR( engine_wait(NULL) );
+        const uint8_t *hex = ((rom_md5_response_t *)comm->response)->md5;
+        for (int i = 0; i < 16; i++) {
+            md5_out[i] = (hex_to_nibble(hex[2 * i]) << 4) | hex_to_nibble(hex[2 * i + 1]);
+        }
+    }
 
     return ESP_LOADER_SUCCESS;
 }
@@ -210,52 +557,32 @@ static void log_loader_internal_error(error_code_t error)
 }
 
 
-static esp_loader_error_t check_response(command_t cmd, uint32_t *reg_value, void* resp, uint32_t resp_size)
+static inline uint32_t encryption_field_size(command_t command, target_chip_t target)
 {
-    esp_loader_error_t err;
-    common_response_t *response = (common_response_t *)resp;
-
-    do {
-        err = SLIP_receive_packet(resp, resp_size);
-        if (err != ESP_LOADER_SUCCESS) {
-            return err;
-        }
-    } while ((response->direction != READ_DIRECTION) || (response->command != cmd));
-
-    response_status_t *status = (response_status_t *)((uint8_t *)resp + resp_size - sizeof(response_status_t));
-
-    if (status->failed) {
-        log_loader_internal_error(status->error);
-        return ESP_LOADER_ERROR_INVALID_RESPONSE;
-    }
-
-    if (reg_value != NULL) {
-        *reg_value = response->value;
+    // Neither MEM_BEGIN nor the stub take the encryption field
+    if (command == MEM_BEGIN || loader_serial_comm()->stub_running) {
+        return sizeof(uint32_t);
     }
 
-    return ESP_LOADER_SUCCESS;
-}
-
-static inline uint32_t encryption_field_size(target_chip_t target)
-{
     return (target == ESP32S2_CHIP || 
             target == ESP32C3_CHIP || 
             target == ESP32S3_CHIP) ? 0 : sizeof(uint32_t);
 }
 
 
-esp_loader_error_t loader_flash_begin_cmd(uint32_t offset,
-                                          uint32_t erase_size,
-                                          uint32_t block_size,
-                                          uint32_t blocks_to_write,
-                                          target_chip_t target)
+static esp_loader_error_t begin_command(command_t command,
+                                        uint32_t offset,
+                                        uint32_t erase_size,
+                                        uint32_t block_size,
+                                        uint32_t blocks_to_write,
+                                        target_chip_t target)
 {
-    uint32_t encryption_size = encryption_field_size(target);
+    uint32_t encryption_size = encryption_field_size(command, target);
 
     begin_command_t begin_cmd = {
         .common = {
             .direction = WRITE_DIRECTION,
-            .command = FLASH_BEGIN,
+            .command = command,
             .size = CMD_SIZE(begin_cmd) - encryption_size,
             .checksum = 0
         },
@@ -266,35 +593,46 @@ esp_loader_error_t loader_flash_begin_cmd(uint32_t offset,
         .encrypted = 0
     };
 
-    s_sequence_number = 0;
+    loader_serial_comm()->sequence_number = 0;
 
     return send_cmd(&begin_cmd, sizeof(begin_cmd) - encryption_size, NULL);
 }
 
 
-esp_loader_error_t loader_flash_data_cmd(const uint8_t *data, uint32_t size)
+static esp_loader_error_t submit_data_command(command_t command, const uint8_t *data, uint32_t size)
 {
     data_command_t data_cmd = {
         .common = {
             .direction = WRITE_DIRECTION,
-            .command = FLASH_DATA,
+            .command = command,
             .size = CMD_SIZE(data_cmd) + size,
             .checksum = compute_checksum(data, size)
         },
         .data_size = size,
-        .sequence_number = s_sequence_number++,
+        .sequence_number = loader_serial_comm()->sequence_number,
     };
 
-    return send_cmd_with_data(&data_cmd, sizeof(data_cmd), data, size);
+    RETURN_ON_ERROR( loader_engine_submit(&data_cmd, sizeof(data_cmd), data, size, sizeof(response_t)) );
+    loader_serial_comm()->sequence_number++;
+
+    return ESP_LOADER_SUCCESS;
 }
 
 
-esp_loader_error_t loader_flash_end_cmd(bool stay_in_loader)
+static esp_loader_error_t data_command(command_t command, const uint8_t *data, uint32_t size)
+{
+    RETURN_ON_ERROR( submit_data_command(command, data, size) );
+
+    return engine_wait(NULL);
+}
+
+
+static esp_loader_error_t end_command(command_t command, bool stay_in_loader)
 {
     flash_end_command_t end_cmd = {
         .common = {
             .direction = WRITE_DIRECTION,
-            .command = FLASH_END,
+            .command = command,
             .size = CMD_SIZE(end_cmd),
             .checksum = 0
         },
@@ -305,6 +643,145 @@ esp_loader_error_t loader_flash_end_cmd(bool stay_in_loader)
 }
 
 
+esp_loader_error_t loader_flash_begin_cmd(uint32_t offset,
+                                          uint32_t erase_size,
+                                          uint32_t block_size,
+                                          uint32_t blocks_to_write,
+                                          target_chip_t target)
+{
+    return begin_command(FLASH_BEGIN, offset, erase_size, block_size, blocks_to_write, target);
+}
+
+
+esp_loader_error_t loader_flash_data_cmd(const uint8_t *data, uint32_t size)
+{
+    return data_command(FLASH_DATA, data, size);
+}
+
+
+esp_loader_error_t loader_flash_data_submit(const uint8_t *data, uint32_t size)
+{
+    return submit_data_command(FLASH_DATA, data, size);
+}
+
+
+esp_loader_error_t loader_flash_end_cmd(bool stay_in_loader)
+{
+    return end_command(FLASH_END, stay_in_loader);
+}
+
+
+esp_loader_error_t loader_flash_defl_begin_cmd(uint32_t offset,
+                                               uint32_t write_size,
+                                               uint32_t block_size,
+                                               uint32_t blocks_to_write,
+                                               target_chip_t target)
+{
+    return begin_command(FLASH_DEFL_BEGIN, offset, write_size, block_size, blocks_to_write, target);
+}
+
+
+esp_loader_error_t loader_flash_defl_data_cmd(const uint8_t *data, uint32_t size)
+{
+    return data_command(FLASH_DEFL_DATA, data, size);
+}
+
+
+esp_loader_error_t loader_flash_defl_data_submit(const uint8_t *data, uint32_t size)
+{
+    return submit_data_command(FLASH_DEFL_DATA, data, size);
+}
+
+
+esp_loader_error_t loader_flash_defl_end_cmd(bool stay_in_loader)
+{
+    return end_command(FLASH_DEFL_END, stay_in_loader);
+}
+
+
+esp_loader_error_t loader_mem_begin_cmd(uint32_t offset,
+                                        uint32_t size,
+                                        uint32_t block_size,
+                                        uint32_t blocks_to_write,
+                                        target_chip_t target)
+{
+    return begin_command(MEM_BEGIN, offset, size, block_size, blocks_to_write, target);
+}
+
+
+esp_loader_error_t loader_mem_data_cmd(const uint8_t *data, uint32_t size)
+{
+    return data_command(MEM_DATA, data, size);
+}
+
+
+esp_loader_error_t loader_mem_end_cmd(uint32_t entry_point)
+{
+    mem_end_command_t end_cmd = {
+        .common = {
+            .direction = WRITE_DIRECTION,
+            .command = MEM_END,
+            .size = CMD_SIZE(end_cmd),
+            .checksum = 0
+        },
+        .stay_in_loader = (entry_point == 0),
+        .entry_point_address = entry_point
+    };
+
+    return send_cmd(&end_cmd, sizeof(end_cmd), NULL);
+}
+
+
+esp_loader_error_t loader_stub_greeting(void)
+{
+    static const uint8_t STUB_GREETING[4] = { 'O', 'H', 'A', 'I' };
+    uint8_t greeting[sizeof(STUB_GREETING)];
+
+    RETURN_ON_ERROR( SLIP_receive_packet(greeting, sizeof(greeting)) );
+
+    if (memcmp(greeting, STUB_GREETING, sizeof(greeting)) != 0) {
+        return ESP_LOADER_ERROR_INVALID_RESPONSE;
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+
+void loader_flush_input(void)
+{
+    serial_comm_t *comm = loader_serial_comm();
+
+    comm->rx_head = 0;
+    comm->rx_tail = 0;
+    SLIP_reset(comm);
+    loader_port_flush_input();
+}
+
+
+uint32_t loader_get_round_trips(void)
+{
+    return loader_serial_comm()->round_trips;
+}
+
+
+void loader_reset_round_trips(void)
+{
+    loader_serial_comm()->round_trips = 0;
+}
+
+
+void loader_set_stub_running(bool running)
+{
+    loader_serial_comm()->stub_running = running;
+}
+
+
+bool loader_is_stub_running(void)
+{
+    return loader_serial_comm()->stub_running;
+}
+
+
 esp_loader_error_t loader_sync_cmd(void)
 {
     sync_command_t sync_cmd = {
@@ -347,7 +824,7 @@ esp_loader_error_t loader_write_reg_cmd(uint32_t address, uint32_t value,
 }
 
 
-esp_loader_error_t loader_read_reg_cmd(uint32_t address, uint32_t *reg)
+esp_loader_error_t loader_read_reg_submit(uint32_t address)
 {
     read_reg_command_t read_cmd = {
         .common = {
@@ -359,7 +836,15 @@ esp_loader_error_t loader_read_reg_cmd(uint32_t address, uint32_t *reg)
         .address = address,
     };
 
-    return send_cmd(&read_cmd, sizeof(read_cmd), reg);
+    return loader_engine_submit(&read_cmd, sizeof(read_cmd), NULL, 0, sizeof(response_t));
+}
+
+
+esp_loader_error_t loader_read_reg_cmd(uint32_t address, uint32_t *reg)
+{
+    RETURN_ON_ERROR( loader_read_reg_submit(address) );
+
+    return engine_wait(reg);
 }
 
 
@@ -379,7 +864,7 @@ esp_loader_error_t loader_spi_attach_cmd(uint32_t config)
     return send_cmd(&attach_cmd, sizeof(attach_cmd), NULL);
 }
 
-esp_loader_error_t loader_change_baudrate_cmd(uint32_t baudrate)
+esp_loader_error_t loader_change_baudrate_cmd(uint32_t baudrate, uint32_t old_baudrate)
 {
     change_baudrate_command_t baudrate_cmd = {
         .common = {
@@ -389,13 +874,13 @@ esp_loader_error_t loader_change_baudrate_cmd(uint32_t baudrate)
             .checksum = 0
         },
         .new_baudrate = baudrate,
-        .old_baudrate = 0 // ESP32 ROM only
+        .old_baudrate = old_baudrate // Stub only, ROM expects 0
     };
 
     return send_cmd(&baudrate_cmd, sizeof(baudrate_cmd), NULL);
 }
 
-esp_loader_error_t loader_md5_cmd(uint32_t address, uint32_t size, uint8_t *md5_out)
+esp_loader_error_t loader_md5_cmd(uint32_t address, uint32_t size, uint8_t md5_out[16])
 {
     spi_flash_md5_command_t md5_cmd = {
         .common = {
@@ -413,6 +898,63 @@ esp_loader_error_t loader_md5_cmd(uint32_t address, uint32_t size, uint8_t *md5_
     return send_cmd_md5(&md5_cmd, sizeof(md5_cmd), md5_out);
 }
 
+esp_loader_error_t loader_erase_region_cmd(uint32_t offset, uint32_t size)
+{
+    erase_region_command_t erase_cmd = {
+        .common = {
+            .direction = WRITE_DIRECTION,
+            .command = ERASE_REGION,
+            .size = CMD_SIZE(erase_cmd),
+            .checksum = 0
+        },
+        .offset = offset,
+        .size = size
+    };
+
+    return send_cmd(&erase_cmd, sizeof(erase_cmd), NULL);
+}
+
+esp_loader_error_t loader_read_flash_cmd(uint32_t address, uint32_t size,
+                                         uint32_t packet_size, uint32_t max_in_flight)
+{
+    read_flash_command_t read_cmd = {
+        .common = {
+            .direction = WRITE_DIRECTION,
+            .command = READ_FLASH,
+            .size = CMD_SIZE(read_cmd),
+            .checksum = 0
+        },
+        .address = address,
+        .size = size,
+        .packet_size = packet_size,
+        .max_in_flight = max_in_flight
+    };
+
+    return send_cmd(&read_cmd, sizeof(read_cmd), NULL);
+}
+
+esp_loader_error_t loader_read_flash_data(uint8_t *data, uint32_t size, uint32_t *received)
+{
+    RETURN_ON_ERROR( SLIP_receive_frame(data, size, received) );
+
+    return (*received <= size) ? ESP_LOADER_SUCCESS : ESP_LOADER_ERROR_INVALID_RESPONSE;
+}
+
+esp_loader_error_t loader_read_flash_ack(uint32_t total_received)
+{
+    // Bare frame with the byte count, stub keeps at most max_in_flight packets unacknowledged
+    return SLIP_send_frame(&total_received, sizeof(total_received), NULL, 0);
+}
+
+esp_loader_error_t loader_read_flash_digest(uint8_t md5[16])
+{
+    uint32_t length;
+
+    RETURN_ON_ERROR( SLIP_receive_frame(md5, 16, &length) );
+
+    return (length == 16) ? ESP_LOADER_SUCCESS : ESP_LOADER_ERROR_INVALID_RESPONSE;
+}
+
 esp_loader_error_t loader_spi_parameters(uint32_t total_size)
 {
     write_spi_command_t spi_cmd = {
@@ -433,6 +975,31 @@ esp_loader_error_t loader_spi_parameters(uint32_t total_size)
     return send_cmd(&spi_cmd, sizeof(spi_cmd), NULL);
 }
 
+__attribute__ ((weak)) esp_loader_error_t loader_port_serial_read_some(uint8_t *data, uint16_t size,
+                                                                      uint16_t *received, uint32_t timeout)
+{
+    *received = 0;
+    RETURN_ON_ERROR( loader_port_serial_read(data, 1, timeout) );
+    *received = 1;
+
+    return ESP_LOADER_SUCCESS;
+}
+
+__attribute__ ((weak)) esp_loader_error_t loader_port_serial_write_some(const uint8_t *data, uint16_t size,
+                                                                       uint16_t *written)
+{
+    *written = 0;
+    RETURN_ON_ERROR( loader_port_serial_write(data, size, loader_port_remaining_time()) );
+    *written = size;
+
+    return ESP_LOADER_SUCCESS;
+}
+
+__attribute__ ((weak)) void loader_port_flush_input(void)
+{
+
+}
+
 __attribute__ ((weak)) void loader_port_debug_print(const char *str)
 {
 
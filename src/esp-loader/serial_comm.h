@@ -27,22 +27,72 @@ esp_loader_error_t loader_flash_begin_cmd(uint32_t offset, uint32_t erase_size,
 
 esp_loader_error_t loader_flash_data_cmd(const uint8_t *data, uint32_t size);
 
+esp_loader_error_t loader_flash_data_submit(const uint8_t *data, uint32_t size);
+
 esp_loader_error_t loader_flash_end_cmd(bool stay_in_loader);
 
+esp_loader_error_t loader_flash_defl_begin_cmd(uint32_t offset, uint32_t write_size, uint32_t block_size, uint32_t blocks_to_write, target_chip_t target);
+
+esp_loader_error_t loader_flash_defl_data_cmd(const uint8_t *data, uint32_t size);
+
+esp_loader_error_t loader_flash_defl_data_submit(const uint8_t *data, uint32_t size);
+
+esp_loader_error_t loader_flash_defl_end_cmd(bool stay_in_loader);
+
+esp_loader_error_t loader_mem_begin_cmd(uint32_t offset, uint32_t size, uint32_t block_size, uint32_t blocks_to_write, target_chip_t target);
+
+esp_loader_error_t loader_mem_data_cmd(const uint8_t *data, uint32_t size);
+
+esp_loader_error_t loader_mem_end_cmd(uint32_t entry_point);
+
+esp_loader_error_t loader_stub_greeting(void);
+
+void loader_set_stub_running(bool running);
+
+bool loader_is_stub_running(void);
+
+uint32_t loader_get_round_trips(void);
+
+void loader_reset_round_trips(void);
+
 esp_loader_error_t loader_write_reg_cmd(uint32_t address, uint32_t value, uint32_t mask, uint32_t delay_us);
 
 esp_loader_error_t loader_read_reg_cmd(uint32_t address, uint32_t *reg);
 
+esp_loader_error_t loader_read_reg_submit(uint32_t address);
+
 esp_loader_error_t loader_sync_cmd(void);
 
 esp_loader_error_t loader_spi_attach_cmd(uint32_t config);
 
-esp_loader_error_t loader_change_baudrate_cmd(uint32_t baudrate);
+esp_loader_error_t loader_change_baudrate_cmd(uint32_t baudrate, uint32_t old_baudrate);
+
+esp_loader_error_t loader_md5_cmd(uint32_t address, uint32_t size, uint8_t md5_out[16]);
+
+esp_loader_error_t loader_erase_region_cmd(uint32_t offset, uint32_t size);
+
+esp_loader_error_t loader_read_flash_cmd(uint32_t address, uint32_t size, uint32_t packet_size, uint32_t max_in_flight);
+
+esp_loader_error_t loader_read_flash_data(uint8_t *data, uint32_t size, uint32_t *received);
+
+esp_loader_error_t loader_read_flash_ack(uint32_t total_received);
 
-esp_loader_error_t loader_md5_cmd(uint32_t address, uint32_t size, uint8_t *md5_out);
+esp_loader_error_t loader_read_flash_digest(uint8_t md5[16]);
 
 esp_loader_error_t loader_spi_parameters(uint32_t total_size);
 
+void loader_flush_input(void);
+
+esp_loader_error_t loader_engine_submit(const void *cmd_data, uint32_t cmd_size, const void *data, uint32_t data_size, uint32_t response_size);
+
+esp_loader_async_state_t loader_engine_step(void);
+
+uint32_t loader_engine_feed(const uint8_t *data, uint32_t size);
+
+esp_loader_async_state_t loader_engine_state(void);
+
+esp_loader_error_t loader_engine_result(uint32_t *reg_value);
+
 #ifdef __cplusplus
 }
 #endif
@@ -17,6 +17,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include "esp_loader.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -49,6 +50,8 @@ typedef enum __attribute__((packed))
     FLASH_DEFL_DATA  = 0x11,
     FLASH_DEFL_END   = 0x12,
     SPI_FLASH_MD5    = 0x13,
+    ERASE_REGION     = 0xd1, // Stub only
+    READ_FLASH       = 0xd2, // Stub only
 } command_t;
 
 typedef enum __attribute__((packed))
@@ -147,6 +150,22 @@ typedef struct __attribute__((packed))
     uint32_t reserved_1;
 } spi_flash_md5_command_t;
 
+typedef struct __attribute__((packed))
+{
+    command_common_t common;
+    uint32_t offset;
+    uint32_t size;
+} erase_region_command_t;
+
+typedef struct __attribute__((packed))
+{
+    command_common_t common;
+    uint32_t address;
+    uint32_t size;
+    uint32_t packet_size;
+    uint32_t max_in_flight;
+} read_flash_command_t;
+
 typedef struct __attribute__((packed))
 {
     uint8_t direction;
@@ -174,6 +193,13 @@ typedef struct __attribute__((packed))
     response_status_t status;
 } rom_md5_response_t;
 
+typedef struct __attribute__((packed))
+{
+    common_response_t common;
+    uint8_t md5[16];           // Stub only
+    response_status_t status;
+} stub_md5_response_t;
+
 typedef struct __attribute__((packed))
 {
     command_common_t common;
@@ -186,6 +212,45 @@ typedef struct __attribute__((packed))
 } write_spi_command_t;
 
 
+// Largest payload of a single command: a 16KB stub flash block
+#define MAX_PAYLOAD_SIZE 0x4000
+// Whole frame in the worst case: every byte escaped, plus both delimiters
+#define WIRE_BUFFER_SIZE (2 + 2 * (sizeof(data_command_t) + MAX_PAYLOAD_SIZE))
+// Received bytes not decoded yet. Refilled in bulk from the port once drained.
+#define RX_BUFFER_SIZE 1024
+// Largest response the engine waits for: ROM MD5 with hex digest and 4 byte status
+#define RESPONSE_BUFFER_SIZE 64
+
+// Protocol state of one connection, kept in the loader context so that
+// several targets can be served at the same time.
+typedef struct
+{
+    uint32_t sequence_number;
+    uint32_t round_trips;
+    bool stub_running;
+    uint32_t wire_length;
+    uint32_t wire_sent;     // Bytes of the wire buffer the port took so far
+    uint32_t rx_head;
+    uint32_t rx_tail;
+    // SLIP decoder, kept between calls so frames can arrive in pieces
+    bool in_frame;
+    bool escaped;
+    uint32_t decoded;
+    // Command in flight
+    esp_loader_async_state_t state;
+    uint8_t command;
+    uint32_t response_size;
+    uint32_t reg_value;
+    esp_loader_error_t result;
+    uint8_t response[RESPONSE_BUFFER_SIZE];
+    uint8_t rx_buffer[RX_BUFFER_SIZE];
+    uint8_t wire_buffer[WIRE_BUFFER_SIZE];
+} serial_comm_t;
+
+// Protocol state of the loader context bound to the calling task
+serial_comm_t *loader_serial_comm(void);
+
+
 #ifdef __cplusplus
 }
 #endif
@@ -40,6 +40,22 @@ esp_loader_error_t loader_port_change_baudrate(uint32_t baudrate);
   */
 esp_loader_error_t loader_port_serial_write(const uint8_t *data, uint16_t size, uint32_t timeout);
 
+/**
+  * @brief Writes as much of data as serial interface takes without waiting,
+  *        possibly nothing. Used by the non-blocking engine.
+  *
+  * @note  Weak function writing all data with loader_port_serial_write is used, otherwise.
+  *
+  * @param data[in]      Buffer with data to be written.
+  * @param size[in]      Size of data in bytes.
+  * @param written[out]  Number of bytes taken.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_FAIL Write failed
+  */
+esp_loader_error_t loader_port_serial_write_some(const uint8_t *data, uint16_t size, uint16_t *written);
+
 /**
   * @brief Reads data from serial interface.
   *
@@ -53,6 +69,30 @@ esp_loader_error_t loader_port_serial_write(const uint8_t *data, uint16_t size,
   */
 esp_loader_error_t loader_port_serial_read(uint8_t *data, uint16_t size, uint32_t timeout);
 
+/**
+  * @brief Reads whatever data serial interface has received, at most size bytes.
+  *        Waits for the first byte only, not at all with a zero timeout.
+  *
+  * @note  Weak function reading one byte with loader_port_serial_read is used, otherwise.
+  *
+  * @param data[out]      Buffer into which received data will be written.
+  * @param size[in]       Size of the buffer in bytes.
+  * @param received[out]  Number of bytes read.
+  * @param timeout[in]    Timeout in milliseconds.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout elapsed
+  */
+esp_loader_error_t loader_port_serial_read_some(uint8_t *data, uint16_t size, uint16_t *received, uint32_t timeout);
+
+/**
+  * @brief Drops whatever serial interface has received and not been read yet.
+  *
+  * @note  Weak function doing nothing is used, otherwise.
+  */
+void loader_port_flush_input(void);
+
 /**
   * @brief Delay in milliseconds.
   *
@@ -100,6 +140,15 @@ void loader_port_reset_target(void);
   */
 void loader_port_debug_print(const char *str);
 
+/**
+  * @brief Returns port instance of the loader context bound to the calling task,
+  *        as given to esp_loader_create(). Provided by the loader, so ports
+  *        serving more than one target can tell which one the call is for.
+  *
+  * @return  Port instance, NULL for the default context.
+  */
+void *loader_port_instance(void);
+
 #ifdef __cplusplus
 }
 #endif